@@ -0,0 +1,7 @@
+#!/bin/sh
+# generate a self-signed certificate for local HTTPS testing
+cd "$(dirname "$0")" || exit 1
+openssl req -x509 -newkey rsa:2048 -nodes -days 365 \
+    -keyout server.key -out server.crt \
+    -subj "/CN=localhost" \
+    -addext "subjectAltName=DNS:localhost,IP:127.0.0.1"
@@ -0,0 +1,38 @@
+#!/usr/bin/env python3
+# compare two result files of bench/run.sh, scenario by scenario
+import json
+import sys
+
+
+def load(path):
+    runs = {}
+    with open(path) as f:
+        for line in f:
+            if line.strip():
+                r = json.loads(line)
+                runs[r["scenario"]] = r
+    return runs
+
+
+def change(old, new):
+    return "%+.1f%%" % ((new - old) * 100.0 / old) if old else "n/a"
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: %s before.jsonl after.jsonl" % sys.argv[0])
+    before, after = load(sys.argv[1]), load(sys.argv[2])
+    print("%-10s %12s %9s %10s %9s %10s %9s" %
+          ("scenario", "req/s", "", "MB/s", "", "p99 us", ""))
+    for name in before:
+        if name not in after:
+            continue
+        b, a = before[name], after[name]
+        print("%-10s %12.0f %9s %10.1f %9s %10d %9s" %
+              (name, a["rps"], change(b["rps"], a["rps"]), a["mbps"],
+               change(b["mbps"], a["mbps"]), a["p99_us"],
+               change(b["p99_us"], a["p99_us"])))
+
+
+if __name__ == "__main__":
+    main()
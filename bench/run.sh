@@ -0,0 +1,71 @@
+#!/bin/bash
+# run every benchmark scenario against a fresh wuw_server and append the
+# results to bench/results/<date>-<commit>.jsonl
+#
+#   BENCH_SECONDS   duration of each scenario (default 10)
+#   BENCH_CONNS     concurrent connections (default 64)
+#   BENCH_THREADS   load generator threads (default 2)
+#   BENCH_IDLE      silent connections of the idle scenario (default 1000)
+#   SERVER_ARGS     extra arguments of wuw_server, e.g. "-w 4"
+#   SCENARIOS       subset to run, e.g. "small large"
+set -e
+
+cd "$(dirname "$0")/.."
+SECONDS_EACH=${BENCH_SECONDS:-10}
+CONNS=${BENCH_CONNS:-64}
+THREADS=${BENCH_THREADS:-2}
+IDLE=${BENCH_IDLE:-1000}
+SCENARIOS=${SCENARIOS:-"small large listing upload close idle"}
+PORT=12306
+FIXTURES=htdocs/__bench
+BENCH=bench/wuw_bench
+
+mkdir -p bench/results
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+RESULTS=${BENCH_RESULTS:-bench/results/$(date +%Y%m%d-%H%M%S)-$COMMIT.jsonl}
+
+# the idle scenario holds many descriptors on both sides
+ulimit -n 65536 2>/dev/null || ulimit -n "$(ulimit -Hn)" 2>/dev/null || true
+
+# fixtures: a small page, a large file, a big directory and an upload target
+rm -rf $FIXTURES
+mkdir -p $FIXTURES/dir $FIXTURES/upload
+head -c 1024 /dev/urandom | base64 > $FIXTURES/small.html
+head -c $((16 << 20)) /dev/urandom > $FIXTURES/large.bin
+i=0
+while [ $i -lt 2000 ]; do
+    : > $FIXTURES/dir/file-$i.txt
+    i=$((i + 1))
+done
+
+./wuw_server $SERVER_ARGS > bench/results/server.log 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; wait $SERVER 2>/dev/null || true; rm -rf $FIXTURES' EXIT INT TERM
+# wait for the listener
+i=0
+until (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null || [ $i -ge 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+
+run() {
+    name=$1
+    shift
+    # one failed scenario doesn't stop the others
+    $BENCH -p $PORT -t $THREADS -d $SECONDS_EACH -n $name -o "$RESULTS" "$@" \
+        || echo "scenario $name failed" >&2
+}
+
+for s in $SCENARIOS; do
+    case $s in
+        small) run small -c $CONNS /__bench/small.html ;;
+        large) run large -c $CONNS /__bench/large.bin ;;
+        listing) run listing -c $CONNS /__bench/dir ;;
+        upload) run upload -c $CONNS -u 65536 /__bench/upload/ ;;
+        close) run close -c $CONNS -C /__bench/small.html ;;
+        idle) run idle -c $CONNS -i $IDLE /__bench/small.html ;;
+        *) echo "unknown scenario $s" >&2 ;;
+    esac
+done
+
+echo "results appended to $RESULTS"
@@ -0,0 +1,560 @@
+// load generator for wuw_server: keeps connections busy with one request
+// at a time for a fixed duration, then reports throughput and latency
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+// latency buckets per power of two, as 1 << BENCH_SUB_BITS
+#define BENCH_SUB_BITS 4
+// latencies are recorded in microseconds, up to 2^BENCH_MAX_BITS of them
+#define BENCH_MAX_BITS 34
+#define BENCH_BUCKETS ((BENCH_MAX_BITS - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS)
+// multipart boundary of generated uploads
+#define BENCH_BOUNDARY "wuwbenchboundary7MA4YWxkTrZu0gW"
+// longest response header line accepted
+#define BENCH_LINE_MAX (1 << 13)
+// pause before replacing a connection that failed to connect
+#define BENCH_RETRY_MSEC 10
+
+// what one run does, from the command line
+typedef struct bench_config_t {
+    const char* addr;
+    int port;
+    int conns;
+    int threads;
+    int seconds;
+    int close;       // one request per connection
+    size_t upload;   // POST a multipart body of this size instead of GET
+    int idle;        // connections opened and left silent
+    const char* path;
+    const char* name;
+    const char* output;
+} bench_config_t;
+
+// response parser states
+enum bench_state {
+    STATE_STATUS = 0,
+    STATE_HEADERS,
+    STATE_BODY,
+    STATE_CHUNK_SIZE,
+    STATE_CHUNK_DATA,
+    STATE_CHUNK_END,
+    STATE_TRAILER,
+    STATE_UNTIL_CLOSE
+};
+
+typedef struct bench_thread_t bench_thread_t;
+
+typedef struct bench_conn_t {
+    bench_thread_t* thread;
+    struct bufferevent* bev;
+    enum bench_state state;
+    int64_t remaining;
+    int status;
+    int close;
+    int chunked;
+    uint64_t started;
+} bench_conn_t;
+
+// counters of one thread, merged once the run is over
+struct bench_thread_t {
+    pthread_t id;
+    struct event_base* base;
+    struct event* stop;
+    int active;
+    int stopping;
+    int conns;
+    int idle;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t latency_max;
+    uint64_t latency[BENCH_BUCKETS];
+    bench_conn_t** idle_conns;
+};
+
+static bench_config_t config = {
+    .addr = "127.0.0.1",
+    .port = 12306,
+    .conns = 64,
+    .threads = 2,
+    .seconds = 10,
+    .path = "/",
+    .name = "custom",
+};
+static struct sockaddr_in server;
+// request head and body shared by every connection
+static char* request_head;
+static size_t request_head_len;
+static char* request_body;
+static size_t request_body_len;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// log-linear bucket of a latency, as the server's /__stats does
+static int bucket_of(uint64_t us) {
+    if (us >> BENCH_MAX_BITS)
+        us = (1ULL << BENCH_MAX_BITS) - 1;
+    if (us < (2U << BENCH_SUB_BITS))
+        return (int)us;
+    int shift = 63 - __builtin_clzll(us) - BENCH_SUB_BITS;
+    return (shift << BENCH_SUB_BITS) + (int)(us >> shift);
+}
+
+static uint64_t bucket_upper(int i) {
+    int shift = (i >> BENCH_SUB_BITS) - 1;
+    if (shift <= 0)
+        return i;
+    uint64_t m = (i & ((1 << BENCH_SUB_BITS) - 1)) | (1 << BENCH_SUB_BITS);
+    return ((m + 1) << shift) - 1;
+}
+
+static void build_request(void) {
+    if (config.upload == 0) {
+        request_head_len = asprintf(
+            &request_head, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", config.path,
+            config.addr, config.close ? "Connection: close\r\n" : "");
+        return;
+    }
+    // multipart body carrying one file of config.upload bytes
+    char* pre = NULL;
+    const char* post = "\r\n--" BENCH_BOUNDARY "--\r\n";
+    int pre_len = asprintf(&pre,
+                           "--" BENCH_BOUNDARY "\r\n"
+                           "Content-Disposition: form-data; name=\"file\"; "
+                           "filename=\"bench.bin\"\r\n"
+                           "Content-Type: application/octet-stream\r\n\r\n");
+    request_body_len = pre_len + config.upload + strlen(post);
+    request_body = (char*)malloc(request_body_len);
+    memcpy(request_body, pre, pre_len);
+    // printable filler, which can't contain the boundary
+    for (size_t i = 0; i < config.upload; i++)
+        request_body[pre_len + i] = 'a' + i % 26;
+    memcpy(request_body + pre_len + config.upload, post, strlen(post));
+    free(pre);
+    request_head_len = asprintf(
+        &request_head,
+        "POST %s HTTP/1.1\r\nHost: %s\r\n%s"
+        "Content-Type: multipart/form-data; boundary=" BENCH_BOUNDARY "\r\n"
+        "Content-Length: %zu\r\n\r\n",
+        config.path, config.addr, config.close ? "Connection: close\r\n" : "",
+        request_body_len);
+}
+
+static void conn_start(bench_thread_t* t);
+static void retry_cb(evutil_socket_t fd, short events, void* arg);
+
+static void conn_free(bench_conn_t* c) {
+    bench_thread_t* t = c->thread;
+    bufferevent_free(c->bev);
+    free(c);
+    t->active--;
+    if (t->stopping && t->active == 0)
+        event_base_loopexit(t->base, NULL);
+}
+
+static void send_request(bench_conn_t* c) {
+    c->state = STATE_STATUS;
+    c->close = config.close;
+    c->chunked = 0;
+    c->started = now_us();
+    struct evbuffer* out = bufferevent_get_output(c->bev);
+    evbuffer_add_reference(out, request_head, request_head_len, NULL, NULL);
+    if (request_body_len > 0)
+        evbuffer_add_reference(out, request_body, request_body_len, NULL, NULL);
+}
+
+// count a complete response, returns 0 if c was freed and 1 if it carries
+// on with the next request
+static int response_done(bench_conn_t* c) {
+    bench_thread_t* t = c->thread;
+    uint64_t us = now_us() - c->started;
+    if (c->status >= 200 && c->status < 400) {
+        t->requests++;
+        t->latency[bucket_of(us)]++;
+        if (us > t->latency_max)
+            t->latency_max = us;
+    } else {
+        t->errors++;
+    }
+    if (c->close || t->stopping) {
+        conn_free(c);
+        if (!t->stopping)
+            conn_start(t);
+        return 0;
+    }
+    send_request(c);
+    return 1;
+}
+
+static void retry_cb(evutil_socket_t fd, short events, void* arg) {
+    (void)fd;
+    (void)events;
+    bench_thread_t* t = (bench_thread_t*)arg;
+    if (!t->stopping)
+        conn_start(t);
+}
+
+static void fail(bench_conn_t* c) {
+    bench_thread_t* t = c->thread;
+    // a refused connect would otherwise be retried in a tight loop
+    int connected = (c->started != 0);
+    t->errors++;
+    conn_free(c);
+    if (t->stopping)
+        return;
+    if (connected) {
+        conn_start(t);
+    } else {
+        struct timeval delay = {0, BENCH_RETRY_MSEC * 1000};
+        event_base_once(t->base, -1, EV_TIMEOUT, retry_cb, t, &delay);
+    }
+}
+
+// consume what is buffered: -1 on a malformed response, 0 once more input
+// is needed and after the last response of c, which is then freed
+static int parse(bench_conn_t* c, struct evbuffer* in) {
+    for (;;) {
+        char* line = NULL;
+        size_t len = 0;
+        if (c->state != STATE_BODY && c->state != STATE_CHUNK_DATA &&
+            c->state != STATE_UNTIL_CLOSE) {
+            line = evbuffer_readln(in, &len, EVBUFFER_EOL_CRLF);
+            if (line == NULL)
+                return evbuffer_get_length(in) > BENCH_LINE_MAX ? -1 : 0;
+        }
+        int done = 0;
+        switch (c->state) {
+            case STATE_STATUS:
+                if (len < 12 || strncmp(line, "HTTP/1.", 7)) {
+                    free(line);
+                    return -1;
+                }
+                c->status = atoi(line + 9);
+                c->remaining = -1;
+                c->state = STATE_HEADERS;
+                break;
+            case STATE_HEADERS:
+                if (len == 0) {
+                    if (c->chunked)
+                        c->state = STATE_CHUNK_SIZE;
+                    else if (c->remaining == 0)
+                        done = 1;
+                    else if (c->remaining > 0)
+                        c->state = STATE_BODY;
+                    else
+                        c->state = STATE_UNTIL_CLOSE;
+                } else if (!strncasecmp(line, "Content-Length:", 15)) {
+                    c->remaining = strtoll(line + 15, NULL, 10);
+                } else if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+                    c->chunked = (strcasestr(line, "chunked") != NULL);
+                } else if (!strncasecmp(line, "Connection:", 11) &&
+                           strcasestr(line, "close")) {
+                    c->close = 1;
+                }
+                break;
+            case STATE_CHUNK_SIZE:
+                c->remaining = strtoll(line, NULL, 16);
+                c->state = c->remaining > 0 ? STATE_CHUNK_DATA : STATE_TRAILER;
+                break;
+            case STATE_CHUNK_END:
+                c->state = STATE_CHUNK_SIZE;
+                break;
+            case STATE_TRAILER:
+                done = (len == 0);
+                break;
+            case STATE_BODY:
+            case STATE_CHUNK_DATA: {
+                int64_t n = evbuffer_get_length(in);
+                if (n > c->remaining)
+                    n = c->remaining;
+                evbuffer_drain(in, n);
+                c->remaining -= n;
+                if (c->remaining > 0)
+                    return 0;
+                if (c->state == STATE_CHUNK_DATA)
+                    c->state = STATE_CHUNK_END;
+                else
+                    done = 1;
+                break;
+            }
+            case STATE_UNTIL_CLOSE:
+                // the end of the body is the end of the connection
+                evbuffer_drain(in, evbuffer_get_length(in));
+                return 0;
+        }
+        free(line);
+        if (done && !response_done(c))
+            return 0;
+    }
+}
+
+static void read_cb(struct bufferevent* bev, void* arg) {
+    bench_conn_t* c = (bench_conn_t*)arg;
+    if (parse(c, bufferevent_get_input(bev)) < 0)
+        fail(c);
+}
+
+static void event_cb(struct bufferevent* bev, short events, void* arg) {
+    (void)bev;
+    bench_conn_t* c = (bench_conn_t*)arg;
+    if (events & BEV_EVENT_CONNECTED) {
+        int one = 1;
+        setsockopt(bufferevent_getfd(c->bev), IPPROTO_TCP, TCP_NODELAY, &one,
+                   sizeof(one));
+        send_request(c);
+        return;
+    }
+    if ((events & BEV_EVENT_EOF) && c->state == STATE_UNTIL_CLOSE) {
+        c->close = 1;
+        response_done(c);
+        return;
+    }
+    fail(c);
+}
+
+static void count_in_cb(struct evbuffer* buf,
+                        const struct evbuffer_cb_info* info, void* arg) {
+    (void)buf;
+    ((bench_thread_t*)arg)->bytes_in += info->n_added;
+}
+
+static void count_out_cb(struct evbuffer* buf,
+                         const struct evbuffer_cb_info* info, void* arg) {
+    (void)buf;
+    ((bench_thread_t*)arg)->bytes_out += info->n_deleted;
+}
+
+static bench_conn_t* conn_open(bench_thread_t* t) {
+    bench_conn_t* c = (bench_conn_t*)calloc(1, sizeof(bench_conn_t));
+    if (c == NULL)
+        return NULL;
+    c->thread = t;
+    c->bev = bufferevent_socket_new(t->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (c->bev == NULL) {
+        free(c);
+        return NULL;
+    }
+    bufferevent_setcb(c->bev, read_cb, NULL, event_cb, c);
+    evbuffer_add_cb(bufferevent_get_input(c->bev), count_in_cb, t);
+    evbuffer_add_cb(bufferevent_get_output(c->bev), count_out_cb, t);
+    bufferevent_enable(c->bev, EV_READ | EV_WRITE);
+    if (bufferevent_socket_connect(c->bev, (struct sockaddr*)&server,
+                                   sizeof(server)) < 0) {
+        bufferevent_free(c->bev);
+        free(c);
+        return NULL;
+    }
+    t->active++;
+    return c;
+}
+
+static void conn_start(bench_thread_t* t) {
+    if (conn_open(t) != NULL)
+        return;
+    t->errors++;
+    struct timeval delay = {0, BENCH_RETRY_MSEC * 1000};
+    event_base_once(t->base, -1, EV_TIMEOUT, retry_cb, t, &delay);
+}
+
+// an idle connection only connects, it is never asked anything
+static void idle_event_cb(struct bufferevent* bev, short events, void* arg) {
+    (void)bev;
+    (void)arg;
+    if (!(events & BEV_EVENT_CONNECTED))
+        fprintf(stderr, "idle connection lost\n");
+}
+
+static void stop_cb(evutil_socket_t fd, short events, void* arg) {
+    (void)fd;
+    (void)events;
+    bench_thread_t* t = (bench_thread_t*)arg;
+    t->stopping = 1;
+    for (int i = 0; i < t->idle; i++) {
+        if (t->idle_conns[i] != NULL) {
+            bufferevent_free(t->idle_conns[i]->bev);
+            free(t->idle_conns[i]);
+        }
+    }
+    // requests in flight get a second to finish
+    struct timeval grace = {1, 0};
+    if (t->active == 0)
+        event_base_loopexit(t->base, NULL);
+    else
+        event_base_loopexit(t->base, &grace);
+}
+
+static void* thread_run(void* arg) {
+    bench_thread_t* t = (bench_thread_t*)arg;
+    t->idle_conns = (bench_conn_t**)calloc(t->idle + 1, sizeof(bench_conn_t*));
+    for (int i = 0; i < t->idle; i++) {
+        bench_conn_t* c = (bench_conn_t*)calloc(1, sizeof(bench_conn_t));
+        c->thread = t;
+        c->bev = bufferevent_socket_new(t->base, -1, BEV_OPT_CLOSE_ON_FREE);
+        bufferevent_setcb(c->bev, NULL, NULL, idle_event_cb, c);
+        bufferevent_enable(c->bev, EV_READ);
+        bufferevent_socket_connect(c->bev, (struct sockaddr*)&server,
+                                   sizeof(server));
+        t->idle_conns[i] = c;
+    }
+    for (int i = 0; i < t->conns; i++)
+        conn_start(t);
+    struct timeval duration = {config.seconds, 0};
+    t->stop = evtimer_new(t->base, stop_cb, t);
+    evtimer_add(t->stop, &duration);
+    event_base_dispatch(t->base);
+    return NULL;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-a addr] [-p port] [-c conns] [-t threads] "
+            "[-d seconds] [-C] [-u upload_bytes] [-i idle] [-n name] "
+            "[-o results] path\n"
+            "  -C            close the connection after each request\n"
+            "  -u bytes      POST a multipart upload of bytes to path\n"
+            "  -i idle       extra connections that stay silent\n"
+            "  -o results    append the result as a JSON line\n",
+            prog);
+}
+
+static int parse_args(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:c:t:d:Cu:i:n:o:h")) != -1) {
+        switch (opt) {
+            case 'a': config.addr = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'c': config.conns = atoi(optarg); break;
+            case 't': config.threads = atoi(optarg); break;
+            case 'd': config.seconds = atoi(optarg); break;
+            case 'C': config.close = 1; break;
+            case 'u': config.upload = strtoull(optarg, NULL, 10); break;
+            case 'i': config.idle = atoi(optarg); break;
+            case 'n': config.name = optarg; break;
+            case 'o': config.output = optarg; break;
+            default: usage(argv[0]); return -1;
+        }
+    }
+    if (optind < argc)
+        config.path = argv[optind];
+    if (config.conns <= 0 || config.threads <= 0 || config.seconds <= 0 ||
+        config.threads > config.conns) {
+        usage(argv[0]);
+        return -1;
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.addr, &server.sin_addr) != 1) {
+        fprintf(stderr, "invalid address %s\n", config.addr);
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t quantile(const bench_thread_t* sum, uint64_t count, double q) {
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * count), seen = 0;
+    if (rank >= count)
+        rank = count - 1;
+    for (int i = 0; i < BENCH_BUCKETS; i++) {
+        seen += sum->latency[i];
+        if (seen > rank)
+            return bucket_upper(i) < sum->latency_max ? bucket_upper(i)
+                                                      : sum->latency_max;
+    }
+    return sum->latency_max;
+}
+
+static void report(const bench_thread_t* sum, double elapsed) {
+    uint64_t count = sum->requests;
+    double rps = count / elapsed;
+    // both directions, so uploads count what they send
+    double mbps = (sum->bytes_in + sum->bytes_out) / elapsed / (1 << 20);
+    uint64_t p50 = quantile(sum, count, 0.5), p90 = quantile(sum, count, 0.9),
+             p99 = quantile(sum, count, 0.99),
+             p999 = quantile(sum, count, 0.999);
+    printf("%-10s %10.0f req/s %9.1f MB/s  p50 %6" PRIu64 "us  p90 %6" PRIu64
+           "us  p99 %7" PRIu64 "us  p99.9 %7" PRIu64 "us  errors %" PRIu64
+           "\n",
+           config.name, rps, mbps, p50, p90, p99, p999, sum->errors);
+    if (config.output == NULL)
+        return;
+    FILE* out = fopen(config.output, "a");
+    if (out == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", config.output,
+                strerror(errno));
+        return;
+    }
+    fprintf(out,
+            "{\"scenario\":\"%s\",\"path\":\"%s\",\"time\":%ld,"
+            "\"connections\":%d,\"threads\":%d,\"keepalive\":%s,"
+            "\"upload\":%zu,\"idle\":%d,\"seconds\":%.3f,"
+            "\"requests\":%" PRIu64 ",\"errors\":%" PRIu64
+            ",\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64
+            ",\"rps\":%.1f,\"mbps\":%.2f,"
+            "\"p50_us\":%" PRIu64 ",\"p90_us\":%" PRIu64 ",\"p99_us\":%" PRIu64
+            ",\"p999_us\":%" PRIu64 ",\"max_us\":%" PRIu64 "}\n",
+            config.name, config.path, (long)time(NULL), config.conns,
+            config.threads, config.close ? "false" : "true", config.upload,
+            config.idle, elapsed, count, sum->errors, sum->bytes_in,
+            sum->bytes_out, rps, mbps,
+            p50, p90, p99, p999, sum->latency_max);
+    fclose(out);
+}
+
+int main(int argc, char** argv) {
+    if (parse_args(argc, argv) < 0)
+        return 1;
+    build_request();
+    bench_thread_t* threads =
+        (bench_thread_t*)calloc(config.threads, sizeof(bench_thread_t));
+    for (int i = 0; i < config.threads; i++) {
+        bench_thread_t* t = &threads[i];
+        t->base = event_base_new();
+        // connections are spread evenly, the first threads take the rest
+        t->conns = config.conns / config.threads +
+                   (i < config.conns % config.threads);
+        t->idle = config.idle / config.threads +
+                  (i < config.idle % config.threads);
+    }
+    uint64_t start = now_us();
+    for (int i = 0; i < config.threads; i++)
+        pthread_create(&threads[i].id, NULL, thread_run, &threads[i]);
+    bench_thread_t* sum = (bench_thread_t*)calloc(1, sizeof(bench_thread_t));
+    for (int i = 0; i < config.threads; i++) {
+        bench_thread_t* t = &threads[i];
+        pthread_join(t->id, NULL);
+        sum->requests += t->requests;
+        sum->errors += t->errors;
+        sum->bytes_in += t->bytes_in;
+        sum->bytes_out += t->bytes_out;
+        if (t->latency_max > sum->latency_max)
+            sum->latency_max = t->latency_max;
+        for (int b = 0; b < BENCH_BUCKETS; b++)
+            sum->latency[b] += t->latency[b];
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    // the grace period doesn't count, requests completed in it do
+    if (elapsed > config.seconds)
+        elapsed = config.seconds;
+    report(sum, elapsed);
+    return sum->requests == 0;
+}
@@ -0,0 +1,546 @@
+// microbenchmarks of the request parser and the response formatters: feeds
+// recorded request corpora through the server code over in-memory
+// bufferevents, and reports time, allocations and bytes copied per request
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include "http_functions.h"
+#include "http_response.h"
+
+// each case runs batches until it has taken this long, in milliseconds
+#define MICRO_TARGET_MS 200
+// runs of a calibrated case, the fastest counts
+#define MICRO_REPEATS 5
+// a case more than this factor slower than its baseline is a regression
+#define MICRO_TOLERANCE 1.10
+// cases run per invocation
+#define MICRO_CASES_MAX 256
+// requests kept per corpus
+#define MICRO_REQUESTS_MAX 4096
+// longest case name
+#define MICRO_NAME_LEN 64
+
+// what the process allocated and copied, counted by the allocator and
+// the copying functions interposed below. Copied bytes are those written by
+// memcpy, memmove, strcpy, stpcpy, strncpy, strdup and strndup, and the
+// output of snprintf, vsnprintf and strftime, wherever they are called from
+// outside libc. Only the main thread runs, no pool threads are started, so
+// plain counters do
+static struct {
+    uint64_t allocs;
+    uint64_t copied;
+} counters;
+
+extern void* __libc_malloc(size_t n);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t n);
+
+void* malloc(size_t n) {
+    counters.allocs++;
+    return __libc_malloc(n);
+}
+
+void* calloc(size_t n, size_t size) {
+    counters.allocs++;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t n) {
+    counters.allocs++;
+    return __libc_realloc(p, n);
+}
+
+// copies made before the real functions are looked up, volatile so the
+// compiler doesn't turn them back into memcpy calls
+static void* byte_move(void* dst, const void* src, size_t n) {
+    volatile char* d = (volatile char*)dst;
+    const volatile char* s = (const volatile char*)src;
+    if (d < s) {
+        for (size_t i = 0; i < n; i++)
+            d[i] = s[i];
+    } else {
+        while (n-- > 0)
+            d[n] = s[n];
+    }
+    return dst;
+}
+
+static void* (*real_memcpy)(void*, const void*, size_t);
+static void* (*real_memmove)(void*, const void*, size_t);
+
+__attribute__((constructor)) static void resolve_copies(void) {
+    real_memcpy = (void* (*)(void*, const void*, size_t))dlsym(RTLD_NEXT,
+                                                               "memcpy");
+    real_memmove = (void* (*)(void*, const void*, size_t))dlsym(RTLD_NEXT,
+                                                                "memmove");
+}
+
+// copies the compiler inlines, of small constant sizes, aren't seen
+void* memcpy(void* dst, const void* src, size_t n) {
+    counters.copied += n;
+    return real_memcpy ? real_memcpy(dst, src, n) : byte_move(dst, src, n);
+}
+
+void* memmove(void* dst, const void* src, size_t n) {
+    counters.copied += n;
+    return real_memmove ? real_memmove(dst, src, n) : byte_move(dst, src, n);
+}
+
+// what libraries built with _FORTIFY_SOURCE call instead
+void* __memcpy_chk(void* dst, const void* src, size_t n, size_t dst_len) {
+    if (n > dst_len)
+        abort();
+    return memcpy(dst, src, n);
+}
+
+void* __memmove_chk(void* dst, const void* src, size_t n, size_t dst_len) {
+    if (n > dst_len)
+        abort();
+    return memmove(dst, src, n);
+}
+
+// libc copies inside its own functions don't go through the symbols above,
+// so the string functions the server formats and copies with are counted
+// by what they write. The real ones are looked up on first use
+#define REAL(fn)                                     \
+    static __typeof__(&fn) real_##fn;                \
+    if (real_##fn == NULL)                           \
+        real_##fn = (__typeof__(&fn))dlsym(RTLD_NEXT, #fn)
+
+char* strcpy(char* dst, const char* src) {
+    REAL(strcpy);
+    counters.copied += strlen(src) + 1;
+    return real_strcpy(dst, src);
+}
+
+char* stpcpy(char* dst, const char* src) {
+    REAL(stpcpy);
+    counters.copied += strlen(src) + 1;
+    return real_stpcpy(dst, src);
+}
+
+// the padding written after a short src counts too
+char* strncpy(char* dst, const char* src, size_t n) {
+    REAL(strncpy);
+    counters.copied += n;
+    return real_strncpy(dst, src, n);
+}
+
+char* strdup(const char* s) {
+    REAL(strdup);
+    counters.copied += strlen(s) + 1;
+    return real_strdup(s);
+}
+
+char* strndup(const char* s, size_t n) {
+    REAL(strndup);
+    counters.copied += strnlen(s, n) + 1;
+    return real_strndup(s, n);
+}
+
+// bytes vsnprintf put in a buffer of size, its terminator included
+static size_t formatted(int ret, size_t size) {
+    if (ret < 0 || size == 0)
+        return 0;
+    return (size_t)ret < size ? (size_t)ret + 1 : size;
+}
+
+int vsnprintf(char* s, size_t size, const char* fmt, va_list ap) {
+    REAL(vsnprintf);
+    int ret = real_vsnprintf(s, size, fmt, ap);
+    counters.copied += formatted(ret, size);
+    return ret;
+}
+
+int snprintf(char* s, size_t size, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = vsnprintf(s, size, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+int __vsnprintf_chk(char* s, size_t size, int flag, size_t slen,
+                    const char* fmt, va_list ap) {
+    (void)flag;
+    if (size > slen)
+        abort();
+    return vsnprintf(s, size, fmt, ap);
+}
+
+int __snprintf_chk(char* s, size_t size, int flag, size_t slen,
+                   const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = __vsnprintf_chk(s, size, flag, slen, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+size_t strftime(char* s, size_t max, const char* fmt, const struct tm* tm) {
+    REAL(strftime);
+    size_t n = real_strftime(s, max, fmt, tm);
+    counters.copied += n > 0 ? n + 1 : 0;
+    return n;
+}
+
+// recorded requests, bodyless and back to back as they came off the wire
+typedef struct micro_corpus_t {
+    char name[MICRO_NAME_LEN];
+    char* data;
+    size_t len;
+    // urls of its requests, for the cases after the parser
+    char* urls[MICRO_REQUESTS_MAX];
+    int count;
+} micro_corpus_t;
+
+// one measured case, run returns the requests a batch handled
+typedef struct micro_case_t {
+    char name[MICRO_NAME_LEN];
+    size_t (*run)(micro_corpus_t* corpus);
+    micro_corpus_t* corpus;
+} micro_case_t;
+
+typedef struct micro_result_t {
+    const char* name;
+    double ns;
+    double allocs;
+    double copied;
+    uint64_t requests;
+} micro_result_t;
+
+static struct {
+    int target_ms;
+    const char* output;
+    const char* baseline;
+    double tolerance;
+} config = {
+    .target_ms = MICRO_TARGET_MS,
+    .tolerance = MICRO_TOLERANCE,
+};
+
+// the connection requests are parsed on and responses written to, one end
+// of a bufferevent pair whose loop never runs
+static struct event_base* base;
+static bfevent_t* pair[2];
+static http_conn_t* conn;
+
+static micro_case_t cases[MICRO_CASES_MAX];
+static int case_count;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// throw away what responses queued on either end of the pair
+static void drain_output(void) {
+    struct evbuffer* out = bufferevent_get_output(pair[0]);
+    struct evbuffer* in = bufferevent_get_input(pair[1]);
+    evbuffer_drain(out, evbuffer_get_length(out));
+    evbuffer_drain(in, evbuffer_get_length(in));
+}
+
+// parse every request of the corpus, as parse_http_header sees them after a
+// read. The corpus is referenced, so feeding it copies nothing
+static size_t run_parse(micro_corpus_t* corpus) {
+    struct evbuffer* input = bufferevent_get_input(conn->bev);
+    evbuffer_add_reference(input, corpus->data, corpus->len, NULL, NULL);
+    size_t n = 0;
+    while (evbuffer_get_length(input) > 0) {
+        if (parse_http_header(conn) != HTTP_PARSE_DONE) {
+            fprintf(stderr, "%s: request %zu doesn't parse\n", corpus->name,
+                    n);
+            exit(1);
+        }
+        http_conn_reset(conn);
+        n++;
+    }
+    return n;
+}
+
+static size_t run_path(micro_corpus_t* corpus) {
+    char path[MAX_PATH_LEN];
+    http_headers_t hdr;
+    http_headers_clear(&hdr);
+    for (int i = 0; i < corpus->count; i++) {
+        hdr.url = corpus->urls[i];
+        get_file_path_on_server(path, &hdr);
+    }
+    return corpus->count;
+}
+
+static size_t run_content_type(micro_corpus_t* corpus) {
+    char extension[MAX_PATH_LEN];
+    const char* volatile type;
+    for (int i = 0; i < corpus->count; i++) {
+        get_file_extension(corpus->urls[i], extension);
+        type = get_content_type(extension);
+    }
+    (void)type;
+    return corpus->count;
+}
+
+// validators of a typical file, for the formatters that send them
+static http_validators_t validators;
+
+static size_t run_ok_send_file(micro_corpus_t* corpus) {
+    (void)corpus;
+    http_ok_send_file(pair[0], 12345, "html", &validators, 1);
+    drain_output();
+    return 1;
+}
+
+static size_t run_not_modified(micro_corpus_t* corpus) {
+    (void)corpus;
+    http_not_modified(pair[0], &validators, 1);
+    drain_output();
+    return 1;
+}
+
+static size_t run_not_found(micro_corpus_t* corpus) {
+    (void)corpus;
+    http_not_found(pair[0], 1);
+    drain_output();
+    return 1;
+}
+
+static size_t run_range_not_satisfiable(micro_corpus_t* corpus) {
+    (void)corpus;
+    http_range_not_satisfiable(pair[0], 12345, 1);
+    drain_output();
+    return 1;
+}
+
+static size_t run_stored(micro_corpus_t* corpus) {
+    (void)corpus;
+    http_stored(pair[0], HTTP_STATUS_CREATED, 1);
+    drain_output();
+    return 1;
+}
+
+static void add_case(const char* name, size_t (*run)(micro_corpus_t*),
+                     micro_corpus_t* corpus) {
+    if (case_count == MICRO_CASES_MAX) {
+        fprintf(stderr, "too many cases, %s left out\n", name);
+        return;
+    }
+    micro_case_t* c = &cases[case_count++];
+    if (corpus != NULL)
+        snprintf(c->name, sizeof(c->name), "%.31s/%.31s", name, corpus->name);
+    else
+        snprintf(c->name, sizeof(c->name), "%s", name);
+    c->run = run;
+    c->corpus = corpus;
+}
+
+// read a corpus and note the url of each of its requests
+static micro_corpus_t* load_corpus(const char* file) {
+    FILE* f = fopen(file, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", file, strerror(errno));
+        return NULL;
+    }
+    micro_corpus_t* corpus = (micro_corpus_t*)calloc(1, sizeof(*corpus));
+    size_t cap = 0;
+    for (;;) {
+        if (corpus->len == cap) {
+            cap = cap ? cap * 2 : (1 << 16);
+            corpus->data = (char*)realloc(corpus->data, cap);
+        }
+        size_t n = fread(corpus->data + corpus->len, 1, cap - corpus->len, f);
+        if (n == 0)
+            break;
+        corpus->len += n;
+    }
+    fclose(f);
+    const char* name = strrchr(file, '/');
+    name = name ? name + 1 : file;
+    snprintf(corpus->name, sizeof(corpus->name), "%.*s",
+             (int)strcspn(name, "."), name);
+
+    struct evbuffer* input = bufferevent_get_input(conn->bev);
+    evbuffer_add(input, corpus->data, corpus->len);
+    while (evbuffer_get_length(input) > 0 &&
+           corpus->count < MICRO_REQUESTS_MAX) {
+        int ret = parse_http_header(conn);
+        if (ret != HTTP_PARSE_DONE) {
+            fprintf(stderr, "%s: request %d is %s\n", file, corpus->count,
+                    ret == HTTP_PARSE_AGAIN ? "cut off" : "malformed");
+            return NULL;
+        }
+        corpus->urls[corpus->count++] = strdup(conn->hdr.url);
+        http_conn_reset(conn);
+    }
+    evbuffer_drain(input, evbuffer_get_length(input));
+    if (corpus->count == 0) {
+        fprintf(stderr, "%s holds no request\n", file);
+        return NULL;
+    }
+    return corpus;
+}
+
+// run batches of the case, doubling them until they take the target time,
+// then keep the fastest of MICRO_REPEATS runs of that many
+static void measure(micro_case_t* c, micro_result_t* r) {
+    uint64_t target = (uint64_t)config.target_ms * 1000000;
+    uint64_t batches = 1, best = UINT64_MAX, requests = 0;
+    c->run(c->corpus);
+    for (int repeat = 0; repeat < MICRO_REPEATS;) {
+        requests = 0;
+        counters.allocs = counters.copied = 0;
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < batches; i++)
+            requests += c->run(c->corpus);
+        uint64_t elapsed = now_ns() - start;
+        if (best == UINT64_MAX && elapsed < target) {
+            batches *= 2;
+            continue;
+        }
+        if (elapsed < best)
+            best = elapsed;
+        repeat++;
+    }
+    r->name = c->name;
+    r->requests = requests;
+    r->ns = (double)best / requests;
+    // the same in every run
+    r->allocs = (double)counters.allocs / requests;
+    r->copied = (double)counters.copied / requests;
+}
+
+static void report(const micro_result_t* r) {
+    printf("%-28s %10.1f ns/req %8.2f allocs/req %10.1f bytes copied/req\n",
+           r->name, r->ns, r->allocs, r->copied);
+    if (config.output == NULL)
+        return;
+    FILE* out = fopen(config.output, "a");
+    if (out == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", config.output,
+                strerror(errno));
+        return;
+    }
+    fprintf(out,
+            "{\"case\":\"%s\",\"time\":%ld,\"requests\":%" PRIu64
+            ",\"ns\":%.1f,\"allocs\":%.3f,\"copied\":%.1f}\n",
+            r->name, (long)time(NULL), r->requests, r->ns, r->allocs,
+            r->copied);
+    fclose(out);
+}
+
+// compare against the last result of the same case in the baseline file,
+// returns whether it regressed
+static int regressed(const micro_result_t* r) {
+    FILE* f = fopen(config.baseline, "r");
+    if (f == NULL)
+        return 0;
+    char line[512], key[MICRO_NAME_LEN + 16];
+    snprintf(key, sizeof(key), "{\"case\":\"%.*s\",", MICRO_NAME_LEN - 1,
+             r->name);
+    double ns = 0, allocs = 0, copied = 0;
+    int found = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        const char* p;
+        if (strncmp(line, key, strlen(key)) || (p = strstr(line, "\"ns\":")) ==
+                                                    NULL ||
+            sscanf(p, "\"ns\":%lf,\"allocs\":%lf,\"copied\":%lf", &ns, &allocs,
+                   &copied) != 3)
+            continue;
+        found = 1;
+    }
+    fclose(f);
+    if (!found)
+        return 0;
+    // time is noisy and gets the tolerance, allocations and copies are
+    // deterministic and may not grow at all
+    int slower = r->ns > ns * config.tolerance;
+    int more_allocs = r->allocs > allocs + 0.001;
+    int more_copies = r->copied > copied + 0.1;
+    if (slower || more_allocs || more_copies)
+        printf("REGRESSION %s: %.1f -> %.1f ns/req, %.2f -> %.2f allocs/req, "
+               "%.1f -> %.1f bytes copied/req\n",
+               r->name, ns, r->ns, allocs, r->allocs, copied, r->copied);
+    return slower || more_allocs || more_copies;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-t ms] [-o results] [-c baseline] [-x tolerance] "
+            "corpus...\n"
+            "  -t ms         time each run of a case takes (default %d)\n"
+            "  -o results    append the results as JSON lines\n"
+            "  -c baseline   fail when a case is slower than in baseline by "
+            "more than the tolerance, or allocates or copies more\n"
+            "  -x tolerance  factor of baseline time allowed (default %.2f)\n"
+            "  corpus        requests without bodies as sent on the wire, "
+            "e.g. bench/corpus/*.http\n",
+            prog, MICRO_TARGET_MS, MICRO_TOLERANCE);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:o:c:x:h")) != -1) {
+        switch (opt) {
+            case 't': config.target_ms = atoi(optarg); break;
+            case 'o': config.output = optarg; break;
+            case 'c': config.baseline = optarg; break;
+            case 'x': config.tolerance = atof(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind == argc || config.target_ms <= 0 || config.tolerance < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    // what main() of the server sets up for these paths
+    http_response_init();
+    base = event_base_new();
+    if (base == NULL || bufferevent_pair_new(base, 0, pair) < 0 ||
+        (conn = http_conn_new(base, pair[0])) == NULL) {
+        fprintf(stderr, "failed to set up the connection\n");
+        return 1;
+    }
+    // only the transport may add to a bufferevent's input, the corpora are
+    // fed here instead
+    evbuffer_unfreeze(bufferevent_get_input(pair[0]), 0);
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_size = 12345;
+    st.st_mtim.tv_sec = 1700000000;
+    http_validators_init(&validators, &st);
+
+    for (int i = optind; i < argc; i++) {
+        micro_corpus_t* corpus = load_corpus(argv[i]);
+        if (corpus == NULL)
+            return 1;
+        add_case("parse", run_parse, corpus);
+        add_case("path", run_path, corpus);
+        add_case("content_type", run_content_type, corpus);
+    }
+    add_case("resp/ok_send_file", run_ok_send_file, NULL);
+    add_case("resp/not_modified", run_not_modified, NULL);
+    add_case("resp/not_found", run_not_found, NULL);
+    add_case("resp/range_not_satisfiable", run_range_not_satisfiable, NULL);
+    add_case("resp/stored", run_stored, NULL);
+
+    int failed = 0;
+    for (int i = 0; i < case_count; i++) {
+        micro_result_t r;
+        measure(&cases[i], &r);
+        report(&r);
+        if (config.baseline != NULL)
+            failed |= regressed(&r);
+    }
+    return failed;
+}
@@ -0,0 +1,112 @@
+#include "http_access.h"
+#include "http_stats.h"
+#include "logger.h"
+
+// "[10/Oct/2000:13:55:36 +0000]" of the current second, per worker thread
+static __thread time_t clf_second = -1;
+static __thread char clf_time[40];
+
+// line being assembled, never longer than a log record
+typedef struct access_line_t {
+    char buf[LOG_RECORD_LEN];
+    size_t len;
+} access_line_t;
+
+static void put(access_line_t* l, const char* s, size_t len) {
+    // the last byte is kept for the newline
+    if (l->len + len > sizeof(l->buf) - 1)
+        len = sizeof(l->buf) - 1 - l->len;
+    memcpy(l->buf + l->len, s, len);
+    l->len += len;
+}
+
+static void put_str(access_line_t* l, const char* s) {
+    put(l, s, strlen(s));
+}
+
+// quoted field of the first len bytes at s, "-" when empty. Quotes,
+// backslashes and control characters are escaped as Apache does, so a
+// client can't forge lines
+static void put_quoted(access_line_t* l, const char* s, size_t len) {
+    put(l, "\"", 1);
+    if (len == 0)
+        put(l, "-", 1);
+    const char* end = s + len;
+    for (const char* run = s;; s++) {
+        unsigned char c = s < end ? (unsigned char)*s : '\0';
+        if (s < end && c != '"' && c != '\\' && c >= 0x20 && c < 0x7f)
+            continue;
+        put(l, run, s - run);
+        if (s == end)
+            break;
+        char esc[8];
+        if (c == '"' || c == '\\')
+            snprintf(esc, sizeof(esc), "\\%c", c);
+        else
+            snprintf(esc, sizeof(esc), "\\x%02x", c);
+        put_str(l, esc);
+        run = s + 1;
+    }
+    put(l, "\"", 1);
+}
+
+// a request header as a quoted field, cut at HTTP_HDR_LOG_LEN - 1 bytes
+static void put_header(access_line_t* l, const http_headers_t* hdr,
+                       enum http_header_id id) {
+    size_t len = hdr->known[id].len;
+    put_quoted(l, http_header(hdr, id),
+               len < HTTP_HDR_LOG_LEN ? len : HTTP_HDR_LOG_LEN - 1);
+}
+
+static const char* clf_now(void) {
+    time_t now = time(NULL);
+    if (now != clf_second) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(clf_time, sizeof(clf_time), "[%d/%b/%Y:%H:%M:%S +0000]",
+                 &tm);
+        clf_second = now;
+    }
+    return clf_time;
+}
+
+void http_access_log(http_conn_t* conn, uint64_t latency_us) {
+    http_headers_t* hdr = &conn->hdr;
+    access_line_t l;
+    l.len = 0;
+    char host[INET_ADDRSTRLEN];
+    if (inet_ntop(AF_INET, &conn->peer.sin_addr, host, sizeof(host)) == NULL)
+        snprintf(host, sizeof(host), "-");
+    put_str(&l, host);
+    put(&l, " - - ", 5);
+    put_str(&l, clf_now());
+    put(&l, " ", 1);
+
+    char request[HTTP_HDR_METHOD_LEN + HTTP_HDR_URL_LEN + MAX_LINE_LEN +
+                 HTTP_HDR_VERSION_LEN + 4];
+    snprintf(request, sizeof(request), "%s %s%s%s %s", hdr->method, hdr->url,
+             hdr->query[0] ? "?" : "", hdr->query, hdr->version);
+    put_quoted(&l, request, strlen(request));
+
+    // size of the body as the response declared it, whether or not it has
+    // been written yet. The head is not counted, and a HEAD gets no body
+    off_t bytes = hdr->mode == HEAD ? 0 : http_stats_last_body();
+    char fields[64];
+    int n = snprintf(fields, sizeof(fields), " %d ",
+                     http_status_code(http_stats_last_status()));
+    put(&l, fields, n);
+    if (bytes > 0) {
+        n = snprintf(fields, sizeof(fields), "%llu ",
+                     (unsigned long long)bytes);
+        put(&l, fields, n);
+    } else {
+        put(&l, "- ", 2);
+    }
+    put_header(&l, hdr, HTTP_HEADER_REFERER);
+    put(&l, " ", 1);
+    put_header(&l, hdr, HTTP_HEADER_USER_AGENT);
+    n = snprintf(fields, sizeof(fields), " %.6f", latency_us / 1e6);
+    put(&l, fields, n);
+    l.buf[l.len++] = '\n';
+    log_access(l.buf, l.len);
+}
@@ -0,0 +1,14 @@
+#ifndef __HTTP_ACCESS_H__
+#define __HTTP_ACCESS_H__
+
+#include <stdint.h>
+#include "http_functions.h"
+
+/*
+    function declarations
+ */
+// queue the Combined Log Format line of the request ending on conn,
+// followed by its latency in seconds
+void http_access_log(http_conn_t* conn, uint64_t latency_us);
+
+#endif
@@ -0,0 +1,98 @@
+#include "http_aio.h"
+#include <stdlib.h>
+#include <event2/thread.h>
+#include "logger.h"
+
+struct http_aio_t {
+    http_aio_work_cb work;
+    http_aio_done_cb done;
+    void* arg;
+    // activated by the pool thread, runs done on the submitting event loop
+    struct event* ev;
+    int cancelled;
+    struct http_aio_t* next;
+};
+
+// jobs waiting for a thread, oldest first
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    http_aio_t* head;
+    http_aio_t* tail;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+};
+
+static void complete_cb(evutil_socket_t fd, short events, void* arg) {
+    (void)fd;
+    (void)events;
+    http_aio_t* job = (http_aio_t*)arg;
+    job->done(job->arg, __atomic_load_n(&job->cancelled, __ATOMIC_ACQUIRE));
+    event_free(job->ev);
+    free(job);
+}
+
+static void* pool_run(void* arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.head == NULL)
+            pthread_cond_wait(&pool.ready, &pool.lock);
+        http_aio_t* job = pool.head;
+        if ((pool.head = job->next) == NULL)
+            pool.tail = NULL;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (!__atomic_load_n(&job->cancelled, __ATOMIC_ACQUIRE))
+            job->work(job->arg);
+        // the event base is notified and runs done on its own thread
+        event_active(job->ev, EV_READ, 0);
+    }
+    return NULL;
+}
+
+int http_aio_init(int threads) {
+    // completions are activated from pool threads, so every event base
+    // has to be created with locking
+    if (evthread_use_pthreads() < 0) {
+        logger(ERROR, "libevent has no pthreads support");
+        return -1;
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_run, NULL) != 0) {
+            logger(ERROR, "failed to start filesystem thread %d", i);
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+http_aio_t* http_aio_submit(struct event_base* base, http_aio_work_cb work,
+                            http_aio_done_cb done, void* arg) {
+    http_aio_t* job = (http_aio_t*)calloc(1, sizeof(http_aio_t));
+    if (job == NULL)
+        return NULL;
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+    if ((job->ev = event_new(base, -1, 0, complete_cb, job)) == NULL) {
+        free(job);
+        return NULL;
+    }
+    pthread_mutex_lock(&pool.lock);
+    if (pool.tail != NULL)
+        pool.tail->next = job;
+    else
+        pool.head = job;
+    pool.tail = job;
+    pthread_cond_signal(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+    return job;
+}
+
+void http_aio_cancel(http_aio_t* job) {
+    __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELEASE);
+}
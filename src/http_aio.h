@@ -0,0 +1,29 @@
+#ifndef __HTTP_AIO_H__
+#define __HTTP_AIO_H__
+
+#include <pthread.h>
+#include <event.h>
+
+// blocking filesystem work handed to the pool
+typedef struct http_aio_t http_aio_t;
+
+// runs on a pool thread, must not touch the connection it was submitted for
+typedef void (*http_aio_work_cb)(void* arg);
+// runs on the event loop that submitted the work once it is finished.
+// cancelled is set when nobody waits for the result anymore, arg only has
+// to be released then
+typedef void (*http_aio_done_cb)(void* arg, int cancelled);
+
+/*
+    function declarations
+ */
+// start the threads shared by all workers, before any event base is created
+int http_aio_init(int threads);
+// run work on the pool, then done on the event loop of base
+http_aio_t* http_aio_submit(struct event_base* base, http_aio_work_cb work,
+                            http_aio_done_cb done, void* arg);
+// tell the pool the result is no longer wanted, work that hasn't started is
+// skipped. done still runs, with cancelled set
+void http_aio_cancel(http_aio_t* job);
+
+#endif
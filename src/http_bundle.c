@@ -0,0 +1,227 @@
+#include "http_bundle.h"
+#include "http_stats.h"
+#include <errno.h>
+#include <sys/mman.h>
+#include "http_conditional.h"
+#include "http_encoding.h"
+#include "http_range.h"
+#include "logger.h"
+
+// the mapped bundle, never unmapped so its content can be referenced by
+// output buffers without holding anything
+static struct {
+    const char* base;  // NULL when no bundle is loaded
+    size_t size;
+    uint32_t mask;
+    const uint32_t* slots;
+    const http_bundle_entry_t* entries;
+} bundle;
+
+// whether the header describes a bundle of this build that fits size bytes
+static int header_valid(const http_bundle_header_t* h, size_t size) {
+    return !memcmp(h->magic, HTTP_BUNDLE_MAGIC, sizeof(HTTP_BUNDLE_MAGIC)) &&
+           h->version == HTTP_BUNDLE_VERSION &&
+           h->entry_size == sizeof(http_bundle_entry_t) && h->size == size &&
+           h->buckets > h->count && (h->buckets & (h->buckets - 1)) == 0 &&
+           h->slots + (uint64_t)h->buckets * sizeof(uint32_t) <= size &&
+           h->entries + (uint64_t)h->count * sizeof(http_bundle_entry_t) <=
+               size &&
+           h->content <= h->slots;
+}
+
+// whether len bytes at offset lie within size bytes
+static int span_valid(uint64_t offset, uint64_t len, uint64_t size) {
+    return offset <= size && len <= size - offset;
+}
+
+// whether every slot and entry of the index stays within the size bytes of
+// the bundle, so serving it never reads past the mapping
+static int index_valid(const char* base, const http_bundle_header_t* h,
+                       size_t size) {
+    const uint32_t* slots = (const uint32_t*)(base + h->slots);
+    const http_bundle_entry_t* entries =
+        (const http_bundle_entry_t*)(base + h->entries);
+    // probes end at an empty slot, there must be one
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < h->buckets; i++) {
+        if (slots[i] > h->count)
+            return 0;
+        used += (slots[i] != 0);
+    }
+    if (used >= h->buckets)
+        return 0;
+    for (uint32_t i = 0; i < h->count; i++) {
+        const http_bundle_entry_t* e = &entries[i];
+        // the path is followed by its '\0'
+        if (!span_valid(e->path, (uint64_t)e->path_len + 1, size) ||
+            base[e->path + e->path_len] != '\0' ||
+            e->reps[BUNDLE_IDENTITY].head_len == 0)
+            return 0;
+        for (int r = 0; r < BUNDLE_REPS; r++) {
+            const http_bundle_rep_t* rep = &e->reps[r];
+            if (rep->head_len > 0 &&
+                (!span_valid(rep->head, rep->head_len, size) ||
+                 !span_valid(rep->data, rep->size, size)))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// madvise a part of the mapping, from the page its offset falls in
+static void advise(uint64_t offset, uint64_t len, int advice) {
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset & ~(page - 1);
+    if (len > 0 && madvise((char*)bundle.base + start, len + offset - start,
+                           advice) < 0)
+        logger(WARNING, "madvise on the bundle failed: %s", strerror(errno));
+}
+
+int http_bundle_open(const char* file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        logger(ERROR, "failed to open bundle %s: %s", file, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+        st.st_size < (off_t)sizeof(http_bundle_header_t)) {
+        logger(ERROR, "%s is not a site bundle", file);
+        close(fd);
+        return -1;
+    }
+    // the mapping keeps the file, replacing it on disk doesn't touch it
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        logger(ERROR, "failed to map bundle %s: %s", file, strerror(errno));
+        return -1;
+    }
+    const http_bundle_header_t* h = (const http_bundle_header_t*)map;
+    if (!header_valid(h, st.st_size) ||
+        !index_valid((const char*)map, h, st.st_size)) {
+        logger(ERROR, "%s is not a site bundle of this server, rebuild it "
+               "with tools/wuw_pack", file);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    bundle.base = (const char*)map;
+    bundle.size = st.st_size;
+    bundle.mask = h->buckets - 1;
+    bundle.slots = (const uint32_t*)(bundle.base + h->slots);
+    bundle.entries = (const http_bundle_entry_t*)(bundle.base + h->entries);
+    // the index is read in right away, the content in the background, so
+    // the first requests after a deploy don't wait for the disk on the
+    // event loop
+    advise(h->slots, bundle.size - h->slots, MADV_WILLNEED);
+    advise(h->content, h->slots - h->content, MADV_WILLNEED);
+    logger(INFO, "serving %u files from bundle %s (%lld bytes)", h->count,
+           file, (long long)st.st_size);
+    return 0;
+}
+
+const http_bundle_entry_t* http_bundle_lookup(const char* url) {
+    if (bundle.base == NULL)
+        return NULL;
+    const char* path = strcmp(url, "/") ? url : "/index.html";
+    size_t len = strlen(path);
+    uint32_t hash = http_bundle_hash(path, len);
+    // the table is never full, so an empty slot ends every probe
+    for (uint32_t i = hash & bundle.mask;; i = (i + 1) & bundle.mask) {
+        uint32_t slot = bundle.slots[i];
+        if (slot == 0)
+            return NULL;
+        const http_bundle_entry_t* e = &bundle.entries[slot - 1];
+        if (e->hash == hash && e->path_len == len &&
+            !memcmp(bundle.base + e->path, path, len))
+            return e;
+    }
+}
+
+// 304 of a representation, compressed ones vary by Accept-Encoding
+static void send_not_modified(http_conn_t* conn, const http_bundle_rep_t* rep,
+                              int vary) {
+    if (!vary) {
+        http_not_modified(conn->bev, &rep->validators, conn->hdr.alive);
+        return;
+    }
+    http_response_t resp;
+    http_response_begin(&resp, HTTP_STATUS_NOT_MODIFIED);
+    http_response_append(&resp, "Vary: Accept-Encoding\r\n", 23);
+    http_response_validators(&resp, &rep->validators);
+    http_response_end(&resp, conn->hdr.alive);
+    http_response_send(&resp, conn->bev);
+}
+
+// answer a Range request, -1 when the header is to be ignored. Several
+// ranges are sent as the span covering them, as a streamed file does
+static int send_range(http_conn_t* conn, const http_bundle_entry_t* e,
+                      const char* range) {
+    const http_bundle_rep_t* rep = &e->reps[BUNDLE_IDENTITY];
+    http_headers_t* hdr = &conn->hdr;
+    const char* if_range = http_header(hdr, HTTP_HEADER_IF_RANGE);
+    if (if_range[0] != '\0' && !http_range_if_range(if_range, &rep->validators))
+        return -1;
+    http_range_t ranges[HTTP_RANGE_MAX];
+    int n = http_range_parse(range, rep->size, ranges);
+    if (n == 0)
+        return -1;
+    if (n < 0) {
+        http_range_not_satisfiable(conn->bev, rep->size, hdr->alive);
+        return 0;
+    }
+    off_t first = ranges[0].first;
+    off_t last = ranges[n - 1].last;
+    char extension[MAX_PATH_LEN];
+    char buf[HTTP_RANGE_PART_HDR_LEN];
+    get_file_extension(bundle.base + e->path, extension);
+    http_response_t resp;
+    http_response_begin(&resp, HTTP_STATUS_PARTIAL_CONTENT);
+    http_response_append(&resp, "Accept-Ranges: bytes\r\n", 22);
+    http_response_header(&resp, "Content-Type", get_content_type(extension));
+    snprintf(buf, sizeof(buf), "bytes %lld-%lld/%lld", (long long)first,
+             (long long)last, (long long)rep->size);
+    http_response_header(&resp, "Content-Range", buf);
+    // the length also goes to the access log, as http_stats_body would
+    http_response_length(&resp, last - first + 1);
+    http_response_end(&resp, hdr->alive);
+    http_response_send(&resp, conn->bev);
+    evbuffer_add_reference(bufferevent_get_output(conn->bev),
+                           bundle.base + rep->data + first, last - first + 1,
+                           NULL, NULL);
+    return 0;
+}
+
+void http_bundle_send(http_conn_t* conn, const http_bundle_entry_t* e) {
+    http_headers_t* hdr = &conn->hdr;
+    logger(DEBUG, "GET %s from bundle", bundle.base + e->path);
+    const char* range = http_header(hdr, HTTP_HEADER_RANGE);
+    // compressed variants are preferred as for files of the tree, ranges
+    // are cut from the identity representation
+    enum http_bundle_rep chosen = BUNDLE_IDENTITY;
+    if (range[0] == '\0') {
+        if ((hdr->encodings & ENCODING_BR) && e->reps[BUNDLE_BR].head_len > 0)
+            chosen = BUNDLE_BR;
+        else if ((hdr->encodings & ENCODING_GZIP) &&
+                 e->reps[BUNDLE_GZIP].head_len > 0)
+            chosen = BUNDLE_GZIP;
+    }
+    const http_bundle_rep_t* rep = &e->reps[chosen];
+    if (http_conditional_not_modified(hdr, &rep->validators)) {
+        send_not_modified(conn, rep, chosen != BUNDLE_IDENTITY);
+        return;
+    }
+    if (hdr->mode == GET && range[0] != '\0' && send_range(conn, e, range) == 0)
+        return;
+    http_response_t resp;
+    http_response_begin(&resp, HTTP_STATUS_OK);
+    http_response_append(&resp, bundle.base + rep->head, rep->head_len);
+    http_response_end(&resp, hdr->alive);
+    // the stored head carries the length
+    http_stats_body(rep->size);
+    http_response_send(&resp, conn->bev);
+    // the content goes out of the page cache without a copy
+    if (hdr->mode == GET && rep->size > 0)
+        evbuffer_add_reference(bufferevent_get_output(conn->bev),
+                               bundle.base + rep->data, rep->size, NULL, NULL);
+}
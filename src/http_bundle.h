@@ -0,0 +1,86 @@
+#ifndef __HTTP_BUNDLE_H__
+#define __HTTP_BUNDLE_H__
+
+#include <stdint.h>
+#include "http_functions.h"
+
+// first bytes of a site bundle, and the layout version after them
+#define HTTP_BUNDLE_MAGIC "WUWBNDL"
+#define HTTP_BUNDLE_VERSION 1
+// content and index start on pages of their own, so they can be advised
+// apart
+#define HTTP_BUNDLE_ALIGN 4096
+
+// representations a bundled file may have
+enum http_bundle_rep {
+    BUNDLE_IDENTITY = 0,
+    BUNDLE_GZIP,
+    BUNDLE_BR,
+    BUNDLE_REPS
+};
+
+// one representation of a file, offsets are from the start of the bundle
+typedef struct http_bundle_rep_t {
+    // response header lines from Content-Type to Content-Length, the status
+    // line, date, connection header and the blank line are added per
+    // response. head_len is 0 for a representation the file doesn't have
+    uint64_t head;
+    uint32_t head_len;
+    uint64_t data;
+    uint64_t size;
+    http_validators_t validators;
+} http_bundle_rep_t;
+
+// a file of the site, found by the url path it is requested with
+typedef struct http_bundle_entry_t {
+    uint32_t hash;
+    // the path is followed by a '\0' not counted in path_len
+    uint32_t path_len;
+    uint64_t path;
+    http_bundle_rep_t reps[BUNDLE_REPS];
+} http_bundle_entry_t;
+
+// start of a bundle, padded to HTTP_BUNDLE_ALIGN. The content follows,
+// then from a page boundary the slots of the hash table, the entries sorted
+// by path, and the paths and heads they point to
+typedef struct http_bundle_header_t {
+    char magic[8];
+    uint32_t version;
+    // sizeof(http_bundle_entry_t) of the packer, bundles are built on the
+    // kind of host serving them
+    uint32_t entry_size;
+    uint32_t count;
+    // slots of the open addressing table, a power of two above count.
+    // Each holds 1 + the index of an entry, 0 when empty
+    uint32_t buckets;
+    uint64_t content;
+    uint64_t slots;
+    uint64_t entries;
+    // size of the whole bundle, a truncated one is refused
+    uint64_t size;
+} http_bundle_header_t;
+
+// FNV-1a of the url path, shared by the packer and the server
+static inline uint32_t http_bundle_hash(const char* path, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+    function declarations
+ */
+// map a bundle built by tools/wuw_pack, its files are served from then on.
+// The header and the index are checked, a bundle with an entry pointing
+// past its end is refused. The content is not read
+int http_bundle_open(const char* file);
+// entry of a url path, "/" meaning "/index.html". NULL when no bundle is
+// loaded or it doesn't have the path
+const http_bundle_entry_t* http_bundle_lookup(const char* url);
+// answer a GET or HEAD from the mapping
+void http_bundle_send(http_conn_t* conn, const http_bundle_entry_t* e);
+
+#endif
@@ -0,0 +1,484 @@
+#include "http_cache.h"
+#include "http_encoding.h"
+#include "http_stats.h"
+#include "logger.h"
+#include <sys/inotify.h>
+
+// events of a watched directory that make its cached files stale
+#define CACHE_WATCH_MASK                                                \
+    (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |   \
+     IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// a watched directory and the cached entries of paths in it, so an event
+// concerns the entries of its directory only
+typedef struct cache_watch_t {
+    int wd;
+    http_cache_entry_t* entries;
+    struct cache_watch_t* next;
+} cache_watch_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    size_t budget;
+    size_t used;
+    http_cache_entry_t* buckets[HTTP_CACHE_BUCKETS];
+    // most recently used first
+    http_cache_entry_t* lru_head;
+    http_cache_entry_t* lru_tail;
+    cache_watch_t* watches[HTTP_CACHE_WATCH_BUCKETS];
+    // -1 when entries are revalidated with stat instead
+    int inotify_fd;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .loaded = PTHREAD_COND_INITIALIZER,
+    .inotify_fd = -1,
+};
+
+static unsigned hash_path(const char* path) {
+    // FNV-1a
+    unsigned h = 2166136261u;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void entry_free(http_cache_entry_t* e) {
+    if (e->gzip != NULL)
+        http_encoding_gzip_release(e->gzip);
+    free(e->path);
+    free(e->headers);
+    free(e->data);
+    free(e);
+}
+
+void http_cache_release(http_cache_entry_t* e) {
+    // the table holds a reference, so the last one is never dropped
+    // while the entry can still be found
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        entry_free(e);
+}
+
+static http_cache_entry_t* lookup(const char* path, unsigned hash) {
+    http_cache_entry_t* e = cache.buckets[hash & (HTTP_CACHE_BUCKETS - 1)];
+    while (e != NULL && (e->hash != hash || strcmp(e->path, path)))
+        e = e->next;
+    return e;
+}
+
+static void lru_unlink(http_cache_entry_t* e) {
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        cache.lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        cache.lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push(http_cache_entry_t* e) {
+    e->lru_prev = NULL;
+    e->lru_next = cache.lru_head;
+    if (cache.lru_head)
+        cache.lru_head->lru_prev = e;
+    cache.lru_head = e;
+    if (cache.lru_tail == NULL)
+        cache.lru_tail = e;
+}
+
+static cache_watch_t* watch_find(int wd) {
+    cache_watch_t* w = cache.watches[wd & (HTTP_CACHE_WATCH_BUCKETS - 1)];
+    while (w != NULL && w->wd != wd)
+        w = w->next;
+    return w;
+}
+
+// file the entry under the directory watch wd, caller holds the lock. The
+// entry stays unwatched, and is revalidated with stat, if that fails
+static void watch_link(http_cache_entry_t* e, int wd) {
+    cache_watch_t* w = watch_find(wd);
+    if (w == NULL) {
+        if ((w = (cache_watch_t*)calloc(1, sizeof(cache_watch_t))) == NULL)
+            return;
+        w->wd = wd;
+        w->next = cache.watches[wd & (HTTP_CACHE_WATCH_BUCKETS - 1)];
+        cache.watches[wd & (HTTP_CACHE_WATCH_BUCKETS - 1)] = w;
+    }
+    e->wd = wd;
+    e->wd_prev = NULL;
+    e->wd_next = w->entries;
+    if (w->entries != NULL)
+        w->entries->wd_prev = e;
+    w->entries = e;
+}
+
+static void watch_unlink(http_cache_entry_t* e) {
+    if (e->wd < 0)
+        return;
+    if (e->wd_prev != NULL) {
+        e->wd_prev->wd_next = e->wd_next;
+    } else {
+        cache_watch_t* w = watch_find(e->wd);
+        if (w != NULL)
+            w->entries = e->wd_next;
+    }
+    if (e->wd_next != NULL)
+        e->wd_next->wd_prev = e->wd_prev;
+    e->wd_prev = e->wd_next = NULL;
+    e->wd = -1;
+}
+
+// forget a watch the kernel dropped, its entries are already removed
+static void watch_free(cache_watch_t* w) {
+    cache_watch_t** p = &cache.watches[w->wd & (HTTP_CACHE_WATCH_BUCKETS - 1)];
+    while (*p != w)
+        p = &(*p)->next;
+    *p = w->next;
+    free(w);
+}
+
+// unlink entry from the table, caller holds the lock
+static void table_remove(http_cache_entry_t* e) {
+    http_cache_entry_t** p = &cache.buckets[e->hash & (HTTP_CACHE_BUCKETS - 1)];
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    e->next = NULL;
+    watch_unlink(e);
+    if (e->state != CACHE_LOADING) {
+        lru_unlink(e);
+        cache.used -= e->charge;
+    }
+    e->in_table = 0;
+    http_cache_release(e);
+}
+
+static void evict(size_t need) {
+    while (cache.lru_tail != NULL && cache.used + need > cache.budget) {
+        logger(DEBUG, "cache evict %s", cache.lru_tail->path);
+        table_remove(cache.lru_tail);
+    }
+}
+
+static int watch_directory(const char* path) {
+    if (cache.inotify_fd < 0)
+        return -1;
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char* slash = strrchr(dir, '/');
+    if (slash != NULL)
+        *slash = '\0';
+    // watching an already watched directory returns the same descriptor
+    return inotify_add_watch(cache.inotify_fd, dir, CACHE_WATCH_MASK);
+}
+
+// read the file and build its response headers, outside of the lock
+static int load_entry(http_cache_entry_t* e) {
+    // watch before reading so no change can slip in between
+    int wd = watch_directory(e->path);
+    pthread_mutex_lock(&cache.lock);
+    // an entry invalidated meanwhile is dropped once loaded
+    if (wd >= 0 && e->in_table)
+        watch_link(e, wd);
+    pthread_mutex_unlock(&cache.lock);
+
+    int fd = open(e->path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_size > HTTP_CACHE_MAX_FILE) {
+        close(fd);
+        return -1;
+    }
+    e->data = (char*)malloc(st.st_size > 0 ? st.st_size : 1);
+    size_t done = 0;
+    while (e->data != NULL && done < (size_t)st.st_size) {
+        ssize_t n = pread(fd, e->data + done, st.st_size - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    close(fd);
+    if (e->data == NULL || done < (size_t)st.st_size)
+        return -1;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim;
+    e->ino = st.st_ino;
+    e->checked_at = time(NULL);
+
+    char extension[MAX_PATH_LEN];
+    char buf[MAX_LINE_LEN];
+    get_file_extension(e->path, extension);
+    http_validators_init(&e->validators, &st);
+    const char* type = get_content_type(extension);
+    int n = snprintf(buf, sizeof(buf),
+                     "Content-Type: %s\r\n%sAccept-Ranges: bytes\r\n"
+                     "ETag: %s\r\nLast-Modified: %s\r\n"
+                     "Content-Length: %zu\r\n",
+                     type,
+                     http_encoding_compressible(type)
+                         ? "Vary: Accept-Encoding\r\n"
+                         : "",
+                     e->validators.etag, e->validators.last_modified, e->size);
+    if ((e->headers = strdup(buf)) == NULL)
+        return -1;
+    e->headers_len = n;
+    // the compressed variant is answered from the entry too, sidecar files
+    // are left to the pool
+    e->type = type;
+    if (http_encoding_compressible(type)) {
+        e->sidecars = http_encoding_sidecars(e->path, &st);
+        e->gzip = http_encoding_gzip(e->path, &st);
+    }
+    return 0;
+}
+
+static int entry_changed(http_cache_entry_t* e, const struct stat* st) {
+    if (st->st_ino != e->ino || (size_t)st->st_size != e->size ||
+        st->st_mtim.tv_sec != e->mtime.tv_sec ||
+        st->st_mtim.tv_nsec != e->mtime.tv_nsec)
+        return 1;
+    // a sidecar file may have appeared or gone
+    return http_encoding_compressible(e->type) &&
+           http_encoding_sidecars(e->path, st) != e->sidecars;
+}
+
+http_cache_entry_t* http_cache_lookup(const char* path) {
+    if (cache.budget == 0)
+        return NULL;
+    pthread_mutex_lock(&cache.lock);
+    http_cache_entry_t* e = lookup(path, hash_path(path));
+    // entries being loaded or due for a stat are left to http_cache_get
+    if (e != NULL && (e->state != CACHE_READY ||
+                      (e->wd < 0 &&
+                       time(NULL) - e->checked_at >= HTTP_CACHE_VALID_SECS)))
+        e = NULL;
+    if (e != NULL) {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        lru_unlink(e);
+        lru_push(e);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return e;
+}
+
+http_cache_entry_t* http_cache_get(const char* path) {
+    if (cache.budget == 0)
+        return NULL;
+    unsigned hash = hash_path(path);
+    http_cache_entry_t* e = NULL;
+
+    pthread_mutex_lock(&cache.lock);
+    while ((e = lookup(path, hash)) != NULL) {
+        if (e->state == CACHE_LOADING) {
+            // another thread is reading the same file, share its result
+            pthread_cond_wait(&cache.loaded, &cache.lock);
+            continue;
+        }
+        if (e->state == CACHE_SKIP) {
+            if (time(NULL) - e->checked_at < HTTP_CACHE_SKIP_SECS) {
+                lru_unlink(e);
+                lru_push(e);
+                pthread_mutex_unlock(&cache.lock);
+                return NULL;
+            }
+            // expired, the path is looked at again
+            table_remove(e);
+            continue;
+        }
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        time_t now = time(NULL);
+        if (e->wd < 0 && now - e->checked_at >= HTTP_CACHE_VALID_SECS) {
+            // unwatched files are checked by one request per interval
+            e->checked_at = now;
+            pthread_mutex_unlock(&cache.lock);
+            struct stat st;
+            int changed = (stat(path, &st) < 0 || entry_changed(e, &st));
+            pthread_mutex_lock(&cache.lock);
+            if (changed || !e->in_table) {
+                if (e->in_table)
+                    table_remove(e);
+                http_cache_release(e);
+                continue;
+            }
+        }
+        lru_unlink(e);
+        lru_push(e);
+        pthread_mutex_unlock(&cache.lock);
+        logger(DEBUG, "cache hit %s", path);
+        return e;
+    }
+
+    // miss: publish a placeholder so concurrent misses wait for this load
+    if ((e = (http_cache_entry_t*)calloc(1, sizeof(http_cache_entry_t))) == NULL ||
+        (e->path = strdup(path)) == NULL) {
+        pthread_mutex_unlock(&cache.lock);
+        free(e);
+        return NULL;
+    }
+    e->hash = hash;
+    e->state = CACHE_LOADING;
+    e->wd = -1;
+    // one reference for the table, one kept by this loader
+    e->refs = 2;
+    e->in_table = 1;
+    e->next = cache.buckets[hash & (HTTP_CACHE_BUCKETS - 1)];
+    cache.buckets[hash & (HTTP_CACHE_BUCKETS - 1)] = e;
+    pthread_mutex_unlock(&cache.lock);
+
+    int ret = load_entry(e);
+
+    pthread_mutex_lock(&cache.lock);
+    size_t need = e->size + e->headers_len + (e->gzip ? e->gzip->len : 0);
+    if (!e->in_table) {
+        // invalidated while it was being read
+        http_cache_release(e);
+        e = NULL;
+    } else if (ret < 0 || need > cache.budget) {
+        // not cacheable, requests of the path skip the cache until the
+        // entry expires or its directory changes
+        free(e->data);
+        free(e->headers);
+        if (e->gzip != NULL)
+            http_encoding_gzip_release(e->gzip);
+        e->data = e->headers = NULL;
+        e->gzip = NULL;
+        e->size = e->headers_len = 0;
+        e->state = CACHE_SKIP;
+        e->checked_at = time(NULL);
+        e->charge = sizeof(http_cache_entry_t) + strlen(path) + 1;
+        evict(e->charge);
+        cache.used += e->charge;
+        lru_push(e);
+        http_cache_release(e);
+        e = NULL;
+        logger(DEBUG, "cache skip %s", path);
+    } else {
+        // the loader reference is handed to the caller
+        evict(need);
+        e->state = CACHE_READY;
+        e->charge = need;
+        cache.used += need;
+        lru_push(e);
+        logger(DEBUG, "cache load %s (%zu bytes)", path, e->size);
+    }
+    pthread_cond_broadcast(&cache.loaded);
+    pthread_mutex_unlock(&cache.lock);
+    return e;
+}
+
+void http_cache_invalidate(const char* path) {
+    if (cache.budget == 0)
+        return;
+    pthread_mutex_lock(&cache.lock);
+    http_cache_entry_t* e = lookup(path, hash_path(path));
+    if (e != NULL)
+        table_remove(e);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static void chunk_sent_cb(const void* data, size_t len, void* arg) {
+    (void)data;
+    (void)len;
+    http_cache_release((http_cache_entry_t*)arg);
+}
+
+void http_cache_send(http_cache_entry_t* e, struct evbuffer* output,
+                     int alive, int head_only) {
+    // the head is small, copying it is cheaper than referencing it
+    http_response_t resp;
+    http_response_begin(&resp, HTTP_STATUS_OK);
+    http_response_append(&resp, e->headers, e->headers_len);
+    http_response_end(&resp, alive);
+    http_stats_body(e->size);
+    evbuffer_add(output, resp.buf, resp.len);
+    // the referenced content owns the entry reference until it is sent
+    if (head_only || e->size == 0 ||
+        evbuffer_add_reference(output, e->data, e->size, chunk_sent_cb, e) < 0)
+        http_cache_release(e);
+}
+
+// whether an event about name concerns the file called file, its sidecar
+// files included
+static int names_file(const char* file, const char* name) {
+    size_t len = strlen(file);
+    return !strncmp(file, name, len) &&
+           (name[len] == '\0' || !strcmp(name + len, ".gz") ||
+            !strcmp(name + len, ".br"));
+}
+
+static void invalidate_event(const struct inotify_event* ev) {
+    pthread_mutex_lock(&cache.lock);
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // events were lost, any entry may be stale
+        logger(DEBUG, "cache invalidate all");
+        for (int i = 0; i < HTTP_CACHE_BUCKETS; i++) {
+            while (cache.buckets[i] != NULL)
+                table_remove(cache.buckets[i]);
+        }
+        pthread_mutex_unlock(&cache.lock);
+        return;
+    }
+    cache_watch_t* w = watch_find(ev->wd);
+    http_cache_entry_t* e = w != NULL ? w->entries : NULL;
+    while (e != NULL) {
+        http_cache_entry_t* next = e->wd_next;
+        const char* name = strrchr(e->path, '/');
+        name = name ? name + 1 : e->path;
+        // events without a name concern the directory itself
+        if (ev->len == 0 || names_file(name, ev->name)) {
+            logger(DEBUG, "cache invalidate %s", e->path);
+            table_remove(e);
+        }
+        e = next;
+    }
+    // the directory is gone and the kernel dropped its watch
+    if (w != NULL && (ev->mask & IN_IGNORED))
+        watch_free(w);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static void* watcher_run(void* arg) {
+    (void)arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(cache.inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        for (char* p = buf; p < buf + n;) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            invalidate_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    logger(ERROR, "inotify watcher stopped: %s", strerror(errno));
+    return NULL;
+}
+
+int http_cache_init(size_t budget) {
+    cache.budget = budget;
+    if (budget == 0)
+        return 0;
+    if ((cache.inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        logger(WARNING, "inotify unavailable, cached files are revalidated");
+        return 0;
+    }
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, watcher_run, NULL) != 0) {
+        logger(WARNING, "failed to start inotify watcher");
+        close(cache.inotify_fd);
+        cache.inotify_fd = -1;
+        return 0;
+    }
+    pthread_detach(watcher);
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef __HTTP_CACHE_H__
+#define __HTTP_CACHE_H__
+
+#include <pthread.h>
+#include <time.h>
+#include "http_encoding.h"
+
+// buckets of the cache hash table, a power of two
+#define HTTP_CACHE_BUCKETS (1 << 12)
+// largest file kept in the cache
+#define HTTP_CACHE_MAX_FILE (1 << 20)
+// seconds between revalidations when inotify is unavailable
+#define HTTP_CACHE_VALID_SECS 1
+// seconds a path that can't be cached is remembered as such: directories,
+// missing files and files over HTTP_CACHE_MAX_FILE
+#define HTTP_CACHE_SKIP_SECS 2
+// buckets of the table of watched directories, a power of two
+#define HTTP_CACHE_WATCH_BUCKETS (1 << 8)
+
+// state of a cache entry
+enum http_cache_state {
+    CACHE_LOADING = 0,  // a thread is reading the file, others wait
+    CACHE_READY,
+    CACHE_SKIP          // not cacheable, nothing is read until it expires
+};
+
+// one cached file with its precomputed response headers
+typedef struct http_cache_entry_t {
+    char* path;
+    unsigned hash;
+    enum http_cache_state state;
+    // "Content-Type: ...\r\n...Content-Length: n\r\n" with the validators, the
+    // status line, date,
+    // connection header and the blank line are added per response
+    char* headers;
+    size_t headers_len;
+    char* data;
+    size_t size;
+    http_validators_t validators;
+    // media type, and for compressible ones the codings that have sidecar
+    // files and the variant compressed by the server, NULL if none
+    const char* type;
+    int sidecars;
+    http_gzip_t* gzip;
+    // metadata used for invalidation
+    struct timespec mtime;
+    ino_t ino;
+    time_t checked_at;
+    int wd;
+    // bytes counted against the budget while it is in the table
+    size_t charge;
+    // references held by the table and by evbuffers still sending it
+    int refs;
+    int in_table;
+    struct http_cache_entry_t* next;
+    struct http_cache_entry_t* lru_prev;
+    struct http_cache_entry_t* lru_next;
+    // entries of the same watched directory
+    struct http_cache_entry_t* wd_prev;
+    struct http_cache_entry_t* wd_next;
+} http_cache_entry_t;
+
+/*
+    function declarations
+ */
+// create the cache shared by all workers, budget 0 disables it
+int http_cache_init(size_t budget);
+// get referenced entry of path only if it can be served without touching
+// the disk, never blocks
+http_cache_entry_t* http_cache_lookup(const char* path);
+// get referenced entry of path, loading it on a miss. NULL if not cacheable,
+// which is remembered for HTTP_CACHE_SKIP_SECS
+http_cache_entry_t* http_cache_get(const char* path);
+// drop a reference returned by http_cache_get
+void http_cache_release(http_cache_entry_t* entry);
+// forget cached content of path
+void http_cache_invalidate(const char* path);
+// queue cached response on output, only its head when head_only is set.
+// The entry reference is handed over
+void http_cache_send(http_cache_entry_t* entry, struct evbuffer* output,
+                     int alive, int head_only);
+
+#endif
@@ -0,0 +1,162 @@
+#include "http_chunked.h"
+#include "http_stats.h"
+#include "logger.h"
+
+int http_chunked_begin(http_chunked_t* ch, http_conn_t* conn,
+                       const char* type, int head_only) {
+    if ((ch->pending = evbuffer_new()) == NULL)
+        return -1;
+    ch->bev = conn->bev;
+    ch->head_only = head_only;
+    ch->body = 0;
+    // HTTP/1.0 has no chunked coding, the end of the body is the close
+    ch->chunked = !strcmp(conn->hdr.version, "HTTP/1.1");
+    if (!ch->chunked && !head_only)
+        conn->hdr.alive = 0;
+
+    http_response_t resp;
+    http_response_begin(&resp, HTTP_STATUS_OK);
+    http_response_header(&resp, "Content-Type", type);
+    if (ch->chunked)
+        http_response_append(&resp, "Transfer-Encoding: chunked\r\n", 28);
+    http_response_end(&resp, conn->hdr.alive);
+    if (http_response_send(&resp, ch->bev) < 0) {
+        evbuffer_free(ch->pending);
+        ch->pending = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// frame everything pending as one chunk, the data chains are moved
+static void emit_chunk(http_chunked_t* ch) {
+    struct evbuffer* output = bufferevent_get_output(ch->bev);
+    size_t len = evbuffer_get_length(ch->pending);
+    if (len == 0)
+        return;
+    if (ch->head_only) {
+        evbuffer_drain(ch->pending, len);
+        return;
+    }
+    // the size line and the framing are not part of the body
+    http_stats_body(len);
+    ch->body += len;
+    if (!ch->chunked) {
+        evbuffer_add_buffer(output, ch->pending);
+        return;
+    }
+    evbuffer_add_printf(output, "%zx\r\n", len);
+    evbuffer_add_buffer(output, ch->pending);
+    evbuffer_add(output, "\r\n", 2);
+}
+
+void http_chunked_coalesce(http_chunked_t* ch) {
+    if (evbuffer_get_length(ch->pending) >= HTTP_CHUNK_SIZE)
+        emit_chunk(ch);
+}
+
+void http_chunked_end(http_chunked_t* ch) {
+    emit_chunk(ch);
+    if (ch->chunked && !ch->head_only)
+        evbuffer_add(bufferevent_get_output(ch->bev), "0\r\n\r\n", 5);
+    evbuffer_free(ch->pending);
+    ch->pending = NULL;
+}
+
+int http_chunk_decoder_init(http_chunk_decoder_t* dec) {
+    dec->state = CHUNK_SIZE_LINE;
+    dec->remaining = 0;
+    return (dec->body = evbuffer_new()) == NULL ? -1 : 0;
+}
+
+void http_chunk_decoder_cleanup(http_chunk_decoder_t* dec) {
+    if (dec->body != NULL)
+        evbuffer_free(dec->body);
+    dec->body = NULL;
+}
+
+// `hex-size[;extensions]`, extensions are ignored
+static int parse_size_line(http_chunk_decoder_t* dec, const char* line) {
+    off_t size = 0;
+    int digits = 0;
+    for (; isxdigit((unsigned char)*line); line++, digits++) {
+        if (digits == HTTP_CHUNK_SIZE_DIGITS)
+            return -1;
+        int c = tolower((unsigned char)*line);
+        size = size * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+    }
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if (digits == 0 || (*line != '\0' && *line != ';'))
+        return -1;
+    dec->remaining = size;
+    return 0;
+}
+
+int http_chunk_decode(http_chunk_decoder_t* dec, struct evbuffer* input) {
+    for (;;) {
+        size_t eol_len = 0;
+        struct evbuffer_ptr eol;
+        switch (dec->state) {
+            case CHUNK_SIZE_LINE:
+            case CHUNK_TRAILER:
+                eol = evbuffer_search_eol(input, NULL, &eol_len,
+                                          EVBUFFER_EOL_CRLF);
+                if (eol.pos < 0) {
+                    if (evbuffer_get_length(input) > HTTP_HDR_LINE_LEN)
+                        return HTTP_PARSE_ERROR;
+                    return HTTP_PARSE_AGAIN;
+                }
+                if (eol.pos > HTTP_HDR_LINE_LEN)
+                    return HTTP_PARSE_ERROR;
+                if (dec->state == CHUNK_TRAILER) {
+                    // trailer fields carry nothing the upload needs
+                    evbuffer_drain(input, eol.pos + eol_len);
+                    if (eol.pos == 0) {
+                        logger(DEBUG, "chunked body complete");
+                        dec->state = CHUNK_DONE;
+                    }
+                    break;
+                }
+                char* line = (char*)evbuffer_pullup(input, eol.pos + eol_len);
+                line[eol.pos] = '\0';
+                int ret = parse_size_line(dec, line);
+                evbuffer_drain(input, eol.pos + eol_len);
+                if (ret < 0) {
+                    logger(DEBUG, "malformed chunk size line");
+                    return HTTP_PARSE_ERROR;
+                }
+                // the last chunk has size 0 and may be followed by trailers
+                dec->state = dec->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                break;
+
+            case CHUNK_DATA: {
+                size_t avail = evbuffer_get_length(input);
+                if (avail == 0)
+                    return HTTP_PARSE_AGAIN;
+                size_t n = (off_t)avail < dec->remaining ? avail
+                                                         : (size_t)dec->remaining;
+                // whole chains are moved, not copied
+                evbuffer_remove_buffer(input, dec->body, n);
+                dec->remaining -= n;
+                if (dec->remaining == 0)
+                    dec->state = CHUNK_DATA_END;
+                break;
+            }
+
+            case CHUNK_DATA_END: {
+                if (evbuffer_get_length(input) < 2)
+                    return HTTP_PARSE_AGAIN;
+                char crlf[2];
+                evbuffer_remove(input, crlf, 2);
+                if (crlf[0] != '\r' || crlf[1] != '\n')
+                    return HTTP_PARSE_ERROR;
+                dec->state = CHUNK_SIZE_LINE;
+                break;
+            }
+
+            case CHUNK_DONE:
+                return HTTP_PARSE_DONE;
+        }
+    }
+}
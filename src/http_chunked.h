@@ -0,0 +1,59 @@
+#ifndef __HTTP_CHUNKED_H__
+#define __HTTP_CHUNKED_H__
+
+#include "http_functions.h"
+
+// generated body gathered before it is framed as one chunk
+#define HTTP_CHUNK_SIZE (1 << 14)
+// hex digits accepted in the size line of a request chunk
+#define HTTP_CHUNK_SIZE_DIGITS 15
+
+// generated response body, framed with chunked transfer coding
+typedef struct http_chunked_t {
+    bfevent_t* bev;
+    // body bytes not framed yet, generators append here
+    struct evbuffer* pending;
+    // 0 for HTTP/1.0 clients, the body is then ended by closing
+    int chunked;
+    // answer of a HEAD request, generators may stop after the head
+    int head_only;
+    // body bytes framed so far
+    off_t body;
+} http_chunked_t;
+
+// states of the request body decoder
+enum chunk_decode_state {
+    CHUNK_SIZE_LINE = 0,  // "hex-size[;ext]\r\n"
+    CHUNK_DATA,           // chunk content
+    CHUNK_DATA_END,       // "\r\n" after the content
+    CHUNK_TRAILER,        // trailer lines up to the blank one
+    CHUNK_DONE
+};
+
+// chunked request body being decoded, persists across read callbacks
+typedef struct http_chunk_decoder_t {
+    enum chunk_decode_state state;
+    off_t remaining;  // content bytes left in the current chunk
+    // decoded body, consumed by the upload parser
+    struct evbuffer* body;
+} http_chunk_decoder_t;
+
+/*
+    function declarations
+ */
+// send the response head of a generated body of content type, the body is
+// dropped when head_only is set
+int http_chunked_begin(http_chunked_t* ch, http_conn_t* conn,
+                       const char* type, int head_only);
+// frame the pending bytes once enough of them are gathered
+void http_chunked_coalesce(http_chunked_t* ch);
+// flush the pending bytes and end the body
+void http_chunked_end(http_chunked_t* ch);
+// prepare to decode a chunked request body
+int http_chunk_decoder_init(http_chunk_decoder_t* dec);
+// move decoded content from input to dec->body, returns one of HTTP_PARSE_*
+int http_chunk_decode(http_chunk_decoder_t* dec, struct evbuffer* input);
+// release a decoder and the content it still buffers
+void http_chunk_decoder_cleanup(http_chunk_decoder_t* dec);
+
+#endif
@@ -0,0 +1,51 @@
+#include "http_conditional.h"
+#include <time.h>
+
+int http_etag_match(const char* list, const char* etag, int weak) {
+    size_t len = strlen(etag);
+    const char* p = list;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '\0')
+            return 0;
+        if (*p == '*')
+            return 1;
+        int is_weak = !strncmp(p, "W/", 2);
+        if (is_weak)
+            p += 2;
+        // the opaque tag runs up to its closing quote
+        const char* end = *p == '"' ? strchr(p + 1, '"') : NULL;
+        if (end == NULL)
+            return 0;
+        end++;
+        if ((weak || !is_weak) && (size_t)(end - p) == len &&
+            !strncmp(p, etag, len))
+            return 1;
+        p = end;
+    }
+}
+
+int http_conditional_not_modified(const http_headers_t* hdr,
+                                  const http_validators_t* v) {
+    if (hdr->mode != GET && hdr->mode != HEAD)
+        return 0;
+    // If-None-Match takes precedence, dates are then ignored
+    const char* if_none_match = http_header(hdr, HTTP_HEADER_IF_NONE_MATCH);
+    if (if_none_match[0] != '\0')
+        return http_etag_match(if_none_match, v->etag, 1);
+    const char* since_date = http_header(hdr, HTTP_HEADER_IF_MODIFIED_SINCE);
+    if (since_date[0] == '\0')
+        return 0;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* end =
+        strptime(since_date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0')
+        return 0;
+    time_t since = timegm(&tm);
+    // a date in the future is not a valid validator
+    if (since > time(NULL))
+        return 0;
+    return v->mtime <= since;
+}
@@ -0,0 +1,15 @@
+#ifndef __HTTP_CONDITIONAL_H__
+#define __HTTP_CONDITIONAL_H__
+
+#include "http_functions.h"
+
+/*
+    function declarations
+ */
+// whether If-None-Match or If-Modified-Since let a 304 answer the request
+int http_conditional_not_modified(const http_headers_t* hdr,
+                                  const http_validators_t* v);
+// whether an entity tag list holds etag, weak comparison when weak is set
+int http_etag_match(const char* list, const char* etag, int weak);
+
+#endif
@@ -0,0 +1,191 @@
+#include "http_config.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+http_config_t server_config = {
+    .workers = DEFAULT_WORKERS,
+    .pin_cpus = 0,
+    .cache_size = (size_t)DEFAULT_CACHE_SIZE_MB << 20,
+    .tls_port = 0,
+    .ktls_handoff = 0,
+    .io_threads = DEFAULT_IO_THREADS,
+    .access_log = NULL,
+    .backlog = DEFAULT_BACKLOG,
+    .max_conns = DEFAULT_MAX_CONNS,
+    .open_files = DEFAULT_OPEN_FILES,
+    .fsync = DEFAULT_FSYNC,
+    .idle_timeout = DEFAULT_IDLE_TIMEOUT,
+    .header_timeout = DEFAULT_HEADER_TIMEOUT,
+    .body_timeout = DEFAULT_BODY_TIMEOUT,
+};
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-w workers] [-a] [-c cache_mb] [-s tls_port] [-k] "
+            "[-i io_threads] [-l access_log] [-b backlog] [-m max_conns] "
+            "[-t idle,header,body] [-f open_files] [-y fsync] "
+            "[-d conn,client,global] [-u conn,client,global] [-p bundle]\n"
+            "  -w workers  number of worker threads, 0 for one per cpu "
+            "(default %d)\n"
+            "  -a          pin each worker thread to its own cpu\n"
+            "  -c cache_mb memory for cached static files, 0 disables "
+            "(default %d)\n"
+            "  -s tls_port also serve HTTPS on tls_port, with the "
+            "certificate in CA/\n"
+            "  -k          once the kernel runs both directions of TLS, "
+            "read and write its socket directly, so files go out with "
+            "sendfile(2). Experimental: connections fail on TLS control "
+            "records such as key updates (default off)\n"
+            "  -i io_threads threads doing disk i/o off the event loops "
+            "(default %d)\n"
+            "  -l access_log append requests to access_log in the combined "
+            "log format, - for stdout\n"
+            "  -b backlog  connections queued by the kernel per listener "
+            "(default %d)\n"
+            "  -m max_conns stop accepting at max_conns open connections, 0 "
+            "for no limit (default %d)\n"
+            "  -t idle,header,body seconds a kept-alive connection may idle, "
+            "a request head may take and a body or response may stall, 0 "
+            "disables one (default %d,%d,%d)\n"
+            "  -f open_files paths kept open with their metadata, 0 "
+            "disables (default %d)\n"
+            "  -y fsync    flush PUT uploads before they replace their "
+            "target: none, data or full (default data)\n"
+            "  -d conn,client,global KiB/s downloads may take per "
+            "connection, per client address and in total, 0 for no limit "
+            "(default none)\n"
+            "  -u conn,client,global KiB/s uploads may take, the same "
+            "way\n"
+            "  -p bundle   serve the files of a bundle built by "
+            "tools/wuw_pack, others from the tree\n",
+            prog, DEFAULT_WORKERS, DEFAULT_CACHE_SIZE_MB, DEFAULT_IO_THREADS,
+            DEFAULT_BACKLOG, DEFAULT_MAX_CONNS, DEFAULT_IDLE_TIMEOUT,
+            DEFAULT_HEADER_TIMEOUT, DEFAULT_BODY_TIMEOUT, DEFAULT_OPEN_FILES);
+}
+
+// "conn,client,global" in KiB/s
+static int parse_limits(const char* arg, int limits[RATE_SCOPES]) {
+    if (sscanf(arg, "%d,%d,%d", &limits[RATE_CONN], &limits[RATE_CLIENT],
+               &limits[RATE_GLOBAL]) != 3)
+        return -1;
+    for (int i = 0; i < RATE_SCOPES; i++) {
+        if (limits[i] < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int http_config_parse(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "w:ac:s:ki:l:b:m:t:f:y:d:u:p:h")) != -1) {
+        switch (opt) {
+            case 'w':
+                server_config.workers = atoi(optarg);
+                if (server_config.workers < 0) {
+                    logger(ERROR, "invalid number of workers: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'a':
+                server_config.pin_cpus = 1;
+                break;
+            case 'c':
+                if (atoi(optarg) < 0) {
+                    logger(ERROR, "invalid cache size: %s", optarg);
+                    return -1;
+                }
+                server_config.cache_size = (size_t)atoi(optarg) << 20;
+                break;
+            case 's':
+                server_config.tls_port = atoi(optarg);
+                if (server_config.tls_port <= 0 ||
+                    server_config.tls_port > 65535) {
+                    logger(ERROR, "invalid tls port: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'k':
+                server_config.ktls_handoff = 1;
+                break;
+            case 'i':
+                server_config.io_threads = atoi(optarg);
+                if (server_config.io_threads <= 0) {
+                    logger(ERROR, "invalid number of io threads: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'l':
+                server_config.access_log = optarg;
+                break;
+            case 'b':
+                server_config.backlog = atoi(optarg);
+                if (server_config.backlog <= 0) {
+                    logger(ERROR, "invalid backlog: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'm':
+                server_config.max_conns = atoi(optarg);
+                if (server_config.max_conns < 0) {
+                    logger(ERROR, "invalid connection limit: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 't':
+                if (sscanf(optarg, "%d,%d,%d", &server_config.idle_timeout,
+                           &server_config.header_timeout,
+                           &server_config.body_timeout) != 3 ||
+                    server_config.idle_timeout < 0 ||
+                    server_config.header_timeout < 0 ||
+                    server_config.body_timeout < 0) {
+                    logger(ERROR, "invalid timeouts: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'f':
+                server_config.open_files = atoi(optarg);
+                if (server_config.open_files < 0) {
+                    logger(ERROR, "invalid number of open files: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'y':
+                if (!strcmp(optarg, "none")) {
+                    server_config.fsync = FSYNC_NONE;
+                } else if (!strcmp(optarg, "data")) {
+                    server_config.fsync = FSYNC_DATA;
+                } else if (!strcmp(optarg, "full")) {
+                    server_config.fsync = FSYNC_FULL;
+                } else {
+                    logger(ERROR, "invalid fsync policy: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'd':
+                if (parse_limits(optarg, server_config.download_limit) < 0) {
+                    logger(ERROR, "invalid download limits: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'u':
+                if (parse_limits(optarg, server_config.upload_limit) < 0) {
+                    logger(ERROR, "invalid upload limits: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'p':
+                server_config.bundle = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if (server_config.workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        server_config.workers = cpus > 0 ? (int)cpus : 1;
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef __HTTP_CONFIG_H__
+#define __HTTP_CONFIG_H__
+
+#include <stddef.h>
+
+/* default server settings, overridable from the command line */
+// worker threads, each running its own event loop and listener
+#define DEFAULT_WORKERS 1
+// memory budget of the static content cache in MB
+#define DEFAULT_CACHE_SIZE_MB 64
+// threads running blocking filesystem calls for all workers
+#define DEFAULT_IO_THREADS 4
+// connections the kernel queues on each listener until they are accepted
+#define DEFAULT_BACKLOG 1024
+// open connections over all workers, 0 for no limit
+#define DEFAULT_MAX_CONNS 10000
+// paths kept open with their metadata by the open file cache, which holds
+// at most as many descriptors
+#define DEFAULT_OPEN_FILES 1024
+// how PUT uploads reach the disk before they replace their target
+#define DEFAULT_FSYNC FSYNC_DATA
+
+// when a PUT upload is flushed to disk
+enum http_fsync {
+    FSYNC_NONE = 0,  // left to the kernel
+    FSYNC_DATA,      // fdatasync before the file is renamed into place
+    FSYNC_FULL       // fsync the file, and its directory after the rename
+};
+// seconds a kept-alive connection may wait for its next request, a client
+// may take to send a request head, and a body or a response may stall
+#define DEFAULT_IDLE_TIMEOUT 60
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_BODY_TIMEOUT 30
+
+// what a bandwidth limit applies to
+enum http_rate_scope {
+    RATE_CONN = 0,  // each connection
+    RATE_CLIENT,    // all connections of one client address
+    RATE_GLOBAL,    // all connections
+    RATE_SCOPES
+};
+
+// runtime configuration of the server
+typedef struct http_config_t {
+    int workers;   // number of worker threads, 0 means one per online cpu
+    int pin_cpus;  // pin worker i to cpu i
+    size_t cache_size;  // bytes of file content cached in memory, 0 disables
+    int tls_port;  // port of the HTTPS listener, 0 disables it
+    // move kTLS connections to plain socket bufferevents, see http_tls.h
+    int ktls_handoff;
+    int io_threads;  // threads running blocking filesystem calls
+    const char* access_log;  // access log file, "-" for stdout, NULL for none
+    int backlog;  // listen(2) backlog of every listener
+    int max_conns;  // open connections over all workers, 0 for no limit
+    int open_files;  // entries of the open file cache, 0 disables it
+    enum http_fsync fsync;  // durability of PUT uploads
+    // timeouts in seconds, 0 disables one
+    int idle_timeout;
+    int header_timeout;
+    int body_timeout;
+    // bandwidth limits in KiB/s by enum http_rate_scope, 0 for none
+    int download_limit[RATE_SCOPES];
+    int upload_limit[RATE_SCOPES];
+    const char* bundle;  // site bundle served before the tree, NULL for none
+} http_config_t;
+
+extern http_config_t server_config;
+
+/*
+    function declarations
+ */
+// fill server_config from command line options
+int http_config_parse(int argc, char** argv);
+
+#endif
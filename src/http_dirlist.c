@@ -0,0 +1,590 @@
+#include "http_dirlist.h"
+#include "http_aio.h"
+#include "http_chunked.h"
+#include "http_stats.h"
+#include "logger.h"
+#include <limits.h>
+#include <pthread.h>
+
+#define CONTENT_TYPE_HTML "text/html"
+#define CONTENT_TYPE_JSON "application/json"
+
+// what the query string asks for
+typedef struct dirlist_query_t {
+    enum dirlist_format format;
+    size_t page;  // 1-based, 0 returns every entry
+    size_t per_page;
+} dirlist_query_t;
+
+// directory read and rendered on the filesystem pool on behalf of a
+// connection
+typedef struct dirlist_job_t {
+    http_conn_t* conn;
+    char path[MAX_PATH_LEN];
+    // links of a full page are made from it
+    char url[HTTP_HDR_URL_LEN];
+    struct timespec mtime;
+    dirlist_query_t q;
+    struct evbuffer* names;
+    size_t count;
+    // referenced listing, found in the cache or published once read
+    http_dirlist_t* list;
+    // errno of opendir or of the rendering, 0 once the listing is ready
+    int err;
+} dirlist_job_t;
+
+// listing streamed to a connection as its output drains
+typedef struct http_dirlist_stream_t {
+    http_conn_t* conn;
+    // referenced listing
+    http_dirlist_t* list;
+    dirlist_query_t q;
+    http_chunked_t ch;
+    // entries [from, to) are sent, those from next on are still to render
+    size_t from;
+    size_t next;
+    size_t to;
+    // the body has been queued, the request ends once it is written
+    int done;
+} http_dirlist_stream_t;
+
+static pthread_mutex_t dirlist_lock = PTHREAD_MUTEX_INITIALIZER;
+static http_dirlist_t* dirlist_slots[DIRLIST_CACHE_SLOTS];
+
+static void dirlist_release(http_dirlist_t* l) {
+    if (__atomic_sub_fetch(&l->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    free(l->path);
+    free(l->names);
+    free(l->index);
+    free(l->page[DIRLIST_HTML]);
+    free(l->page[DIRLIST_JSON]);
+    free(l);
+}
+
+static void page_sent_cb(const void* data, size_t len, void* arg) {
+    (void)data;
+    (void)len;
+    dirlist_release((http_dirlist_t*)arg);
+}
+
+// get referenced listing of path if it is still current
+static http_dirlist_t* dirlist_lookup(const char* path,
+                                      const struct timespec* mtime) {
+    http_dirlist_t* found = NULL;
+    pthread_mutex_lock(&dirlist_lock);
+    for (int i = 0; i < DIRLIST_CACHE_SLOTS; i++) {
+        http_dirlist_t* l = dirlist_slots[i];
+        if (l != NULL && !strcmp(l->path, path)) {
+            if (l->mtime.tv_sec == mtime->tv_sec &&
+                l->mtime.tv_nsec == mtime->tv_nsec) {
+                __atomic_add_fetch(&l->refs, 1, __ATOMIC_RELAXED);
+                l->used_at = time(NULL);
+                found = l;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dirlist_lock);
+    return found;
+}
+
+// store listing in the slot of its directory, or the least recently used one
+static void dirlist_publish(http_dirlist_t* l) {
+    pthread_mutex_lock(&dirlist_lock);
+    int victim = 0;
+    for (int i = 0; i < DIRLIST_CACHE_SLOTS; i++) {
+        http_dirlist_t* cur = dirlist_slots[i];
+        if (cur == NULL || !strcmp(cur->path, l->path)) {
+            victim = i;
+            break;
+        }
+        if (cur->used_at < dirlist_slots[victim]->used_at)
+            victim = i;
+    }
+    if (dirlist_slots[victim] != NULL)
+        dirlist_release(dirlist_slots[victim]);
+    __atomic_add_fetch(&l->refs, 1, __ATOMIC_RELAXED);
+    l->used_at = time(NULL);
+    dirlist_slots[victim] = l;
+    pthread_mutex_unlock(&dirlist_lock);
+}
+
+// `format=json&page=2&per_page=100`
+static void parse_query(const char* query, dirlist_query_t* q) {
+    q->format = DIRLIST_HTML;
+    q->page = 0;
+    q->per_page = DIRLIST_PER_PAGE;
+    while (*query) {
+        const char* value = strchr(query, '=');
+        const char* end = strchr(query, '&');
+        if (end == NULL)
+            end = query + strlen(query);
+        if (value != NULL && value < end) {
+            size_t key_len = value - query;
+            value++;
+            if (key_len == 6 && !strncmp(query, "format", 6))
+                q->format = strncmp(value, "json", 4) ? DIRLIST_HTML : DIRLIST_JSON;
+            else if (key_len == 4 && !strncmp(query, "page", 4))
+                q->page = strtoul(value, NULL, 10);
+            else if (key_len == 8 && !strncmp(query, "per_page", 8))
+                q->per_page = strtoul(value, NULL, 10);
+        }
+        query = *end ? end + 1 : end;
+    }
+    if (q->per_page == 0)
+        q->per_page = DIRLIST_PER_PAGE;
+    else if (q->per_page > DIRLIST_PER_PAGE_MAX)
+        q->per_page = DIRLIST_PER_PAGE_MAX;
+}
+
+static void add_html_escaped(struct evbuffer* out, const char* s) {
+    const char* run = s;
+    for (; *s; s++) {
+        const char* rep = NULL;
+        switch (*s) {
+            case '&': rep = "&amp;"; break;
+            case '<': rep = "&lt;"; break;
+            case '>': rep = "&gt;"; break;
+            case '"': rep = "&quot;"; break;
+            case '\'': rep = "&#39;"; break;
+            default: continue;
+        }
+        evbuffer_add(out, run, s - run);
+        evbuffer_add(out, rep, strlen(rep));
+        run = s + 1;
+    }
+    evbuffer_add(out, run, s - run);
+}
+
+static void add_json_escaped(struct evbuffer* out, const char* s) {
+    const char* run = s;
+    evbuffer_add(out, "\"", 1);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c != '"' && c != '\\' && c >= 0x20)
+            continue;
+        evbuffer_add(out, run, s - run);
+        if (c == '"' || c == '\\')
+            evbuffer_add_printf(out, "\\%c", c);
+        else
+            evbuffer_add_printf(out, "\\u%04x", c);
+        run = s + 1;
+    }
+    evbuffer_add(out, run, s - run);
+    evbuffer_add(out, "\"", 1);
+}
+
+// percent-encode s into out, which has room for 3 * strlen(s) + 1 bytes.
+// Only unreserved characters are left as they are, and '/' when keep_slash
+// is set, so the result needs no html escaping either
+static size_t url_encode(char* out, const char* s, int keep_slash) {
+    static const char hex[] = "0123456789ABCDEF";
+    char* p = out;
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~' ||
+            (c == '/' && keep_slash)) {
+            *p++ = c;
+        } else {
+            *p++ = '%';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+        }
+    }
+    *p = '\0';
+    return p - out;
+}
+
+// the url path, encoded
+static void add_url(struct evbuffer* out, const char* url) {
+    char buf[3 * HTTP_HDR_URL_LEN + 1];
+    evbuffer_add(out, buf, url_encode(buf, url, 1));
+}
+
+// what comes before the entries, which start at from
+static void render_begin(struct evbuffer* out, http_dirlist_t* l,
+                         const dirlist_query_t* q, const char* url,
+                         size_t from) {
+    if (q->format == DIRLIST_JSON) {
+        evbuffer_add(out, "{\"directory\":", 13);
+        add_json_escaped(out, url);
+        evbuffer_add_printf(out, ",\"total\":%zu,\"offset\":%zu,\"entries\":[",
+                            l->count, from);
+        return;
+    }
+    evbuffer_add(out, HTML_BEFORE_BODY, sizeof(HTML_BEFORE_BODY) - 1);
+}
+
+// entries [from, to) of the listing, first says whether from is the first
+// one of the response. Links are the url of the directory followed by the
+// name, both encoded
+static void render_entries(struct evbuffer* out, http_dirlist_t* l,
+                           const dirlist_query_t* q, const char* url,
+                           size_t from, size_t to, int first,
+                           http_chunked_t* ch) {
+    char prefix[3 * HTTP_HDR_URL_LEN + 2];
+    size_t prefix_len = url_encode(prefix, url, 1);
+    if (prefix_len == 0 || prefix[prefix_len - 1] != '/')
+        prefix[prefix_len++] = '/';
+    char name_buf[3 * NAME_MAX + 1];
+    for (size_t i = from; i < to; i++) {
+        const char* name = l->names + l->index[i];
+        if (q->format == DIRLIST_JSON) {
+            if (i > from || !first)
+                evbuffer_add(out, ",", 1);
+            add_json_escaped(out, name);
+        } else {
+            evbuffer_add(out, "<dd>- <a href=\"", 15);
+            evbuffer_add(out, prefix, prefix_len);
+            evbuffer_add(out, name_buf, url_encode(name_buf, name, 0));
+            evbuffer_add(out, "\">", 2);
+            add_html_escaped(out, name);
+            evbuffer_add(out, "</a></dd>", 9);
+        }
+        if (ch != NULL)
+            http_chunked_coalesce(ch);
+    }
+}
+
+// what comes after the entries, which end before to. Page links go to the
+// url path the listing was asked for
+static void render_end(struct evbuffer* out, http_dirlist_t* l,
+                       const dirlist_query_t* q, const char* url, size_t to) {
+    if (q->format == DIRLIST_JSON) {
+        evbuffer_add(out, "]}", 2);
+        return;
+    }
+    if (q->page > 0) {
+        evbuffer_add(out, "<dd>", 4);
+        if (q->page > 1) {
+            evbuffer_add(out, "<a href=\"", 9);
+            add_url(out, url);
+            evbuffer_add_printf(out,
+                                "?page=%zu&amp;per_page=%zu\">Previous</a> ",
+                                q->page - 1, q->per_page);
+        }
+        if (to < l->count) {
+            evbuffer_add(out, "<a href=\"", 9);
+            add_url(out, url);
+            evbuffer_add_printf(out, "?page=%zu&amp;per_page=%zu\">Next</a>",
+                                q->page + 1, q->per_page);
+        }
+        evbuffer_add(out, "</dd>", 5);
+    }
+    evbuffer_add(out, HTML_AFTER_BODY, sizeof(HTML_AFTER_BODY) - 1);
+}
+
+// whether the full page of the format has been rendered
+static int page_ready(http_dirlist_t* l, enum dirlist_format format) {
+    pthread_mutex_lock(&dirlist_lock);
+    int ready = (l->page[format] != NULL);
+    pthread_mutex_unlock(&dirlist_lock);
+    return ready;
+}
+
+// whether the full listing is answered from a page kept with it, larger
+// ones are streamed
+static int page_cached(http_dirlist_t* l, const dirlist_query_t* q) {
+    return q->page == 0 && l->count <= DIRLIST_PAGE_CACHE_MAX;
+}
+
+// full page of the listing, rendered once on the filesystem pool and then
+// shared. The path of the listing is the url under SERVER_ROOT_DIR, so the
+// links are the same for every request of it
+static int full_page(http_dirlist_t* l, const dirlist_query_t* q,
+                     const char* url) {
+    if (page_ready(l, q->format))
+        return 0;
+
+    struct evbuffer* out = evbuffer_new();
+    if (out == NULL)
+        return -1;
+    render_begin(out, l, q, url, 0);
+    render_entries(out, l, q, url, 0, l->count, 1, NULL);
+    render_end(out, l, q, url, l->count);
+    size_t len = evbuffer_get_length(out);
+    char* page = (char*)malloc(len);
+    if (page == NULL) {
+        evbuffer_free(out);
+        return -1;
+    }
+    evbuffer_remove(out, page, len);
+    evbuffer_free(out);
+
+    pthread_mutex_lock(&dirlist_lock);
+    if (l->page[q->format] == NULL) {
+        l->page[q->format] = page;
+        l->page_len[q->format] = len;
+        page = NULL;
+    }
+    pthread_mutex_unlock(&dirlist_lock);
+    free(page);
+    return 0;
+}
+
+static void stream_cb(struct evbuffer* output,
+                      const struct evbuffer_cb_info* info, void* arg);
+
+// render the next batches of the streamed listing while little output is
+// queued, and end the body after the last one
+static void stream_fill(http_dirlist_stream_t* s) {
+    const char* url = s->conn->hdr.url;
+    struct evbuffer* output = bufferevent_get_output(s->conn->bev);
+    while (s->next < s->to && evbuffer_get_length(output) < FILE_STREAM_CHUNK) {
+        size_t to = s->to - s->next < DIRLIST_STREAM_BATCH
+                        ? s->to
+                        : s->next + DIRLIST_STREAM_BATCH;
+        render_entries(s->ch.pending, s->list, &s->q, url, s->next, to,
+                       s->next == s->from, &s->ch);
+        s->next = to;
+    }
+    if (s->next < s->to || s->done)
+        return;
+    render_end(s->ch.pending, s->list, &s->q, url, s->to);
+    http_chunked_end(&s->ch);
+    evbuffer_remove_cb(output, stream_cb, s->conn);
+    s->done = 1;
+}
+
+static void stream_cb(struct evbuffer* output,
+                      const struct evbuffer_cb_info* info, void* arg) {
+    (void)output;
+    // only render more once the transport has taken some
+    if (info->n_deleted > 0)
+        stream_fill(((http_conn_t*)arg)->listing);
+}
+
+static void stream_free(http_conn_t* conn) {
+    http_dirlist_stream_t* s = conn->listing;
+    if (!s->done) {
+        evbuffer_remove_cb(bufferevent_get_output(conn->bev), stream_cb,
+                           conn);
+        evbuffer_free(s->ch.pending);
+    }
+    dirlist_release(s->list);
+    free(s);
+    conn->listing = NULL;
+}
+
+// stream entries [from, to) of the listing, which is referenced, as the
+// output drains. Only the head is sent for HEAD
+static void stream_listing(http_conn_t* conn, http_dirlist_t* l,
+                           const dirlist_query_t* q, size_t from, size_t to) {
+    int head_only = (conn->hdr.mode == HEAD);
+    const char* type =
+        q->format == DIRLIST_JSON ? CONTENT_TYPE_JSON : CONTENT_TYPE_HTML;
+    http_dirlist_stream_t* s =
+        (http_dirlist_stream_t*)calloc(1, sizeof(http_dirlist_stream_t));
+    if (s == NULL || http_chunked_begin(&s->ch, conn, type, head_only) < 0) {
+        free(s);
+        http_conn_error(conn, HTTP_STATUS_INTERNAL_ERR);
+        return;
+    }
+    if (head_only) {
+        http_chunked_end(&s->ch);
+        free(s);
+        return;
+    }
+    __atomic_add_fetch(&l->refs, 1, __ATOMIC_RELAXED);
+    s->conn = conn;
+    s->list = l;
+    s->q = *q;
+    s->from = s->next = from;
+    s->to = to;
+    conn->listing = s;
+    render_begin(s->ch.pending, l, q, conn->hdr.url, from);
+    if (evbuffer_add_cb(bufferevent_get_output(conn->bev), stream_cb,
+                        conn) == NULL) {
+        stream_free(conn);
+        conn->failed = 1;
+        return;
+    }
+    stream_fill(s);
+    // small listings are queued in one go, the request ends right away
+    if (s->done)
+        stream_free(conn);
+}
+
+int http_dirlist_streamed(http_conn_t* conn) {
+    if (!conn->listing->done)
+        return 0;
+    // responses of other connections were built on the thread while this
+    // one was streamed
+    http_stats_restore(HTTP_STATUS_OK, conn->listing->ch.body);
+    stream_free(conn);
+    return 1;
+}
+
+void http_dirlist_stop(http_conn_t* conn) {
+    if (conn->listing != NULL)
+        stream_free(conn);
+}
+
+// answer with the listing. A full page kept with it must have been
+// rendered already, other listings are streamed
+static void send_listing(http_conn_t* conn, http_dirlist_t* l,
+                         const dirlist_query_t* q) {
+    bfevent_t* client = conn->bev;
+    int alive = conn->hdr.alive;
+    int head_only = (conn->hdr.mode == HEAD);
+    const char* type =
+        q->format == DIRLIST_JSON ? CONTENT_TYPE_JSON : CONTENT_TYPE_HTML;
+
+    if (page_cached(l, q)) {
+        if (l->page[q->format] == NULL) {
+            http_conn_error(conn, HTTP_STATUS_INTERNAL_ERR);
+            return;
+        }
+        http_ok_content(client, l->page_len[q->format], type, alive);
+        if (head_only)
+            return;
+        __atomic_add_fetch(&l->refs, 1, __ATOMIC_RELAXED);
+        if (evbuffer_add_reference(bufferevent_get_output(client),
+                                   l->page[q->format], l->page_len[q->format],
+                                   page_sent_cb, l) < 0)
+            dirlist_release(l);
+        return;
+    }
+    if (q->page == 0) {
+        stream_listing(conn, l, q, 0, l->count);
+        return;
+    }
+
+    // only the requested page is rendered
+    size_t from = l->count;
+    if (q->page - 1 <= l->count / q->per_page)
+        from = (q->page - 1) * q->per_page;
+    if (from > l->count)
+        from = l->count;
+    size_t to = l->count - from < q->per_page ? l->count : from + q->per_page;
+    stream_listing(conn, l, q, from, to);
+}
+
+static void job_free(dirlist_job_t* job) {
+    if (job->names != NULL)
+        evbuffer_free(job->names);
+    if (job->list != NULL)
+        dirlist_release(job->list);
+    free(job);
+}
+
+// turn the names collected by the job into a listing
+static http_dirlist_t* job_publish(dirlist_job_t* job) {
+    http_dirlist_t* l = (http_dirlist_t*)calloc(1, sizeof(http_dirlist_t));
+    if (l == NULL)
+        return NULL;
+    l->refs = 1;
+    l->mtime = job->mtime;
+    l->count = job->count;
+    size_t len = evbuffer_get_length(job->names);
+    l->path = strdup(job->path);
+    l->names = (char*)malloc(len ? len : 1);
+    l->index = (size_t*)malloc((job->count ? job->count : 1) * sizeof(size_t));
+    if (l->path == NULL || l->names == NULL || l->index == NULL) {
+        dirlist_release(l);
+        return NULL;
+    }
+    evbuffer_remove(job->names, l->names, len);
+    size_t pos = 0;
+    for (size_t i = 0; i < l->count; i++) {
+        l->index[i] = pos;
+        pos += strlen(l->names + pos) + 1;
+    }
+    dirlist_publish(l);
+    return l;
+}
+
+// read the whole directory, on a pool thread
+static int job_readdir(dirlist_job_t* job) {
+    DIR* dir = opendir(job->path);
+    if (dir == NULL)
+        return errno;
+    struct dirent* ent = NULL;
+    while ((ent = readdir(dir)) != NULL) {
+        // '.', "..", '.DS_Store' and uploads in progress are all hidden,
+        // none of them is served
+        if (ent->d_name[0] == '.')
+            continue;
+        evbuffer_add(job->names, ent->d_name, strlen(ent->d_name) + 1);
+        job->count++;
+    }
+    closedir(dir);
+    return 0;
+}
+
+// read the directory unless its listing was cached, and render the full
+// page when one is kept for it, on a pool thread. Escaping and formatting
+// every name of a large directory at once would hold up the event loop
+static void job_read(void* arg) {
+    dirlist_job_t* job = (dirlist_job_t*)arg;
+    if (job->list == NULL) {
+        if ((job->err = job_readdir(job)) != 0)
+            return;
+        if ((job->list = job_publish(job)) == NULL) {
+            job->err = ENOMEM;
+            return;
+        }
+    }
+    if (page_cached(job->list, &job->q) &&
+        full_page(job->list, &job->q, job->url) < 0)
+        job->err = ENOMEM;
+}
+
+static void job_done(void* arg, int cancelled) {
+    dirlist_job_t* job = (dirlist_job_t*)arg;
+    if (cancelled) {
+        job_free(job);
+        return;
+    }
+    http_conn_t* conn = job->conn;
+    conn->aio = NULL;
+    if (job->err != 0) {
+        if (job->err == EACCES)
+            http_conn_error(conn, HTTP_STATUS_FORBIDDEN);
+        else
+            http_conn_error(conn, HTTP_STATUS_INTERNAL_ERR);
+    } else {
+        logger(DEBUG, "listed %zu entries of %s", job->list->count, job->path);
+        send_listing(conn, job->list, &job->q);
+    }
+    job_free(job);
+    // a streamed listing ends in http_dirlist_streamed
+    if (conn->listing == NULL)
+        http_conn_resume(conn);
+}
+
+void http_dirlist_send(http_conn_t* conn, const char* path,
+                       const struct stat* st) {
+    logger(DEBUG, "list directory: %s", path);
+    dirlist_query_t q;
+    parse_query(conn->hdr.query, &q);
+    http_dirlist_t* l = dirlist_lookup(path, &st->st_mtim);
+    if (l != NULL && (!page_cached(l, &q) || page_ready(l, q.format))) {
+        send_listing(conn, l, &q);
+        dirlist_release(l);
+        return;
+    }
+
+    dirlist_job_t* job = (dirlist_job_t*)calloc(1, sizeof(dirlist_job_t));
+    if (job == NULL || (job->names = evbuffer_new()) == NULL) {
+        free(job);
+        if (l != NULL)
+            dirlist_release(l);
+        http_conn_error(conn, HTTP_STATUS_INTERNAL_ERR);
+        return;
+    }
+    job->conn = conn;
+    job->q = q;
+    // a cached listing only has its page rendered
+    job->list = l;
+    job->mtime = st->st_mtim;
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    snprintf(job->url, sizeof(job->url), "%s", conn->hdr.url);
+    // the response follows once the directory has been read
+    if ((conn->aio = http_aio_submit(conn->base, job_read, job_done, job)) ==
+        NULL) {
+        job_free(job);
+        http_conn_error(conn, HTTP_STATUS_INTERNAL_ERR);
+    }
+}
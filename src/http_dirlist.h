@@ -0,0 +1,54 @@
+#ifndef __HTTP_DIRLIST_H__
+#define __HTTP_DIRLIST_H__
+
+#include <time.h>
+#include "http_functions.h"
+
+// directories whose listing is kept in memory
+#define DIRLIST_CACHE_SLOTS 64
+// entries per page when only a page number is given
+#define DIRLIST_PER_PAGE 1000
+// most entries a numbered page may ask for
+#define DIRLIST_PER_PAGE_MAX 10000
+// most entries of a listing whose full page is kept with it, larger ones
+// are streamed instead of held in memory as a whole
+#define DIRLIST_PAGE_CACHE_MAX 10000
+// entries rendered at a time while a listing is streamed, on the event loop
+#define DIRLIST_STREAM_BATCH 256
+
+// output formats of a listing
+enum dirlist_format {
+    DIRLIST_HTML = 0,
+    DIRLIST_JSON
+};
+
+// cached listing of one directory, immutable once published
+typedef struct http_dirlist_t {
+    char* path;
+    struct timespec mtime;
+    // NUL separated names in readdir order, index[i] is where name i starts
+    char* names;
+    size_t* index;
+    size_t count;
+    // full pages, rendered on the filesystem pool on first use, for up to
+    // DIRLIST_PAGE_CACHE_MAX entries
+    char* page[2];
+    size_t page_len[2];
+    time_t used_at;
+    int refs;
+} http_dirlist_t;
+
+/*
+    function declarations
+ */
+// answer a directory request, read on the filesystem pool if the listing
+// isn't cached
+void http_dirlist_send(http_conn_t* conn, const char* path,
+                       const struct stat* st);
+// the output of the connection drained while its listing streams. Returns
+// 1 once the whole listing has been written and the request is over
+int http_dirlist_streamed(http_conn_t* conn);
+// drop the listing still streaming to the connection
+void http_dirlist_stop(http_conn_t* conn);
+
+#endif
@@ -0,0 +1,420 @@
+#include "http_encoding.h"
+#include "http_conditional.h"
+#include "logger.h"
+#include <pthread.h>
+#include <zlib.h>
+
+// media types compressed besides text/*
+static const char* compressible_types[] = {
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "image/svg+xml",
+    NULL,
+};
+
+static pthread_mutex_t gzip_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gzip_loaded = PTHREAD_COND_INITIALIZER;
+static http_gzip_t* gzip_slots[HTTP_GZIP_CACHE_SLOTS];
+static size_t gzip_used;
+
+int http_encoding_parse(const char* value) {
+    int encodings = 0;
+    const char* p = value;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        const char* coding = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        size_t len = p - coding;
+        // `;q=0` refuses the coding
+        int refused = 0;
+        while (*p && *p != ',') {
+            if (*p == '=' && p[-1] == 'q')
+                refused = (strtod(p + 1, NULL) <= 0);
+            p++;
+        }
+        if (refused || len == 0)
+            continue;
+        if ((len == 4 && !strncasecmp(coding, "gzip", 4)) ||
+            (len == 1 && *coding == '*'))
+            encodings |= ENCODING_GZIP;
+        else if (len == 2 && !strncasecmp(coding, "br", 2))
+            encodings |= ENCODING_BR;
+    }
+    return encodings;
+}
+
+int http_encoding_compressible(const char* type) {
+    if (!strncmp(type, "text/", 5))
+        return 1;
+    for (int i = 0; compressible_types[i] != NULL; i++) {
+        if (!strcmp(type, compressible_types[i]))
+            return 1;
+    }
+    return 0;
+}
+
+static void gzip_release(http_gzip_t* g) {
+    if (__atomic_sub_fetch(&g->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    free(g->path);
+    free(g->data);
+    free(g);
+}
+
+static void gzip_sent_cb(const void* data, size_t len, void* arg) {
+    (void)data;
+    (void)len;
+    gzip_release((http_gzip_t*)arg);
+}
+
+static int gzip_matches(const http_gzip_t* g, const struct stat* st) {
+    return g->size == st->st_size && g->ino == st->st_ino &&
+           g->mtime.tv_sec == st->st_mtim.tv_sec &&
+           g->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// slot of the variant of path, -1 if none. Caller holds the lock
+static int gzip_find(const char* path) {
+    for (int i = 0; i < HTTP_GZIP_CACHE_SLOTS; i++) {
+        if (gzip_slots[i] != NULL && !strcmp(gzip_slots[i]->path, path))
+            return i;
+    }
+    return -1;
+}
+
+// least recently used slot but keep's, caller holds the lock. Variants
+// being compressed are never evicted
+static int gzip_victim(const http_gzip_t* keep) {
+    int victim = -1;
+    for (int i = 0; i < HTTP_GZIP_CACHE_SLOTS; i++) {
+        http_gzip_t* g = gzip_slots[i];
+        if (g == NULL || g == keep || g->loading)
+            continue;
+        if (victim < 0 || g->used_at < gzip_slots[victim]->used_at)
+            victim = i;
+    }
+    return victim;
+}
+
+static void gzip_evict(int i) {
+    gzip_used -= gzip_slots[i]->len;
+    gzip_release(gzip_slots[i]);
+    gzip_slots[i] = NULL;
+}
+
+// free slot for a new variant, the least recently used one is evicted if
+// need be. -1 when every slot is being compressed. Caller holds the lock
+static int gzip_slot(void) {
+    for (int i = 0; i < HTTP_GZIP_CACHE_SLOTS; i++) {
+        if (gzip_slots[i] == NULL)
+            return i;
+    }
+    int victim = gzip_victim(NULL);
+    if (victim >= 0)
+        gzip_evict(victim);
+    return victim;
+}
+
+// compress the file into g->data, left NULL if it doesn't shrink
+static int gzip_load(http_gzip_t* g) {
+    // the request that got here has the file open already
+    http_open_file_t* file = http_open_cache_get(g->path);
+    if (file == NULL)
+        return -1;
+    int fd = file->fd;
+    if (fd < 0) {
+        http_open_cache_release(file);
+        return -1;
+    }
+    char* src = (char*)malloc(g->size);
+    off_t done = 0;
+    while (src != NULL && done < g->size) {
+        ssize_t n = pread(fd, src + done, g->size - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    http_open_cache_release(file);
+    if (src == NULL || done < g->size) {
+        free(src);
+        return -1;
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 added to the window bits selects the gzip wrapper
+    if (deflateInit2(&zs, HTTP_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(src);
+        return -1;
+    }
+    uLong bound = deflateBound(&zs, g->size);
+    g->data = (char*)malloc(bound);
+    int ret = Z_STREAM_ERROR;
+    if (g->data != NULL) {
+        zs.next_in = (Bytef*)src;
+        zs.avail_in = g->size;
+        zs.next_out = (Bytef*)g->data;
+        zs.avail_out = bound;
+        ret = deflate(&zs, Z_FINISH);
+    }
+    g->len = zs.total_out;
+    deflateEnd(&zs);
+    free(src);
+    if (ret != Z_STREAM_END || g->len >= (size_t)g->size) {
+        free(g->data);
+        g->data = NULL;
+        g->len = 0;
+        if (ret != Z_STREAM_END)
+            return -1;
+    }
+    logger(DEBUG, "gzip %s: %lld -> %zu bytes", g->path, (long long)g->size,
+           g->len);
+    return 0;
+}
+
+// get referenced variant of this version of path, compressing it on a miss.
+// Files that don't shrink are remembered too, so they aren't retried
+static http_gzip_t* gzip_get(const char* path, const struct stat* st) {
+    if (st->st_size < HTTP_GZIP_MIN_SIZE || st->st_size > HTTP_GZIP_MAX_FILE)
+        return NULL;
+    pthread_mutex_lock(&gzip_lock);
+    int i;
+    // another thread is compressing the file, share its result
+    while ((i = gzip_find(path)) >= 0 && gzip_slots[i]->loading)
+        pthread_cond_wait(&gzip_loaded, &gzip_lock);
+    http_gzip_t* g = i >= 0 ? gzip_slots[i] : NULL;
+    if (g != NULL && gzip_matches(g, st)) {
+        __atomic_add_fetch(&g->refs, 1, __ATOMIC_RELAXED);
+        g->used_at = time(NULL);
+        pthread_mutex_unlock(&gzip_lock);
+        return g;
+    }
+    // an older version of the file is replaced
+    if (g != NULL)
+        gzip_evict(i);
+    if ((g = (http_gzip_t*)calloc(1, sizeof(http_gzip_t))) == NULL ||
+        (g->path = strdup(path)) == NULL) {
+        pthread_mutex_unlock(&gzip_lock);
+        free(g);
+        return NULL;
+    }
+    g->mtime = st->st_mtim;
+    g->size = st->st_size;
+    g->ino = st->st_ino;
+    g->used_at = time(NULL);
+    g->refs = 1;
+    // publish a placeholder so concurrent misses wait for this compression
+    if ((i = gzip_slot()) >= 0) {
+        g->loading = 1;
+        g->refs++;
+        gzip_slots[i] = g;
+    }
+    pthread_mutex_unlock(&gzip_lock);
+
+    int ret = gzip_load(g);
+
+    pthread_mutex_lock(&gzip_lock);
+    g->loading = 0;
+    if (i >= 0) {
+        if (ret < 0) {
+            gzip_slots[i] = NULL;
+            gzip_release(g);
+        } else {
+            gzip_used += g->len;
+            int victim;
+            while (gzip_used > HTTP_GZIP_CACHE_SIZE &&
+                   (victim = gzip_victim(g)) >= 0)
+                gzip_evict(victim);
+        }
+    }
+    pthread_cond_broadcast(&gzip_loaded);
+    pthread_mutex_unlock(&gzip_lock);
+    if (ret < 0) {
+        gzip_release(g);
+        return NULL;
+    }
+    return g;
+}
+
+http_gzip_t* http_encoding_gzip(const char* path, const struct stat* st) {
+    http_gzip_t* g = gzip_get(path, st);
+    if (g != NULL && g->data == NULL) {
+        gzip_release(g);
+        g = NULL;
+    }
+    return g;
+}
+
+void http_encoding_gzip_release(http_gzip_t* g) {
+    gzip_release(g);
+}
+
+// head of an encoded response, or of its 304 when the client has it
+static void send_head(http_conn_t* conn, enum http_status status,
+                      const char* type, const char* coding,
+                      const http_validators_t* v, off_t len) {
+    http_response_t resp;
+    http_response_begin(&resp, status);
+    if (status == HTTP_STATUS_OK) {
+        http_response_header(&resp, "Content-Type", type);
+        http_response_header(&resp, "Content-Encoding", coding);
+    }
+    http_response_append(&resp, "Vary: Accept-Encoding\r\n", 23);
+    http_response_validators(&resp, v);
+    if (status == HTTP_STATUS_OK)
+        http_response_length(&resp, len);
+    http_response_end(&resp, conn->hdr.alive);
+    http_response_send(&resp, conn->bev);
+}
+
+// use path + suffix if it exists and is not older than the file
+static int open_sidecar(const char* path, const struct stat* st,
+                        const char* suffix, http_variant_t* var) {
+    char sidecar[MAX_PATH_LEN];
+    if (snprintf(sidecar, sizeof(sidecar), "%s%s", path, suffix) >=
+        (int)sizeof(sidecar))
+        return -1;
+    // most files have no sidecar, the open file cache remembers that too
+    http_open_file_t* file = http_open_cache_get(sidecar);
+    if (file == NULL)
+        return -1;
+    if (file->err != 0 || !S_ISREG(file->st.st_mode) ||
+        file->st.st_mtime < st->st_mtime) {
+        http_open_cache_release(file);
+        return -1;
+    }
+    logger(DEBUG, "found variant %s", sidecar);
+    var->file = file;
+    return 0;
+}
+
+void http_encoding_prepare(const char* path, const struct stat* st,
+                           int encodings, http_variant_t* var) {
+    var->coding = NULL;
+    var->file = NULL;
+    var->gzip = NULL;
+    if ((encodings & ENCODING_BR) && open_sidecar(path, st, ".br", var) == 0) {
+        var->coding = "br";
+        return;
+    }
+    if (!(encodings & ENCODING_GZIP))
+        return;
+    if (open_sidecar(path, st, ".gz", var) == 0) {
+        var->coding = "gzip";
+        return;
+    }
+    http_gzip_t* g = http_encoding_gzip(path, st);
+    if (g != NULL) {
+        var->coding = "gzip";
+        var->gzip = g;
+    }
+}
+
+int http_encoding_sidecars(const char* path, const struct stat* st) {
+    static const struct {
+        const char* suffix;
+        int encoding;
+    } sidecars[] = {{".br", ENCODING_BR}, {".gz", ENCODING_GZIP}};
+    int encodings = 0;
+    // stat rather than the open cache, which may remember a removed file
+    // for a while, the result outlives this request
+    for (size_t i = 0; i < sizeof(sidecars) / sizeof(sidecars[0]); i++) {
+        char sidecar[MAX_PATH_LEN];
+        struct stat sst;
+        if (snprintf(sidecar, sizeof(sidecar), "%s%s", path,
+                     sidecars[i].suffix) < (int)sizeof(sidecar) &&
+            stat(sidecar, &sst) == 0 && S_ISREG(sst.st_mode) &&
+            sst.st_mtime >= st->st_mtime)
+            encodings |= sidecars[i].encoding;
+    }
+    return encodings;
+}
+
+void http_encoding_release(http_variant_t* var) {
+    if (var->file != NULL)
+        http_open_cache_release(var->file);
+    if (var->gzip != NULL)
+        gzip_release(var->gzip);
+    var->file = NULL;
+    var->gzip = NULL;
+    var->coding = NULL;
+}
+
+static void send_sidecar(http_conn_t* conn, const char* type,
+                         http_variant_t* var) {
+    http_open_file_t* file = var->file;
+    http_validators_t v;
+    http_validators_init(&v, &file->st);
+    if (http_conditional_not_modified(&conn->hdr, &v)) {
+        send_head(conn, HTTP_STATUS_NOT_MODIFIED, type, var->coding, &v, 0);
+        http_encoding_release(var);
+        return;
+    }
+    send_head(conn, HTTP_STATUS_OK, type, var->coding, &v, file->st.st_size);
+    if (conn->hdr.mode == HEAD) {
+        http_encoding_release(var);
+        return;
+    }
+    // send_file owns the reference from here on
+    var->file = NULL;
+    if (send_file(conn, file, 0, file->st.st_size) < 0)
+        logger(ERROR, "failed to send %s variant", var->coding);
+}
+
+void http_encoding_send_gzip(http_conn_t* conn, const http_validators_t* v,
+                             const char* type, http_gzip_t* g) {
+    // the variant has a tag of its own, derived from the file's
+    http_validators_t gz = *v;
+    size_t n = strlen(gz.etag);
+    snprintf(gz.etag + n - 1, sizeof(gz.etag) - n + 1, "-gz\"");
+    if (http_conditional_not_modified(&conn->hdr, &gz)) {
+        send_head(conn, HTTP_STATUS_NOT_MODIFIED, type, "gzip", &gz, 0);
+        return;
+    }
+    send_head(conn, HTTP_STATUS_OK, type, "gzip", &gz, g->len);
+    if (conn->hdr.mode == HEAD)
+        return;
+    // the output buffer keeps the variant alive until it is sent
+    __atomic_add_fetch(&g->refs, 1, __ATOMIC_RELAXED);
+    if (evbuffer_add_reference(bufferevent_get_output(conn->bev), g->data,
+                               g->len, gzip_sent_cb, g) < 0)
+        gzip_release(g);
+}
+
+static void send_gzip(http_conn_t* conn, const struct stat* st,
+                      const char* type, http_variant_t* var) {
+    http_validators_t v;
+    http_validators_init(&v, st);
+    http_encoding_send_gzip(conn, &v, type, var->gzip);
+    http_encoding_release(var);
+}
+
+int http_encoding_wanted(const http_headers_t* hdr, const char* path) {
+    // ranges are cut from the identity representation
+    if (hdr->encodings == ENCODING_IDENTITY ||
+        http_header(hdr, HTTP_HEADER_RANGE)[0] != '\0')
+        return 0;
+    char extension[MAX_PATH_LEN];
+    get_file_extension(path, extension);
+    return http_encoding_compressible(get_content_type(extension));
+}
+
+int http_encoding_send(http_conn_t* conn, const char* path,
+                       const struct stat* st, http_variant_t* var) {
+    if (var->coding == NULL)
+        return -1;
+    char extension[MAX_PATH_LEN];
+    get_file_extension(path, extension);
+    const char* type = get_content_type(extension);
+    if (var->gzip != NULL)
+        send_gzip(conn, st, type, var);
+    else
+        send_sidecar(conn, type, var);
+    return 0;
+}
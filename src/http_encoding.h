@@ -0,0 +1,81 @@
+#ifndef __HTTP_ENCODING_H__
+#define __HTTP_ENCODING_H__
+
+#include <time.h>
+#include "http_functions.h"
+
+// files smaller than this aren't worth compressing
+#define HTTP_GZIP_MIN_SIZE 256
+// largest file compressed on the fly
+#define HTTP_GZIP_MAX_FILE (1 << 22)
+// compressed variants kept in memory, and their total size
+#define HTTP_GZIP_CACHE_SLOTS 256
+#define HTTP_GZIP_CACHE_SIZE (1 << 24)
+// zlib compression level of generated variants
+#define HTTP_GZIP_LEVEL 6
+
+// content codings, as bits of http_headers_t.encodings
+enum http_encoding {
+    ENCODING_IDENTITY = 0,
+    ENCODING_GZIP = 1 << 0,
+    ENCODING_BR = 1 << 1
+};
+
+// gzip variant of one version of a file, immutable once published
+typedef struct http_gzip_t {
+    char* path;
+    struct timespec mtime;
+    off_t size;
+    ino_t ino;
+    // NULL when the file doesn't get smaller, identity is served then
+    char* data;
+    size_t len;
+    time_t used_at;
+    int refs;
+    // a thread is compressing the file, others wanting it wait
+    int loading;
+} http_gzip_t;
+
+// encoded variant chosen for a request, found off the event loop
+typedef struct http_variant_t {
+    // "br" or "gzip", NULL when identity has to be sent
+    const char* coding;
+    // referenced precompressed sidecar file, NULL if none
+    http_open_file_t* file;
+    // referenced variant compressed by the server
+    http_gzip_t* gzip;
+} http_variant_t;
+
+/*
+    function declarations
+ */
+// content codings accepted by an Accept-Encoding value
+int http_encoding_parse(const char* value);
+// whether a content type benefits from compression
+int http_encoding_compressible(const char* type);
+// whether the request may get a compressed variant of path
+int http_encoding_wanted(const http_headers_t* hdr, const char* path);
+// find the variant of path for the accepted encodings, opening sidecars
+// and compressing the file as needed. Blocks, runs on the filesystem pool
+void http_encoding_prepare(const char* path, const struct stat* st,
+                           int encodings, http_variant_t* var);
+// answer a GET or HEAD of a regular file with a prepared variant, which is
+// consumed. Returns -1 when it has none and identity has to be sent
+int http_encoding_send(http_conn_t* conn, const char* path,
+                       const struct stat* st, http_variant_t* var);
+// release a prepared variant that won't be sent
+void http_encoding_release(http_variant_t* var);
+// codings of path that have a precompressed sidecar file, as bits of enum
+// http_encoding. Blocks, runs on the filesystem pool
+int http_encoding_sidecars(const char* path, const struct stat* st);
+// referenced variant of this version of path compressed by the server, NULL
+// when the file isn't worth it. Concurrent callers share one compression.
+// Blocks, runs on the filesystem pool
+http_gzip_t* http_encoding_gzip(const char* path, const struct stat* st);
+void http_encoding_gzip_release(http_gzip_t* g);
+// answer a GET or HEAD with g, compressed from the file of validators v,
+// of media type type. The caller keeps its reference
+void http_encoding_send_gzip(http_conn_t* conn, const http_validators_t* v,
+                             const char* type, http_gzip_t* g);
+
+#endif
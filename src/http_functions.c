@@ -1,7 +1,32 @@
 #include "http_functions.h"
+#include "http_aio.h"
+#include "http_bundle.h"
+#include "http_cache.h"
+#include "http_dirlist.h"
+#include "http_multipart.h"
+#include "http_put.h"
+#include "http_ratelimit.h"
+#include "http_chunked.h"
+#include "http_conditional.h"
+#include "http_encoding.h"
+#include "http_range.h"
+#include "http_access.h"
+#include "http_stats.h"
 #include "logger.h"
+#include <netinet/tcp.h>
 
-evutil_socket_t http_init() {
+// read timeouts per enum http_wait and the write timeout, NULL if disabled
+static struct timeval wait_timeouts[3];
+static struct timeval write_timeout;
+static int timeouts_set[3];
+static int write_timeout_set;
+static uint64_t header_timeout_us;
+// connections open over all workers
+static int open_conns;
+// contexts of the connections of this worker, recycled
+static __thread http_pool_t conn_pool = HTTP_POOL_INIT(sizeof(http_conn_t));
+
+evutil_socket_t http_init(int port, int reuse_port, int backlog) {
     // create socket
     evutil_socket_t httpfd = -1;
     if ((httpfd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
@@ -13,20 +38,33 @@ evutil_socket_t http_init() {
     struct sockaddr_in name;
     memset(&name, 0, sizeof(name));
     name.sin_family = AF_INET;
-    name.sin_port = htons(SERVER_PORT);  // SERVER_PORT is in http_response.h
+    name.sin_port = htons(port);
     name.sin_addr.s_addr = htonl(INADDR_ANY);
     // make socket reuseable
     if (evutil_make_listen_socket_reuseable(httpfd) < 0) {
         logger(ERROR, "setsockfd reuseable failed.");
         return -1;
     }
+    // let every worker bind its own listener to the same port
+    if (reuse_port && evutil_make_listen_socket_reuseable_port(httpfd) < 0) {
+        logger(ERROR, "setsockfd reuseport failed.");
+        return -1;
+    }
     // bind socket to ip:port
     if (bind(httpfd, (struct sockaddr*)&name, sizeof(name)) < 0) {
         logger(ERROR, "failed to bind.");
         return -1;
     }
-    // listen for connections
-    if (listen(httpfd, 5) < 0) {
+    // only wake up for connections that have sent their request, and let
+    // returning clients send it along with the SYN. Both are optional
+    int defer = HTTP_DEFER_ACCEPT_SEC, qlen = HTTP_FASTOPEN_QLEN;
+    if (setsockopt(httpfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer,
+                   sizeof(defer)) < 0)
+        logger(WARNING, "TCP_DEFER_ACCEPT unavailable: %s", strerror(errno));
+    if (setsockopt(httpfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) < 0)
+        logger(WARNING, "TCP_FASTOPEN unavailable: %s", strerror(errno));
+    // listen for connections, the kernel caps backlog at somaxconn
+    if (listen(httpfd, backlog) < 0) {
         logger(ERROR, "fail to listen.");
         return -1;
     }
@@ -35,32 +73,6 @@ evutil_socket_t http_init() {
     return (httpfd);
 }
 
-int get_line_from_bufferevent(bfevent_t* bev, char* buf) {
-    // param: bev buf
-    // return: the length of line
-    int ret = 0, i = 0;
-    char c = '\0', c_b = '\0';
-    // read characters one by one, and add them into buf[]
-    while ((i < MAX_LINE_LEN - 1) && (c != '\n')) {
-        ret = bufferevent_read(bev, &c, 1);
-        // logger(DEBUG,"ret = %d, char = %c", ret, c);
-        if (ret > 0) {
-            // stop when encounters "\r\n"
-            if ((c_b == '\r') && (c == '\n')) {
-                buf[i - 1] = c;
-                break;
-            }
-            c_b = c;
-            buf[i++] = c;
-        } else {
-            c = '\n';
-        }
-    }
-    // add '\0' to the end of the string
-    buf[i] = '\0';
-    return (i);
-}
-
 char* get_method_from_str(char* buf, http_headers_t* hdr) {
     int i = 0;
     while (!isSpace(buf[i]) && (i < HTTP_HDR_METHOD_LEN - 1)) {
@@ -72,6 +84,10 @@ char* get_method_from_str(char* buf, http_headers_t* hdr) {
         hdr->mode = GET;
     else if (!strcasecmp(hdr->method, "POST"))
         hdr->mode = POST;
+    else if (!strcasecmp(hdr->method, "HEAD"))
+        hdr->mode = HEAD;
+    else if (!strcasecmp(hdr->method, "PUT"))
+        hdr->mode = PUT;
     else
         hdr->mode = NOT_IMPLEMENT;
     return (buf + i);
@@ -79,180 +95,523 @@ char* get_method_from_str(char* buf, http_headers_t* hdr) {
 
 char* get_url_from_str(char* buf, http_headers_t* hdr) {
     int i = 0, j = 0;
-    while (isSpace(buf[i]) && (i < MAX_LINE_LEN))
+    while (isSpace(buf[i]))
         i++;
-    while (!isSpace(buf[i]) && (i < MAX_LINE_LEN) && (j < HTTP_HDR_URL_LEN - 1))
-        hdr->url[j++] = buf[i++];
-    hdr->url[j] = '\0';
-    // if method is GET, ignore query string when setting url
-    char* query_string = NULL;
-    if (hdr->mode == GET) {
-        query_string = hdr->url;
-        while ((*query_string != '?') && (*query_string != '\0'))
-            query_string++;
-        if (*query_string == '?') {
+    while (!isSpace(buf[i + j]) && (buf[i + j] != '\0'))
+        j++;
+    if (j > HTTP_HDR_URL_LEN - 1)
+        return NULL;
+    // the url stays in the request line, cut off after the version is read
+    hdr->url = buf + i;
+    i += j;
+    // if method is GET or HEAD, ignore query string when setting url
+    if (hdr->mode == GET || hdr->mode == HEAD) {
+        char* query_string = memchr(hdr->url, '?', j);
+        if (query_string != NULL) {
             *query_string = '\0';
-            query_string++;
+            hdr->query = query_string + 1;
         }
-        strcpy(hdr->query, query_string);
     }
     return (buf + i);
 }
 
 void get_version_from_str(char* buf, http_headers_t* hdr) {
     int i = 0, j = 0;
-    while (isSpace(buf[i]) && (i < MAX_LINE_LEN))
+    while (isSpace(buf[i]))
         i++;
-    while (!isSpace(buf[i]) && (buf[i] != '\n') && (i < MAX_LINE_LEN) &&
+    while (!isSpace(buf[i]) && (buf[i] != '\0') &&
            (j < HTTP_HDR_VERSION_LEN - 1))
         hdr->version[j++] = buf[i++];
     hdr->version[j] = '\0';
 }
 
-int get_first_header(bfevent_t* bev, http_headers_t* hdr) {
-    char buf[MAX_LINE_LEN];
-    // get first line of the header -> `Method URI Version\r\n`
-    // size_t recv_bytes = get_line_from_bufferevent(bev, buf);
-    get_line_from_bufferevent(bev, buf);
+// whether the url path has a ".." segment, which would leave the root once
+// it is appended to SERVER_ROOT_DIR
+static int url_climbs(const char* url) {
+    const char* p = url;
+    while ((p = strstr(p, "..")) != NULL) {
+        if (p[-1] == '/' && (p[2] == '/' || p[2] == '\0'))
+            return 1;
+        p++;
+    }
+    return 0;
+}
+
+// whether a segment of the url names a hidden file. Uploads in progress
+// are kept in such files next to their target, and are never served
+static int url_hidden(const char* url) {
+    return strstr(url, "/.") != NULL;
+}
+
+// decode %XX escapes of the url in place, -1 on a malformed one or on an
+// escaped '\0', which would cut the path short
+static int url_decode(char* url) {
+    char* out = url;
+    for (char* p = url; *p; p++) {
+        if (*p != '%') {
+            *out++ = *p;
+            continue;
+        }
+        if (!isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2]))
+            return -1;
+        char hex[3] = {p[1], p[2], '\0'};
+        if ((*out++ = (char)strtol(hex, NULL, 16)) == '\0')
+            return -1;
+        p += 2;
+    }
+    *out = '\0';
+    return 0;
+}
+
+int get_first_header(char* line, http_headers_t* hdr) {
+    // first line of the header -> `Method URI Version`
     // parse method
-    char* anchor = get_method_from_str(buf, hdr);
+    char* anchor = get_method_from_str(line, hdr);
     logger(DEBUG, "Method: %s", hdr->method);
-    if (hdr->mode == NOT_IMPLEMENT) {
+    if (hdr->mode == NOT_IMPLEMENT)
         logger(DEBUG, "Method [%s] not implemented.", hdr->method);
-        http_not_implemented(bev);
-        return -1;
-    }
     // parse url
-    anchor = get_url_from_str(anchor, hdr);
-    logger(DEBUG, "url: %s", hdr->url);
+    if ((anchor = get_url_from_str(anchor, hdr)) == NULL)
+        return -1;
     // parse version
     get_version_from_str(anchor, hdr);
+    *anchor = '\0';
+    logger(DEBUG, "url: %s", hdr->url);
     logger(DEBUG, "http version: %s", hdr->version);
+    // HTTP/1.1 connections are persistent unless told otherwise
+    hdr->alive = !strcmp(hdr->version, "HTTP/1.1");
+    // every file the server reads or writes is found from the url, the
+    // POST and PUT targets included. Escapes are decoded first, so an
+    // escaped ".." is caught too
+    if (url_decode(hdr->url) < 0 || hdr->url[0] != '/' ||
+        url_climbs(hdr->url) ||
+        strncmp(hdr->version, "HTTP/", 5))
+        return -1;
     return 0;
 }
 
-int get_other_headers(bfevent_t* bev, http_headers_t* hdr) {
-    char buf[MAX_LINE_LEN];
-    char key[MAX_LINE_LEN];
-    char value[MAX_LINE_LEN];
-    memset(buf, 0, MAX_LINE_LEN);
-    memset(key, 0, MAX_LINE_LEN);
-    memset(value, 0, MAX_LINE_LEN);
-    size_t recv_bytes = 1;
-    // while ((recv_bytes > 0) && strcmp("\n", buf)) {
-    while ((recv_bytes > 0)) {
-        recv_bytes = get_line_from_bufferevent(bev, buf);
-        logger(DEBUG, "line: %s", buf);
-        int i = 0, j = 0;
-        while ((buf[i] != ':') && (i < (MAX_LINE_LEN - 1))) {
-            key[i] = buf[i];
-            i++;
-        }
-        key[i++] = '\0';  // avoid ':'
-        if (!strcasecmp(key, "Connection")) {
-            while (isSpace(buf[i]) && (i < MAX_LINE_LEN))
-                i++;
-            while ((buf[i] != '\n') && (i < (MAX_LINE_LEN - 1)))
-                value[j++] = buf[i++];
-            value[j] = '\0';
-            if (!strcasecmp(value, "keep-alive")) {
+void http_headers_clear(http_headers_t* hdr) {
+    memset(hdr, 0, sizeof(http_headers_t));
+    hdr->url = hdr->query = hdr->boundary = "";
+}
+
+int get_other_headers(char* line, http_headers_t* hdr) {
+    // `Key: value`, split in place
+    logger(DEBUG, "line: %s", line);
+    char* key = line;
+    char* value = strchr(line, ':');
+    if (value == NULL)
+        return -1;
+    size_t key_len = value - key;
+    *value++ = '\0';
+    while (isSpace(*value))
+        value++;
+    // trim trailing whitespace of the value
+    char* end = value + strlen(value);
+    while (end > value && isSpace(end[-1]))
+        *--end = '\0';
+
+    enum http_header_id id = http_header_lookup(key, key_len);
+    if (id == HTTP_HEADER_UNKNOWN)
+        return 0;
+    // a repeated header replaces the earlier value
+    hdr->known[id].off = value - hdr->head;
+    hdr->known[id].len = end - value;
+    switch (id) {
+        case HTTP_HEADER_CONNECTION:
+            if (strcasestr(value, "close")) {
+                hdr->alive = 0;
+            } else if (strcasestr(value, "keep-alive")) {
                 hdr->alive = 1;
                 logger(DEBUG, "Connection need keep alive!");
             }
-        } else if (!strcasecmp(key, "Content-Type")) {
-            while (isSpace(buf[i]) && (i < MAX_LINE_LEN))
-                i++;
-            while ((buf[i] != ';') && (i < (MAX_LINE_LEN - 1)))
-                value[j++] = buf[i++];
-            value[j] = '\0';
-            j = 0;
-            if (!strcasecmp(value, "multipart/form-data")) {
-                while ((isSpace(buf[i]) || buf[i] != '=') && (i < MAX_LINE_LEN))
-                    i++;
-                i++;
-                while ((buf[i] != '\n') && (i < (MAX_LINE_LEN - 1)))
-                    hdr->boundary[j++] = buf[i++];
-                hdr->boundary[j] = '\0';
-                logger(DEBUG, "%s boundary: %s", hdr->method, hdr->boundary);
+            break;
+        case HTTP_HEADER_CONTENT_TYPE:
+            if (!strncasecmp(value, "multipart/form-data", 19)) {
+                char* boundary = strstr(value, "boundary=");
+                if (boundary != NULL) {
+                    hdr->boundary = boundary + 9;
+                    if (strlen(hdr->boundary) > HTTP_HDR_BOUNDARY_LEN - 1)
+                        return -1;
+                    logger(DEBUG, "%s boundary: %s", hdr->method,
+                           hdr->boundary);
+                }
             }
-        } else if (!strcasecmp(key, "Content-Length")) {
-            while (isSpace(buf[i]) && (i < MAX_LINE_LEN))
-                i++;
-            while ((buf[i] != '\n') && (i < (MAX_LINE_LEN - 1)))
-                value[j++] = buf[i++];
-            value[j] = '\0';
-            hdr->length = atoi(value);
-            logger(DEBUG, "content length: %d", hdr->length);
-        } else
-            continue;
+            break;
+        case HTTP_HEADER_ACCEPT_ENCODING:
+            hdr->encodings = http_encoding_parse(value);
+            break;
+        case HTTP_HEADER_TRANSFER_ENCODING:
+            // chunked overrides any Content-Length
+            hdr->chunked = (strcasestr(value, "chunked") != NULL);
+            logger(DEBUG, "chunked body: %d", hdr->chunked);
+            break;
+        case HTTP_HEADER_CONTENT_LENGTH: {
+            // digits only, a negative or garbled length can't frame a body
+            char* digits_end = NULL;
+            errno = 0;
+            hdr->length = strtoll(value, &digits_end, 10);
+            if (!isdigit((unsigned char)value[0]) || *digits_end != '\0' ||
+                errno == ERANGE)
+                return -1;
+            logger(DEBUG, "content length: %lld", (long long)hdr->length);
+            break;
+        }
+        default:
+            // read through http_header() by whoever needs it
+            break;
     }
     return 0;
 }
 
-int parse_http_header(bfevent_t* bev, http_headers_t* hdr) {
-    if (get_first_header(bev, hdr) < 0)
-        return -1;
-    if (get_other_headers(bev, hdr) < 0)
-        return -1;
-    return 0;
+// take the complete head of hdr_bytes out of the input with one copy and
+// parse it in place, headers become views into the copy
+static int parse_head(http_conn_t* conn, struct evbuffer* input) {
+    http_headers_t* hdr = &conn->hdr;
+    size_t len = conn->hdr_bytes;
+    char* head = (char*)http_arena_alloc(&conn->arena, len + 1);
+    if (head == NULL || evbuffer_remove(input, head, len) != (int)len)
+        return HTTP_PARSE_ERROR;
+    head[len] = '\0';
+    hdr->head = head;
+    hdr->head_len = len;
+    char* end = head + len;
+    char* line = head;
+    while (line < end) {
+        // every line of the head ends with '\n', maybe after '\r'
+        char* next = (char*)memchr(line, '\n', end - line) + 1;
+        char* eol = next - 1;
+        *eol = '\0';
+        if (eol > line && eol[-1] == '\r')
+            *--eol = '\0';
+        int ret = 0;
+        if (line == head) {
+            ret = get_first_header(line, hdr);
+            hdr->fields = next - head;
+        } else if (eol == line) {
+            break;
+        } else {
+            ret = get_other_headers(line, hdr);
+        }
+        if (ret < 0)
+            return HTTP_PARSE_ERROR;
+        line = next;
+    }
+    return HTTP_PARSE_DONE;
 }
 
-void get_current_directory(char* directory, char* cur_dir) {
-    int i = strlen(directory) - 1;
-    while (i--) {
-        if (directory[i] == '/')
-            break;
+int parse_http_header(http_conn_t* conn) {
+    struct evbuffer* input = bufferevent_get_input(conn->bev);
+    while (conn->parse_state != PARSE_DONE) {
+        // look for the end of the next line, starting where the previous
+        // callback stopped so that no byte is scanned twice
+        struct evbuffer_ptr pos;
+        size_t eol_len = 0;
+        evbuffer_ptr_set(input, &pos, conn->scan_pos, EVBUFFER_PTR_SET);
+        pos = evbuffer_search_eol(input, &pos, &eol_len, EVBUFFER_EOL_CRLF);
+        if (pos.pos < 0) {
+            size_t avail = evbuffer_get_length(input);
+            if (avail - conn->hdr_bytes > HTTP_HDR_LINE_LEN)
+                return HTTP_PARSE_ERROR;
+            // a trailing '\r' may be completed by the next segment
+            conn->scan_pos = avail > conn->hdr_bytes ? avail - 1 : avail;
+            return HTTP_PARSE_AGAIN;
+        }
+        size_t line_len = pos.pos - conn->hdr_bytes;
+        if (line_len > HTTP_HDR_LINE_LEN ||
+            conn->hdr_bytes + line_len + eol_len > HTTP_HDR_MAX_SIZE)
+            return HTTP_PARSE_ERROR;
+        if (conn->parse_state == PARSE_REQUEST_LINE) {
+            // ignore empty lines before the request line
+            if (line_len == 0) {
+                evbuffer_drain(input, eol_len);
+                conn->scan_pos = 0;
+                continue;
+            }
+            conn->parse_state = PARSE_HEADERS;
+        } else if (line_len == 0) {
+            conn->parse_state = PARSE_DONE;
+        }
+        conn->hdr_bytes += line_len + eol_len;
+        conn->scan_pos = conn->hdr_bytes;
     }
-    strcpy(cur_dir, directory + 1 + i);
+    return parse_head(conn, input);
 }
 
-void send_directory_to_client(bfevent_t* client, char* directory) {
-    logger(DEBUG, "list directory: %s", directory);
-    char cur_dir[MAX_PATH_LEN];
-    get_current_directory(directory, cur_dir);
+void http_conn_init(int idle, int header, int body) {
+    int secs[3] = {idle, header, body};
+    for (int i = 0; i < 3; i++) {
+        wait_timeouts[i].tv_sec = secs[i];
+        timeouts_set[i] = (secs[i] > 0);
+    }
+    header_timeout_us = (uint64_t)header * 1000000;
+    // a response stalls as long as a body may
+    write_timeout.tv_sec = body;
+    write_timeout_set = (body > 0);
+}
 
-    DIR* dir = NULL;
-    if (!(dir = opendir(directory))) {
-        if (errno == EACCES) {
-            http_forbidden(client);
-        } else {
-            http_internal_server_error(client);
-        }
+http_conn_t* http_conn_new(struct event_base* base, bfevent_t* bev) {
+    size_t carved = conn_pool.total;
+    http_conn_t* conn = (http_conn_t*)http_pool_alloc(&conn_pool);
+    if (conn == NULL)
+        return NULL;
+    if (conn_pool.total != carved)
+        http_stats_contexts(conn_pool.total);
+    // the arena's bytes are never read before they are written
+    memset(conn, 0, offsetof(http_conn_t, arena));
+    http_arena_init(&conn->arena);
+    http_headers_clear(&conn->hdr);
+    conn->base = base;
+    conn->bev = bev;
+    // a new client has as long to send its first request as any other head
+    conn->wait = WAIT_HEAD;
+    http_conn_timeouts(conn);
+    __atomic_add_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+    return conn;
+}
+
+int http_conn_count(void) {
+    return __atomic_load_n(&open_conns, __ATOMIC_RELAXED);
+}
+
+void http_conn_timeouts(http_conn_t* conn) {
+    bufferevent_set_timeouts(
+        conn->bev, timeouts_set[conn->wait] ? &wait_timeouts[conn->wait] : NULL,
+        write_timeout_set ? &write_timeout : NULL);
+}
+
+// switch the read timeout, only when it changes since rearming isn't free
+static void conn_wait(http_conn_t* conn, enum http_wait wait) {
+    if (conn->wait == wait)
+        return;
+    conn->wait = wait;
+    http_conn_timeouts(conn);
+}
+
+void http_conn_timeout(http_conn_t* conn, short what) {
+    logger(INFO, "connection timed out while %s",
+           (what & BEV_EVENT_WRITING) ? "writing"
+           : conn->wait == WAIT_IDLE  ? "idle"
+           : conn->wait == WAIT_HEAD  ? "reading a request head"
+                                      : "reading a request body");
+    // a client that started a request is told why it is dropped
+    struct evbuffer* input = bufferevent_get_input(conn->bev);
+    if ((what & BEV_EVENT_READING) && conn->wait == WAIT_HEAD &&
+        !conn->paused &&
+        (conn->hdr_bytes > 0 || evbuffer_get_length(input) > 0)) {
+        http_request_timeout(conn->bev);
+        http_conn_close_after_write(conn);
+        return;
+    }
+    http_conn_free(conn);
+}
+
+// upload body being received, its parts are written on the filesystem pool
+typedef struct http_upload_t {
+    http_conn_t* conn;
+    http_multipart_t mp;
+    // decoder of the body when it is chunked, NULL otherwise
+    http_chunk_decoder_t* decoder;
+    // body handed to the pool, what the parser leaves waits for more
+    struct evbuffer* spool;
+    // every chunk of the body has been decoded
+    int decoded;
+    // result of the last http_multipart_feed
+    int ret;
+} http_upload_t;
+
+static void file_stream_cb(struct evbuffer* output,
+                           const struct evbuffer_cb_info* info,
+                           void* arg);
+static void upload_free(http_conn_t* conn);
+static void put_free(http_conn_t* conn);
+static void http_conn_process(http_conn_t* conn);
+
+static void file_stream_stop(http_conn_t* conn) {
+    http_file_stream_t* stream = &conn->stream;
+    if (stream->file == NULL)
+        return;
+    evbuffer_remove_cb(bufferevent_get_output(conn->bev), file_stream_cb,
+                       conn);
+    http_open_cache_release(stream->file);
+    stream->file = NULL;
+    stream->remaining = 0;
+}
+
+void http_conn_free(http_conn_t* conn) {
+    __atomic_sub_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+    http_stats_closed();
+    file_stream_stop(conn);
+    http_dirlist_stop(conn);
+    // work still running releases what it was given, an upload or a PUT
+    // included
+    if (conn->aio != NULL)
+        http_aio_cancel(conn->aio);
+    else if (conn->upload != NULL)
+        upload_free(conn);
+    else if (conn->put != NULL)
+        put_free(conn);
+    http_ratelimit_leave(conn);
+    bufferevent_free(conn->bev);
+    http_arena_reset(&conn->arena);
+    http_pool_free(&conn_pool, conn);
+}
+
+static void close_after_write_cb(bfevent_t* bev, void* arg) {
+    (void)bev;
+    http_conn_free((http_conn_t*)arg);
+}
+
+// the response of the current request is queued
+static void request_end(http_conn_t* conn) {
+    if (conn->started == 0)
+        return;
+    uint64_t us = http_stats_now() - conn->started;
+    http_stats_latency(us);
+    if (log_access_enabled())
+        http_access_log(conn, us);
+    conn->started = 0;
+}
+
+void http_conn_close_after_write(http_conn_t* conn) {
+    request_end(conn);
+    bufferevent_disable(conn->bev, EV_READ);
+    if (evbuffer_get_length(bufferevent_get_output(conn->bev)) == 0) {
+        http_conn_free(conn);
         return;
     }
+    // the write callback runs once the output buffer has drained
+    bufferevent_event_cb event_cb = NULL;
+    bufferevent_getcb(conn->bev, NULL, NULL, &event_cb, NULL);
+    bufferevent_setcb(conn->bev, NULL, close_after_write_cb, event_cb, conn);
+}
 
-    http_ok(client);
+void http_conn_eof(http_conn_t* conn) {
+    conn->eof = 1;
+    // a paused connection closes once its queued requests are answered
+    if (!conn->paused)
+        http_conn_close_after_write(conn);
+}
 
-    int sz = 0;
-    char buffer[MAX_LINE_LEN];
-    struct dirent* myDir = NULL;
-    sz = sprintf(buffer, "%s", HTML_BEFORE_BODY);
-    bufferevent_write(client, buffer, sz);
-    logger(DEBUG, "%s", buffer);
-    while ((myDir = readdir(dir)) != NULL) {
-        // ignore '.' and ".." in current directory, plus '.DS_Store'
-        if (strcmp(myDir->d_name, "..") && strcmp(myDir->d_name, ".") &&
-            strcmp(myDir->d_name, ".DS_Store")) {
-            sz = sprintf(buffer, "<dd>- <a href=\"%s/%s\">%s</a></dd>", cur_dir,
-                         myDir->d_name, myDir->d_name);
-            bufferevent_write(client, buffer, sz);
-            logger(DEBUG, "%s", buffer);
+void http_conn_reset(http_conn_t* conn) {
+    request_end(conn);
+    http_headers_clear(&conn->hdr);
+    http_arena_reset(&conn->arena);
+    conn->head_deadline = 0;
+    conn->parse_state = PARSE_REQUEST_LINE;
+    conn->scan_pos = 0;
+    conn->hdr_bytes = 0;
+}
+
+// read the next pieces of the file straight into the output buffer, keeping
+// at most FILE_STREAM_CHUNK bytes of it queued at any time
+static void file_stream_fill(http_conn_t* conn) {
+    http_file_stream_t* stream = &conn->stream;
+    struct evbuffer* output = bufferevent_get_output(conn->bev);
+    while (stream->remaining > 0 &&
+           evbuffer_get_length(output) < FILE_STREAM_CHUNK) {
+        size_t want = stream->remaining < FILE_STREAM_CHUNK
+                          ? (size_t)stream->remaining
+                          : FILE_STREAM_CHUNK;
+        struct evbuffer_iovec vec;
+        if (evbuffer_reserve_space(output, want, &vec, 1) < 1) {
+            logger(ERROR, "failed to reserve space for file stream");
+            break;
+        }
+        ssize_t n = pread(stream->file->fd, vec.iov_base, want, stream->offset);
+        if (n <= 0) {
+            logger(ERROR, "failed to read file: %s",
+                   n < 0 ? strerror(errno) : "unexpected end of file");
+            break;
         }
+        vec.iov_len = n;
+        stream->offset += n;
+        stream->remaining -= n;
+        evbuffer_commit_space(output, &vec, 1);
+    }
+    if (stream->remaining > 0 && evbuffer_get_length(output) == 0) {
+        // the response is cut short, only closing can tell the client
+        conn->failed = 1;
+        file_stream_stop(conn);
+    } else if (stream->remaining <= 0) {
+        file_stream_stop(conn);
+    }
+}
+
+static void file_stream_cb(struct evbuffer* output,
+                           const struct evbuffer_cb_info* info,
+                           void* arg) {
+    (void)output;
+    // only refill once the transport has drained something
+    if (info->n_deleted > 0)
+        file_stream_fill((http_conn_t*)arg);
+}
+
+int http_conn_can_sendfile(http_conn_t* conn) {
+#ifndef HTTP_DISABLE_SENDFILE
+    // a socket bufferevent drains straight to its fd, so libevent hands the
+    // file to sendfile(2) and the bytes never enter user space. It sends
+    // whole segments though, past the rate limits of the bufferevent
+    return !conn->tls && bufferevent_get_underlying(conn->bev) == NULL &&
+           !http_ratelimit_downloads();
+#else
+    (void)conn;
+    return 0;
+#endif
+}
+
+static void segment_done_cb(struct evbuffer_file_segment const* seg,
+                            int flags, void* arg) {
+    (void)seg;
+    (void)flags;
+    http_open_cache_release((http_open_file_t*)arg);
+}
+
+struct evbuffer_file_segment* http_file_segment(http_open_file_t* file) {
+    // the descriptor is shared, the segment holds a reference instead of
+    // closing it
+    struct evbuffer_file_segment* seg =
+        evbuffer_file_segment_new(file->fd, 0, file->st.st_size, 0);
+    if (seg == NULL) {
+        http_open_cache_release(file);
+        return NULL;
     }
-    sz = sprintf(buffer, "%s", HTML_AFTER_BODY);
-    bufferevent_write(client, buffer, sz);
-    logger(DEBUG, "%s", buffer);
-    closedir(dir);
+    evbuffer_file_segment_add_cleanup_cb(seg, segment_done_cb, file);
+    return seg;
 }
 
-void send_file(bfevent_t* client, FILE* fp) {
-    char buf[1024];
-    fgets(buf, sizeof(buf), fp);
-    while (!feof(fp)) {
-        // logger(DEBUG, "%s", buf);
-        bufferevent_write(client, buf, strlen(buf));
-        fgets(buf, sizeof(buf), fp);
+int send_file(http_conn_t* conn, http_open_file_t* file, off_t offset,
+              off_t length) {
+    struct evbuffer* output = bufferevent_get_output(conn->bev);
+    if (length <= 0) {
+        http_open_cache_release(file);
+        return 0;
     }
+    if (http_conn_can_sendfile(conn)) {
+        struct evbuffer_file_segment* seg = http_file_segment(file);
+        if (seg == NULL)
+            return -1;
+        int ret = evbuffer_add_file_segment(output, seg, offset, length);
+        evbuffer_file_segment_free(seg);
+        return ret;
+    }
+    // filtering transports need the bytes in memory, stream them in
+    // bounded pieces as the output buffer drains
+    file_stream_stop(conn);
+    conn->stream.file = file;
+    conn->stream.offset = offset;
+    conn->stream.remaining = length;
+    if (evbuffer_add_cb(output, file_stream_cb, conn) == NULL) {
+        conn->stream.file = NULL;
+        http_open_cache_release(file);
+        return -1;
+    }
+    file_stream_fill(conn);
+    return 0;
+}
+
+void http_conn_error(http_conn_t* conn, enum http_status status) {
+    http_error(conn->bev, status, conn->hdr.alive, conn->hdr.mode == HEAD);
 }
 
 void get_file_extension(const char* file_name, char* extension) {
@@ -264,137 +623,772 @@ void get_file_extension(const char* file_name, char* extension) {
     strcpy(extension, file_name + i + 1);
 }
 
-void send_file_to_client(bfevent_t* client, char* file_name) {
+void send_file_to_client(http_conn_t* conn, http_open_file_t* file) {
+    const char* file_name = file->path;
+    const struct stat* st = &file->st;
     logger(DEBUG, "GET %s", file_name);
-
-    FILE* fp = NULL;
-    if ((fp = fopen(file_name, "r")) != NULL) {
-        struct stat st;
-        if (stat(file_name, &st) == -1) {
-            fclose(fp);
-            http_internal_server_error(client);
+    bfevent_t* client = conn->bev;
+    char extension[MAX_PATH_LEN];
+    get_file_extension(file_name, extension);
+    http_headers_t* hdr = &conn->hdr;
+    http_validators_t v;
+    http_validators_init(&v, st);
+    const char* range = http_header(hdr, HTTP_HEADER_RANGE);
+    const char* if_range = http_header(hdr, HTTP_HEADER_IF_RANGE);
+    if (hdr->mode == GET && range[0] != '\0' &&
+        (if_range[0] == '\0' || http_range_if_range(if_range, &v))) {
+        http_range_t ranges[HTTP_RANGE_MAX];
+        int n = http_range_parse(range, st->st_size, ranges);
+        if (n < 0) {
+            http_range_not_satisfiable(client, st->st_size, hdr->alive);
+            http_open_cache_release(file);
+            return;
+        }
+        if (n > 0) {
+            if (http_range_send(conn, file, get_content_type(extension),
+                                ranges, n) < 0)
+                logger(ERROR, "failed to send ranges of %s", file_name);
             return;
         }
-        char extension[MAX_PATH_LEN];
-        get_file_extension(file_name, extension);
-        http_ok_send_file(client, st.st_size, extension);
-        send_file(client, fp);
-    } else
-        http_not_found(client);
-
-    fclose(fp);
-}
-
-void get_start_and_end_boundary(char* start, char* end, const char* boundary) {
-    memset(start, 0, sizeof(char) * MAX_LINE_LEN);
-    memset(end, 0, sizeof(char) * MAX_LINE_LEN);
-    strcat(start, "--");
-    strcat(start, boundary);
-    strcat(start, "\n");
-    strcat(end, "--");
-    strcat(end, boundary);
-    strcat(end, "--\n");
-}
-
-void recv_file_from_client(bfevent_t* bev, char* path, http_headers_t* hdr) {
-    // content-length = len(--boundary)
-    //                + len(--boundary--)
-    //                + len(Content-Disposition:line)
-    //                + len(Content-Type:line)
-    //                + len(content-body)
+    }
+    http_ok_send_file(client, st->st_size, extension, &v, conn->hdr.alive);
+    if (hdr->mode == HEAD) {
+        http_open_cache_release(file);
+        return;
+    }
+    if (send_file(conn, file, 0, st->st_size) < 0)
+        logger(ERROR, "failed to send file %s", file_name);
+}
+
+static void upload_destroy(http_upload_t* up) {
+    http_multipart_cleanup(&up->mp);
+    if (up->decoder != NULL) {
+        http_chunk_decoder_cleanup(up->decoder);
+        free(up->decoder);
+    }
+    if (up->spool != NULL)
+        evbuffer_free(up->spool);
+    free(up);
+}
+
+void recv_file_from_client(http_conn_t* conn, char* path) {
+    // the body is consumed by recv_file_body as it arrives
     logger(DEBUG, "receiving file from client.");
-    if (hdr->length == 0 && hdr->mode == POST) {
-        logger(DEBUG, "Receive file => length == 0");
-        http_internal_server_error(bev);
-        return;
-    }
-    FILE* fp = NULL;
-    if ((fp = fopen(path, "w")) == NULL) {
-        logger(DEBUG, "Failed to create file %s", path);
-        http_internal_server_error(bev);
-        return;
-    }
-
-    // get start boundary and end boundary from header
-    char start_bound[MAX_LINE_LEN];
-    char end_bound[MAX_LINE_LEN];
-    get_start_and_end_boundary(start_bound, end_bound, hdr->boundary);
-    logger(DEBUG, "start_bound: %s", start_bound);
-    logger(DEBUG, "end_bound: %s", end_bound);
-    // receive file
-    char buf[MAX_LINE_LEN];
-    int bytes_received = 0, is_file_body = 0, count = 0;
-    while (bytes_received < hdr->length) {
-        bytes_received += get_line_from_bufferevent(bev, buf);
-        logger(DEBUG, "bytes received: %d", bytes_received);
-        logger(DEBUG, "buf: %s", buf);
-        if (bytes_received == 0) {
-            if (count ++ == 10) 
-                break;
+    http_headers_t* hdr = &conn->hdr;
+    if ((!hdr->chunked && hdr->length <= 0) || hdr->boundary[0] == '\0') {
+        logger(DEBUG, "Receive file => no length or boundary");
+        hdr->alive = 0;
+        http_bad_request(conn->bev, hdr->alive);
+        return;
+    }
+    http_upload_t* up = (http_upload_t*)calloc(1, sizeof(http_upload_t));
+    if (up == NULL) {
+        hdr->alive = 0;
+        http_internal_server_error(conn->bev, hdr->alive);
+        return;
+    }
+    // the length is known once the last chunk has been decoded
+    off_t length = hdr->chunked ? MULTIPART_LENGTH_UNKNOWN : hdr->length;
+    int ret = http_multipart_init(&up->mp, hdr->boundary, length, path);
+    if (ret == 0 && hdr->chunked) {
+        up->decoder = (http_chunk_decoder_t*)malloc(sizeof(http_chunk_decoder_t));
+        if (up->decoder != NULL && http_chunk_decoder_init(up->decoder) < 0) {
+            free(up->decoder);
+            up->decoder = NULL;
+        }
+        if (up->decoder == NULL)
+            ret = -1;
+    }
+    if (ret < 0 || (up->spool = evbuffer_new()) == NULL) {
+        upload_destroy(up);
+        hdr->alive = 0;
+        http_internal_server_error(conn->bev, hdr->alive);
+        return;
+    }
+    up->conn = conn;
+    conn->upload = up;
+    // stop reading from the socket while too much body waits for the disk
+    bufferevent_setwatermark(conn->bev, EV_READ, 0, UPLOAD_READ_HIGHWATER);
+}
+
+static void upload_free(http_conn_t* conn) {
+    upload_destroy(conn->upload);
+    conn->upload = NULL;
+    bufferevent_setwatermark(conn->bev, EV_READ, 0, 0);
+}
+
+// answer the upload once its body is consumed or rejected
+static int upload_finish(http_conn_t* conn, int ret) {
+    http_upload_t* up = conn->upload;
+    if (ret == HTTP_PARSE_DONE) {
+        logger(DEBUG, "received %d file(s)", up->mp.parts);
+        http_ok(conn->bev, 0, conn->hdr.alive);
+    } else if (up->mp.io_error) {
+        http_internal_server_error(conn->bev, 0);
+    } else {
+        http_bad_request(conn->bev, 0);
+    }
+    upload_free(conn);
+    return ret;
+}
+
+// parse the queued body and write its parts, on a pool thread
+static void upload_write(void* arg) {
+    http_upload_t* up = (http_upload_t*)arg;
+    up->ret = http_multipart_feed(&up->mp, up->spool);
+}
+
+static void upload_written(void* arg, int cancelled) {
+    http_upload_t* up = (http_upload_t*)arg;
+    if (cancelled) {
+        upload_destroy(up);
+        return;
+    }
+    http_conn_t* conn = up->conn;
+    conn->aio = NULL;
+    int ret = up->ret;
+    // nothing more will arrive for a body whose chunks all ended
+    if (ret == HTTP_PARSE_AGAIN && up->decoded)
+        ret = HTTP_PARSE_ERROR;
+    if (ret != HTTP_PARSE_AGAIN) {
+        upload_finish(conn, ret);
+        if (ret != HTTP_PARSE_DONE)
+            conn->hdr.alive = 0;
+        http_conn_resume(conn);
+        return;
+    }
+    // carry on with the body that arrived in the meantime
+    conn->paused = 0;
+    http_conn_process(conn);
+}
+
+int recv_file_body(http_conn_t* conn) {
+    http_upload_t* up = conn->upload;
+    // the parser belongs to the pool until its round is done
+    if (conn->aio != NULL)
+        return HTTP_PARSE_AGAIN;
+    struct evbuffer* input = bufferevent_get_input(conn->bev);
+    size_t queued = evbuffer_get_length(up->spool);
+    if (up->decoder != NULL) {
+        // the multipart parser reads the decoded content
+        int ret = http_chunk_decode(up->decoder, input);
+        if (ret == HTTP_PARSE_ERROR)
+            return upload_finish(conn, ret);
+        evbuffer_add_buffer(up->spool, up->decoder->body);
+        // after the last chunk only what is queued is left
+        if (ret == HTTP_PARSE_DONE) {
+            up->decoded = 1;
+            up->mp.remaining = evbuffer_get_length(up->spool);
         }
-        if (!strcmp(buf, end_bound)) {
-            logger(DEBUG, "detect end boundary.");
+    } else {
+        // bytes past the body belong to the next request
+        size_t avail = evbuffer_get_length(input);
+        off_t want = up->mp.remaining - (off_t)queued;
+        evbuffer_remove_buffer(input, up->spool,
+                               (off_t)avail < want ? avail : (size_t)want);
+    }
+    if (evbuffer_get_length(up->spool) == queued && !up->decoded)
+        return HTTP_PARSE_AGAIN;
+    // the chains are handed over, the disk is written off the event loop
+    conn->aio = http_aio_submit(conn->base, upload_write, upload_written, up);
+    if (conn->aio == NULL) {
+        up->mp.io_error = 1;
+        return upload_finish(conn, HTTP_PARSE_ERROR);
+    }
+    return HTTP_PARSE_AGAIN;
+}
+
+// PUT whose body is written next to its target on the filesystem pool
+typedef struct http_put_t {
+    http_conn_t* conn;
+    http_put_file_t file;
+    // Content-Range of a piece, total is -1 for a whole file
+    off_t first;
+    off_t total;
+    // body bytes not taken from the client yet
+    off_t remaining;
+    // body read by the bufferevent, waiting for the pool
+    struct evbuffer* spool;
+    // the rest of the body is spliced from this descriptor of the socket,
+    // -1 when it comes through the bufferevent. A job outlives a closed
+    // connection, so it holds a descriptor nobody else can reuse
+    int sock;
+    // sock became readable while the bufferevent isn't reading
+    struct event* ev;
+    // what the pool found, HTTP_STATUS_OK while the body goes on
+    enum http_status status;
+    // the client went away before the body was complete
+    int closed;
+} http_put_t;
+
+static void put_destroy(http_put_t* put) {
+    if (put->ev != NULL)
+        event_free(put->ev);
+    if (put->sock >= 0)
+        close(put->sock);
+    http_put_cleanup(&put->file);
+    if (put->spool != NULL)
+        evbuffer_free(put->spool);
+    free(put);
+}
+
+static void put_free(http_conn_t* conn) {
+    put_destroy(conn->put);
+    conn->put = NULL;
+    bufferevent_setwatermark(conn->bev, EV_READ, 0, 0);
+}
+
+// answer the PUT with what the pool found
+static void put_answer(http_conn_t* conn) {
+    http_put_t* put = conn->put;
+    bfevent_t* client = conn->bev;
+    // the rest of a body that wasn't read can't be told from a request
+    if (put->remaining > 0)
+        conn->hdr.alive = 0;
+    int alive = conn->hdr.alive;
+    switch (put->status) {
+        case HTTP_STATUS_CREATED:
+        case HTTP_STATUS_NO_CONTENT:
+            http_stored(client, put->status, alive);
             break;
-        } else if (!strcmp(buf, start_bound)) {
-            logger(DEBUG, "detect start boundary.");
-            continue;
-        } else if (!strcmp(buf, "\n")) {
-            is_file_body = 1;
+        case HTTP_STATUS_ACCEPTED:
+            http_accepted_range(client, put->file.offset, alive);
+            break;
+        case HTTP_STATUS_RANGE_NOT_SATISFIABLE:
+            http_range_not_satisfiable(client, put->file.offset, alive);
+            break;
+        case HTTP_STATUS_CONFLICT:
+            http_conflict(client, alive);
+            break;
+        case HTTP_STATUS_FORBIDDEN:
+            http_forbidden(client, alive);
+            break;
+        default:
+            http_internal_server_error(client, alive);
+            break;
+    }
+    put_free(conn);
+}
+
+// open the file, write what is queued and splice what the socket has, on
+// a pool thread. The file is committed once the body is complete
+static void put_run(void* arg) {
+    http_put_t* put = (http_put_t*)arg;
+    http_put_file_t* f = &put->file;
+    if (f->fd < 0) {
+        off_t length = put->remaining + evbuffer_get_length(put->spool);
+        put->status = http_put_open(f, put->first, length, put->total);
+        if (put->status != HTTP_STATUS_OK)
+            return;
+    }
+    if (http_put_write(f, put->spool) < 0) {
+        put->status = HTTP_STATUS_INTERNAL_ERR;
+        return;
+    }
+    if (put->sock >= 0 && put->remaining > 0) {
+        int ret = http_put_splice(f, put->sock, &put->remaining);
+        if (ret < 0)
+            put->status = HTTP_STATUS_INTERNAL_ERR;
+        put->closed = (ret > 0);
+        if (ret != 0)
+            return;
+    }
+    if (put->remaining == 0)
+        put->status = http_put_commit(f, put->total >= 0 ? put->total
+                                                         : f->offset);
+}
+
+static void put_readable(evutil_socket_t fd, short what, void* arg);
+
+static void put_done(void* arg, int cancelled) {
+    http_put_t* put = (http_put_t*)arg;
+    if (cancelled) {
+        put_destroy(put);
+        return;
+    }
+    http_conn_t* conn = put->conn;
+    conn->aio = NULL;
+    if (put->closed) {
+        http_conn_free(conn);
+        return;
+    }
+    if (put->status != HTTP_STATUS_OK) {
+        put_answer(conn);
+        http_conn_resume(conn);
+        return;
+    }
+    // wait for the socket to have more of the body
+    if (put->sock >= 0) {
+        event_add(put->ev, timeouts_set[WAIT_BODY] ? &wait_timeouts[WAIT_BODY]
+                                                   : NULL);
+        return;
+    }
+    // carry on with the body that arrived in the meantime
+    conn->paused = 0;
+    bufferevent_enable(conn->bev, EV_READ);
+    http_conn_process(conn);
+}
+
+static void put_readable(evutil_socket_t fd, short what, void* arg) {
+    (void)fd;
+    http_put_t* put = (http_put_t*)arg;
+    http_conn_t* conn = put->conn;
+    if (what & EV_TIMEOUT) {
+        http_conn_timeout(conn, BEV_EVENT_READING);
+        return;
+    }
+    conn->aio = http_aio_submit(conn->base, put_run, put_done, put);
+    if (conn->aio == NULL) {
+        put->status = HTTP_STATUS_INTERNAL_ERR;
+        put_answer(conn);
+        http_conn_resume(conn);
+    }
+}
+
+// move body bytes of the input to the spool, those past it belong to the
+// next request
+static void put_take(http_conn_t* conn) {
+    http_put_t* put = conn->put;
+    struct evbuffer* input = bufferevent_get_input(conn->bev);
+    size_t avail = evbuffer_get_length(input);
+    size_t n = (off_t)avail < put->remaining ? avail : (size_t)put->remaining;
+    evbuffer_remove_buffer(input, put->spool, n);
+    put->remaining -= n;
+}
+
+// parse "bytes first-last/total" of a piece of length bytes
+static int parse_content_range(const char* value, off_t length, off_t* first,
+                               off_t* total) {
+    long long a, b, c;
+    int end = 0;
+    if (sscanf(value, "bytes %lld-%lld/%lld%n", &a, &b, &c, &end) != 3 ||
+        value[end] != '\0' || a < 0 || b < a || c <= b || b - a + 1 != length)
+        return -1;
+    *first = a;
+    *total = c;
+    return 0;
+}
+
+// store the body of a PUT as path. Plain connections splice(2) the body
+// from the socket to the file, TLS ones decrypt it through the bufferevent
+static void put_start(http_conn_t* conn, const char* path) {
+    http_headers_t* hdr = &conn->hdr;
+    // the file is allocated and the connection framed by the length
+    if (hdr->chunked || http_header(hdr, HTTP_HEADER_CONTENT_LENGTH)[0] == '\0') {
+        hdr->alive = 0;
+        http_length_required(conn->bev, hdr->alive);
+        return;
+    }
+    // "/" stands for index.html when read, and a directory is no file to
+    // replace. Hidden names are where uploads are collected
+    size_t url_len = strlen(hdr->url);
+    if (hdr->url[url_len - 1] == '/' || url_hidden(hdr->url)) {
+        hdr->alive = 0;
+        http_conflict(conn->bev, hdr->alive);
+        return;
+    }
+    off_t first = 0, total = -1;
+    const char* range = http_header_find(hdr, "Content-Range");
+    if (range != NULL &&
+        parse_content_range(range, hdr->length, &first, &total) < 0) {
+        hdr->alive = 0;
+        http_bad_request(conn->bev, hdr->alive);
+        return;
+    }
+    http_put_t* put = (http_put_t*)calloc(1, sizeof(http_put_t));
+    if (put == NULL || (put->spool = evbuffer_new()) == NULL) {
+        free(put);
+        hdr->alive = 0;
+        http_internal_server_error(conn->bev, hdr->alive);
+        return;
+    }
+    put->conn = conn;
+    http_put_prepare(&put->file, path);
+    put->first = first;
+    put->total = total;
+    put->remaining = hdr->length;
+    put->sock = -1;
+    put->status = HTTP_STATUS_OK;
+    conn->put = put;
+    put_take(conn);
+    if (put->remaining > 0) {
+        const char* expect = http_header_find(hdr, "Expect");
+        if (expect != NULL && !strcasecmp(expect, "100-continue"))
+            bufferevent_write(conn->bev, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+        // splice(2) would read around the rate limits of the bufferevent
+        if (http_conn_can_sendfile(conn) && !http_ratelimit_uploads()) {
+            put->sock = fcntl(bufferevent_getfd(conn->bev), F_DUPFD_CLOEXEC, 0);
+            if (put->sock >= 0)
+                put->ev = event_new(conn->base, put->sock, EV_READ,
+                                    put_readable, put);
+            if (put->ev == NULL && put->sock >= 0) {
+                close(put->sock);
+                put->sock = -1;
+            }
         }
-        if (is_file_body)
-            fputs(buf, fp);
+        // stop reading from the socket while too much body waits for the disk
+        if (put->sock < 0)
+            bufferevent_setwatermark(conn->bev, EV_READ, 0,
+                                     UPLOAD_READ_HIGHWATER);
+    }
+    conn_wait(conn, WAIT_BODY);
+    conn->aio = http_aio_submit(conn->base, put_run, put_done, put);
+    if (conn->aio == NULL) {
+        put->status = HTTP_STATUS_INTERNAL_ERR;
+        put_answer(conn);
     }
-    http_ok(bev);
-    fclose(fp);
+}
+
+// consume PUT body buffered by the bufferevent, returns one of HTTP_PARSE_*
+static int put_body(http_conn_t* conn) {
+    http_put_t* put = conn->put;
+    // the file belongs to the pool until its round is done
+    if (conn->aio != NULL)
+        return HTTP_PARSE_AGAIN;
+    put_take(conn);
+    if (evbuffer_get_length(put->spool) == 0)
+        return HTTP_PARSE_AGAIN;
+    conn->aio = http_aio_submit(conn->base, put_run, put_done, put);
+    if (conn->aio == NULL) {
+        put->status = HTTP_STATUS_INTERNAL_ERR;
+        put_answer(conn);
+        return HTTP_PARSE_ERROR;
+    }
+    return HTTP_PARSE_AGAIN;
 }
 
 void get_file_path_on_server(char* path, http_headers_t* hdr) {
-    strcpy(path, SERVER_ROOT_DIR);
-    strcat(path, hdr->url);
-    if (!strcmp("/", hdr->url))
-        strcat(path, "index.html");
+    snprintf(path, MAX_PATH_LEN, "%s%s%s", SERVER_ROOT_DIR, hdr->url,
+             strcmp("/", hdr->url) ? "" : "index.html");
 }
 
-void do_accept_cb(bfevent_t* client, void* arg) {
-    // get client socket fd as bufferevent
-    struct event_base* base = (struct event_base*)arg;
+// file request whose disk accesses are made on the filesystem pool
+typedef struct http_lookup_t {
+    http_conn_t* conn;
+    char path[MAX_PATH_LEN];
+    // whether the content cache may answer, and the codings to look for
+    int cacheable;
+    int encodings;
+    // what the pool found
+    http_cache_entry_t* entry;
+    http_open_file_t* file;
+    http_variant_t variant;
+} http_lookup_t;
+
+// whether a cache entry can answer a request accepting encodings, sidecar
+// files are sent by the pool
+static int cached_fits(const http_cache_entry_t* entry, int encodings) {
+    return !(encodings & entry->sidecars);
+}
+
+// answer from a referenced cache entry, which is handed over. The variant
+// compressed by the server is sent when encodings has gzip
+static void send_cached(http_conn_t* conn, http_cache_entry_t* entry,
+                        int encodings) {
+    http_headers_t* hdr = &conn->hdr;
+    if ((encodings & ENCODING_GZIP) && entry->gzip != NULL) {
+        http_encoding_send_gzip(conn, &entry->validators, entry->type,
+                                entry->gzip);
+        http_cache_release(entry);
+        return;
+    }
+    if (http_conditional_not_modified(hdr, &entry->validators)) {
+        http_not_modified(conn->bev, &entry->validators, hdr->alive);
+        http_cache_release(entry);
+    } else {
+        http_cache_send(entry, bufferevent_get_output(conn->bev), hdr->alive,
+                        hdr->mode == HEAD);
+    }
+}
 
-    // initialize http_headers_t struct
-    http_headers_t http_hdr;
-    memset(&http_hdr, 0, sizeof(http_headers_t));
+// open the path through the open file cache, on a pool thread
+static void lookup_run(void* arg) {
+    http_lookup_t* job = (http_lookup_t*)arg;
+    if (job->cacheable && (job->entry = http_cache_get(job->path)) != NULL) {
+        if (cached_fits(job->entry, job->encodings))
+            return;
+        http_cache_release(job->entry);
+        job->entry = NULL;
+    }
+    if ((job->file = http_open_cache_get(job->path)) == NULL)
+        return;
+    if (job->file->err == 0 && S_ISREG(job->file->st.st_mode) &&
+        job->encodings != ENCODING_IDENTITY)
+        http_encoding_prepare(job->path, &job->file->st, job->encodings,
+                              &job->variant);
+}
+
+// answer a GET or HEAD with what the pool found out about the path
+static void lookup_answer(http_conn_t* conn, http_lookup_t* job) {
+    bfevent_t* client = conn->bev;
+    http_headers_t* hdr = &conn->hdr;
+    if (job->entry != NULL) {
+        send_cached(conn, job->entry, job->encodings);
+        job->entry = NULL;
+        return;
+    }
+    http_open_file_t* file = job->file;
+    if (file == NULL) {
+        http_conn_error(conn, HTTP_STATUS_INTERNAL_ERR);
+        return;
+    }
+    if (file->err != 0) {
+        if (file->err == EACCES)
+            http_conn_error(conn, HTTP_STATUS_FORBIDDEN);
+        else
+            http_conn_error(conn, HTTP_STATUS_NOT_FOUND);  // 404 not found
+        return;
+    }
+    if (S_ISDIR(file->st.st_mode)) {
+        http_dirlist_send(conn, job->path, &file->st);
+        return;
+    }
+    if (!S_ISREG(file->st.st_mode)) {
+        http_conn_error(conn, HTTP_STATUS_NOT_FOUND);
+        return;
+    }
+    // compressed variants have validators of their own
+    if (http_encoding_send(conn, job->path, &file->st, &job->variant) == 0)
+        return;
+    // revalidation is answered from the cached stat data alone
+    http_validators_t v;
+    http_validators_init(&v, &file->st);
+    if (http_conditional_not_modified(hdr, &v)) {
+        http_not_modified(client, &v, hdr->alive);
+        return;
+    }
+    send_file_to_client(conn, file);
+    job->file = NULL;
+}
 
-    // parse http headers information from sockets
-    logger(DEBUG, "Starting to parse method and url");
-    if (parse_http_header(client, &http_hdr) < 0) {
-        // TODO: add error handling
+static void lookup_done(void* arg, int cancelled) {
+    http_lookup_t* job = (http_lookup_t*)arg;
+    if (!cancelled) {
+        http_conn_t* conn = job->conn;
+        conn->aio = NULL;
+        lookup_answer(conn, job);
+        // a directory may still have to be read, or its listing streams
+        if (conn->aio == NULL && conn->listing == NULL)
+            http_conn_resume(conn);
+    }
+    // release what the answer didn't take over
+    if (job->entry != NULL)
+        http_cache_release(job->entry);
+    http_encoding_release(&job->variant);
+    if (job->file != NULL)
+        http_open_cache_release(job->file);
+    free(job);
+}
+
+static void lookup_start(http_conn_t* conn, const char* path, int cacheable,
+                         int encodings) {
+    http_lookup_t* job = (http_lookup_t*)calloc(1, sizeof(http_lookup_t));
+    if (job == NULL) {
+        http_conn_error(conn, HTTP_STATUS_INTERNAL_ERR);
         return;
     }
+    job->conn = conn;
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    job->cacheable = cacheable;
+    job->encodings = encodings;
+    if ((conn->aio = http_aio_submit(conn->base, lookup_run, lookup_done,
+                                     job)) == NULL) {
+        free(job);
+        http_conn_error(conn, HTTP_STATUS_INTERNAL_ERR);
+    }
+}
+
+// answer the parsed request, returns whether the connection stays open
+static int handle_request(http_conn_t* conn) {
+    bfevent_t* client = conn->bev;
+    http_headers_t* http_hdr = &conn->hdr;
+    conn->started = http_stats_now();
+    http_stats_request();
 
     // get the file of the main page of html
-    struct stat st;
     char path[MAX_PATH_LEN];
-    get_file_path_on_server(path, &http_hdr);
+    http_cache_entry_t* entry = NULL;
+    const http_bundle_entry_t* bundled;
+    int cacheable = 0, encodings = ENCODING_IDENTITY;
+    get_file_path_on_server(path, http_hdr);
     logger(DEBUG, "access path: %s", path);
-    switch (http_hdr.mode) {
+    switch (http_hdr->mode) {
         case GET:
-            if (stat(path, &st) == -1) {  // get file information failed
-                http_not_found(client);   // 404 not found
-                return;
+        case HEAD:
+            if (url_hidden(http_hdr->url)) {
+                http_conn_error(conn, HTTP_STATUS_NOT_FOUND);
+                break;
             }
-            if ((st.st_mode & S_IFMT) == S_IFDIR)
-                send_directory_to_client(client, path);
-            else if ((st.st_mode & S_IFMT) == S_IFREG)
-                send_file_to_client(client, path);
-            else
-                http_not_found(client);
+            if (!strcmp(http_hdr->url, HTTP_STATS_PATH)) {
+                http_stats_send(conn);
+                break;
+            }
+            // a bundled file is answered from the mapping, found by one
+            // hash probe without a path walk
+            if ((bundled = http_bundle_lookup(http_hdr->url)) != NULL) {
+                http_bundle_send(conn, bundled);
+                break;
+            }
+            // hot files are answered from memory without touching the disk,
+            // compressed or not. Ranges and sidecar files are taken from
+            // files
+            cacheable = (http_header(http_hdr, HTTP_HEADER_RANGE)[0] == '\0');
+            if (http_encoding_wanted(http_hdr, path))
+                encodings = http_hdr->encodings;
+            if (cacheable && (entry = http_cache_lookup(path)) != NULL) {
+                if (cached_fits(entry, encodings)) {
+                    send_cached(conn, entry, encodings);
+                    break;
+                }
+                http_cache_release(entry);
+            }
+            // anything else may block on the disk, so the filesystem pool
+            // looks it up and the response follows in lookup_done
+            lookup_start(conn, path, cacheable, encodings);
             break;
 
         case POST:
-            recv_file_from_client(client, path, &http_hdr);
+            recv_file_from_client(conn, path);
+            break;
+        case PUT:
+            put_start(conn, path);
             break;
         default:
-            http_not_implemented(client);
+            // an unknown method may carry a body we can't skip
+            http_hdr->alive = 0;
+            http_not_implemented(client, http_hdr->alive);
             break;
     }
-    // FIXME: maybe we need to add sth. here
-}
\ No newline at end of file
+    return http_hdr->alive;
+}
+
+// answer buffered requests of the connection in order
+static void http_conn_process(http_conn_t* conn) {
+    bfevent_t* client = conn->bev;
+    struct evbuffer* input = bufferevent_get_input(client);
+    struct evbuffer* output = bufferevent_get_output(client);
+    while (evbuffer_get_length(input) > 0) {
+        int alive = 0;
+        if (conn->put != NULL) {
+            // body of a PUT read through the bufferevent, put_done answers
+            if (put_body(conn) == HTTP_PARSE_AGAIN) {
+                if (conn->aio != NULL) {
+                    conn->paused = 1;
+                    return;
+                }
+                break;
+            }
+        } else if (conn->upload != NULL) {
+            // body of the current request
+            int ret = recv_file_body(conn);
+            if (ret == HTTP_PARSE_AGAIN) {
+                // the socket is still read up to the watermark while the
+                // pool writes, upload_written carries on from there
+                if (conn->aio != NULL) {
+                    conn->paused = 1;
+                    return;
+                }
+                break;
+            }
+            alive = (ret == HTTP_PARSE_DONE) && conn->hdr.alive;
+        } else {
+            // responses must leave in request order, so hold pipelined
+            // requests while a file is still streaming or too much output
+            // is queued
+            if (conn->stream.file != NULL || conn->aio != NULL ||
+                evbuffer_get_length(output) > HTTP_PIPELINE_OUTPUT_MAX) {
+                conn->paused = 1;
+                bufferevent_disable(client, EV_READ);
+                return;
+            }
+            // parse http headers information from buffered input
+            int ret = parse_http_header(conn);
+            if (ret == HTTP_PARSE_AGAIN) {
+                // the read timeout restarts with every segment, a client
+                // trickling its head out is held to a deadline instead
+                uint64_t now = http_stats_now();
+                if (conn->head_deadline == 0) {
+                    conn->head_deadline = now + header_timeout_us;
+                } else if (header_timeout_us > 0 && now > conn->head_deadline) {
+                    http_conn_timeout(conn, BEV_EVENT_READING);
+                    return;
+                }
+                break;
+            }
+            if (ret == HTTP_PARSE_ERROR) {
+                logger(DEBUG, "malformed request header");
+                http_bad_request(client, 0);
+                http_conn_close_after_write(conn);
+                return;
+            }
+            alive = handle_request(conn);
+            // the request body follows
+            if (conn->upload != NULL) {
+                conn_wait(conn, WAIT_BODY);
+                continue;
+            }
+            // the response follows, http_conn_resume picks up from there
+            if (conn->aio != NULL) {
+                conn->paused = 1;
+                bufferevent_disable(client, EV_READ);
+                return;
+            }
+        }
+        if (!alive) {
+            http_conn_close_after_write(conn);
+            return;
+        }
+        http_conn_reset(conn);
+    }
+    if (conn->eof) {
+        http_conn_close_after_write(conn);
+        return;
+    }
+    // what the connection waits for now that the input is used up
+    if (conn->upload != NULL || conn->put != NULL)
+        conn_wait(conn, WAIT_BODY);
+    else if (conn->head_deadline != 0 || evbuffer_get_length(input) > 0)
+        conn_wait(conn, WAIT_HEAD);
+    else
+        conn_wait(conn, WAIT_IDLE);
+}
+
+void http_conn_resume(http_conn_t* conn) {
+    if (!conn->hdr.alive) {
+        http_conn_close_after_write(conn);
+        return;
+    }
+    http_conn_reset(conn);
+    conn->paused = 0;
+    bufferevent_enable(conn->bev, EV_READ);
+    http_conn_process(conn);
+}
+
+void do_accept_cb(bfevent_t* client, void* arg) {
+    (void)client;
+    // get connection context of the client
+    http_conn_t* conn = (http_conn_t*)arg;
+    if (!conn->paused)
+        http_conn_process(conn);
+}
+
+void do_write_cb(bfevent_t* client, void* arg) {
+    http_conn_t* conn = (http_conn_t*)arg;
+    if (conn->failed) {
+        http_conn_free(conn);
+        return;
+    }
+    // a streamed listing has been written, its request is over
+    if (conn->listing != NULL) {
+        if (http_dirlist_streamed(conn))
+            http_conn_resume(conn);
+        return;
+    }
+    // output has drained, carry on with pipelined requests
+    if (conn->paused && conn->stream.file == NULL && conn->aio == NULL &&
+        conn->put == NULL) {
+        conn->paused = 0;
+        bufferevent_enable(client, EV_READ);
+        http_conn_process(conn);
+    }
+}
@@ -3,6 +3,7 @@
 
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -18,12 +19,26 @@
 #include <openssl/err.h>
 // self-write header file
 #include "http_response.h"
+#include "http_pool.h"
+#include "http_headers.h"
+#include "http_open_cache.h"
 
 // http header params
 #define HTTP_HDR_METHOD_LEN 10
 #define HTTP_HDR_URL_LEN (1 << 10)
 #define HTTP_HDR_VERSION_LEN 10
 #define HTTP_HDR_BOUNDARY_LEN (1 << 8)
+// Referer and User-Agent are cut this long in the access log
+#define HTTP_HDR_LOG_LEN (1 << 8)
+// longest single line accepted in the request header block
+#define HTTP_HDR_LINE_LEN (1 << 13)
+// largest request header block accepted
+#define HTTP_HDR_MAX_SIZE (1 << 16)
+
+// results of feeding input to the request parser
+#define HTTP_PARSE_ERROR -1
+#define HTTP_PARSE_AGAIN 0
+#define HTTP_PARSE_DONE 1
 
 // server root path
 #define SERVER_ROOT_DIR "htdocs"
@@ -35,6 +50,14 @@
 // process params
 #define MAX_PATH_LEN 512
 #define MAX_LINE_LEN 1024
+// bytes read ahead per refill when a file cannot be sent with sendfile(2)
+#define FILE_STREAM_CHUNK (1 << 16)
+// queued output above which pipelined requests wait for the client to read
+#define HTTP_PIPELINE_OUTPUT_MAX (1 << 20)
+// seconds the kernel holds a new connection back until data arrives on it
+#define HTTP_DEFER_ACCEPT_SEC 5
+// TCP fast open requests pending per listener
+#define HTTP_FASTOPEN_QLEN 256
 
 // html strings
 #define HTML_BEFORE_BODY                                             \
@@ -66,12 +89,12 @@ enum http_method {
     NOT_IMPLEMENT = -1,
     GET,
     POST,
+    HEAD,
+    PUT,
     /*
        the below methods
        are not implemented.
     */
-    HEAD,
-    PUT,
     DELETE,
     OPTIONS,
     TRACE,
@@ -79,47 +102,175 @@ enum http_method {
     OTHERS
 };
 
-// http header struct
+// states of the incremental request parser
+enum http_parse_state {
+    PARSE_REQUEST_LINE = 0,
+    PARSE_HEADERS,
+    PARSE_DONE
+};
+
+// what a connection waits for from the client, each with its own timeout
+enum http_wait {
+    WAIT_IDLE = 0,  // next request of a kept-alive connection
+    WAIT_HEAD,      // rest of a request head
+    WAIT_BODY       // rest of a request body
+};
+
+// http header struct. Strings point into the request head, which lives in
+// the request arena of the connection, and are "" when absent
 typedef struct http_headers_t {
     char version[HTTP_HDR_VERSION_LEN];
     char method[HTTP_HDR_METHOD_LEN];
-    char url[HTTP_HDR_URL_LEN];
-    char query[MAX_LINE_LEN];
-    char boundary[HTTP_HDR_BOUNDARY_LEN];
+    char* url;
+    // part of url after '?', for GET and HEAD
+    char* query;
+    char* boundary;
+    // the request head, taken out of the input in one copy once complete.
+    // Parsing turns line ends and the colons after names into '\0'
+    char* head;
+    uint32_t head_len;
+    // offset of the first header line in head
+    uint32_t fields;
+    // values of the headers in enum http_header_id, see http_header()
+    http_header_view_t known[HTTP_HEADER_COUNT];
     int mode;
-    int length;
+    off_t length;
+    // body is sent with chunked transfer coding
+    int chunked;
+    // content codings the client accepts, see http_encoding.h
+    int encodings;
     int alive;
 } http_headers_t;
 
+// file being pushed chunk by chunk through a transport that can't sendfile
+typedef struct http_file_stream_t {
+    // referenced open file, NULL when nothing is streaming
+    http_open_file_t* file;
+    off_t offset;
+    off_t remaining;
+} http_file_stream_t;
+
+// upload body being received and written to disk
+struct http_upload_t;
+
+// PUT body being received and written to disk
+struct http_put_t;
+
+// filesystem work running on the pool, see http_aio.h
+struct http_aio_t;
+
+// directory listing being streamed, see http_dirlist.h
+struct http_dirlist_stream_t;
+
+// rate limits of a client address, see http_ratelimit.h
+struct http_rate_client_t;
+
+// per-connection context, passed as the argument of bufferevent callbacks
+typedef struct http_conn_t {
+    struct event_base* base;
+    bfevent_t* bev;
+    struct sockaddr_in peer;
+    http_file_stream_t stream;
+    // request processing is held until queued output drains
+    int paused;
+    // client has shut down its side of the connection
+    int eof;
+    // response could not be completed, drop the connection
+    int failed;
+    // records are encrypted by openssl in user space, no sendfile(2)
+    int tls;
+    // upload whose body is still arriving
+    struct http_upload_t* upload;
+    // PUT whose body is still arriving
+    struct http_put_t* put;
+    // connections of the same client address share its rate limits
+    struct http_rate_client_t* rate_client;
+    // filesystem work the connection waits for, requests are held meanwhile
+    struct http_aio_t* aio;
+    // listing still being generated, requests are held meanwhile as well
+    struct http_dirlist_stream_t* listing;
+    // monotonic microseconds the current request was parsed at, 0 if none
+    uint64_t started;
+    // read timeout currently armed
+    enum http_wait wait;
+    // monotonic microseconds the head being received must be complete by,
+    // 0 until part of it is buffered
+    uint64_t head_deadline;
+    // parser state, kept across read callbacks
+    enum http_parse_state parse_state;
+    size_t scan_pos;
+    size_t hdr_bytes;
+    http_headers_t hdr;
+    // strings of the current request, rewound by http_conn_reset. Last,
+    // so a recycled context is cleared up to here only
+    http_arena_t arena;
+} http_conn_t;
+
 /*
     function declarations
  */
-// initialize http server
-evutil_socket_t http_init();
+// initialize http server on port, reuse_port allows one listener per worker
+evutil_socket_t http_init(int port, int reuse_port, int backlog);
+// timeouts of every connection in seconds, 0 disables one
+void http_conn_init(int idle, int header, int body);
+// create context of a new connection
+http_conn_t* http_conn_new(struct event_base* base, bfevent_t* bev);
+// connections open over all workers
+int http_conn_count(void);
+// arm the timeouts of the connection on its bufferevent, again after the
+// bufferevent is replaced
+void http_conn_timeouts(http_conn_t* conn);
+// a timeout of the connection expired, what holds BEV_EVENT_READING or
+// BEV_EVENT_WRITING
+void http_conn_timeout(http_conn_t* conn, short what);
+// release connection context and its bufferevent
+void http_conn_free(http_conn_t* conn);
+// release connection once pending output has been written
+void http_conn_close_after_write(http_conn_t* conn);
+// get ready to parse the next request on the connection
+void http_conn_reset(http_conn_t* conn);
+// client closed its side, finish queued requests then close
+void http_conn_eof(http_conn_t* conn);
+// carry on after an asynchronously completed response
+void http_conn_resume(http_conn_t* conn);
 // callback of handing request
 void do_accept_cb(bfevent_t* bev, void* arg);
-// send directory to client
-void send_directory_to_client(bfevent_t* bev, char* directory);
-// send file to client
-void send_file_to_client(bfevent_t* bev, char* path);
-// send file main function
-void send_file(bfevent_t* bev, FILE* fp);
+// callback of output drained
+void do_write_cb(bfevent_t* bev, void* arg);
+// answer the current request with the error page of status, without its
+// body for HEAD
+void http_conn_error(http_conn_t* conn, enum http_status status);
+// send opened file to client, takes over the reference to file
+void send_file_to_client(http_conn_t* conn, http_open_file_t* file);
+// whether file content can go to the client with sendfile(2)
+int http_conn_can_sendfile(http_conn_t* conn);
+// send [offset, offset + length) of file, takes over the reference to it
+int send_file(http_conn_t* conn, http_open_file_t* file, off_t offset,
+              off_t length);
+// segment of the whole file for evbuffer_add_file_segment, takes over the
+// reference to file. NULL on failure
+struct evbuffer_file_segment* http_file_segment(http_open_file_t* file);
 // receive file from client
-void recv_file_from_client(bfevent_t* bev, char* path, http_headers_t* hdr);
-// get first header
-int get_first_header(bfevent_t* bev, http_headers_t* hdr);
-// get other headers
-int get_other_headers(bfevent_t* bev, http_headers_t* hdr);
-// parse http header from socket
-int parse_http_header(bfevent_t* bev, http_headers_t* hdr);
-// get line string from socket
-int get_line_from_bufferevent(bfevent_t* bev, char* buf);
+void recv_file_from_client(http_conn_t* conn, char* path);
+// consume buffered upload body, returns one of HTTP_PARSE_*
+int recv_file_body(http_conn_t* conn);
+// parse request line, in place
+int get_first_header(char* line, http_headers_t* hdr);
+// parse one header line of hdr->head, in place
+int get_other_headers(char* line, http_headers_t* hdr);
+// set every header of hdr to absent
+void http_headers_clear(http_headers_t* hdr);
+// feed buffered input to the request parser of the connection, the head
+// stays in the input until it is complete
+int parse_http_header(http_conn_t* conn);
 // parse method string from given string
 char* get_method_from_str(char* buf, http_headers_t* hdr);
-// parse url string from given string
+// parse url string from given string, NULL if it is too long
 char* get_url_from_str(char* buf, http_headers_t* hdr);
 // parse version string from given string
 void get_version_from_str(char* buf, http_headers_t* hdr);
+// get extension of file name
+void get_file_extension(const char* file_name, char* extension);
 // format path on server from http headers
 void get_file_path_on_server(char* path, http_headers_t* hdr);
 
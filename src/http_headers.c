@@ -0,0 +1,72 @@
+#include "http_headers.h"
+#include <string.h>
+#include <strings.h>
+#include "http_functions.h"
+
+// slot of a name in known_names, see header_slot
+#define HEADER_SLOTS 16
+
+// names of the known headers by hash slot. No two of them share a slot, so a
+// lookup compares against one name at most
+static const struct {
+    const char* name;
+    size_t len;
+    enum http_header_id id;
+} known_names[HEADER_SLOTS] = {
+    [1] = {"if-modified-since", 17, HTTP_HEADER_IF_MODIFIED_SINCE},
+    [2] = {"content-type", 12, HTTP_HEADER_CONTENT_TYPE},
+    [4] = {"user-agent", 10, HTTP_HEADER_USER_AGENT},
+    [5] = {"range", 5, HTTP_HEADER_RANGE},
+    [6] = {"content-length", 14, HTTP_HEADER_CONTENT_LENGTH},
+    [7] = {"host", 4, HTTP_HEADER_HOST},
+    [8] = {"transfer-encoding", 17, HTTP_HEADER_TRANSFER_ENCODING},
+    [9] = {"if-none-match", 13, HTTP_HEADER_IF_NONE_MATCH},
+    [10] = {"accept-encoding", 15, HTTP_HEADER_ACCEPT_ENCODING},
+    [13] = {"referer", 7, HTTP_HEADER_REFERER},
+    [14] = {"connection", 10, HTTP_HEADER_CONNECTION},
+    [15] = {"if-range", 8, HTTP_HEADER_IF_RANGE},
+};
+
+// hash of the length and the first two letters, case folded. Perfect for
+// known_names; keep it so when adding a name
+static inline unsigned header_slot(const char* name, size_t len) {
+    return (len * 2 + (name[0] | 0x20) + (name[1] | 0x20) * 9) &
+           (HEADER_SLOTS - 1);
+}
+
+enum http_header_id http_header_lookup(const char* name, size_t len) {
+    if (len < 2)
+        return HTTP_HEADER_UNKNOWN;
+    unsigned slot = header_slot(name, len);
+    if (known_names[slot].len != len ||
+        strncasecmp(known_names[slot].name, name, len) != 0)
+        return HTTP_HEADER_UNKNOWN;
+    return known_names[slot].id;
+}
+
+const char* http_header(const http_headers_t* hdr, enum http_header_id id) {
+    const http_header_view_t* view = &hdr->known[id];
+    return view->off ? hdr->head + view->off : "";
+}
+
+const char* http_header_find(const http_headers_t* hdr, const char* name) {
+    size_t len = strlen(name);
+    const char* p = hdr->head + hdr->fields;
+    const char* end = hdr->head + hdr->head_len;
+    // every header line reads "name\0 value\0", line ends are runs of '\0'
+    while (p < end) {
+        if (*p == '\0') {
+            p++;
+            continue;
+        }
+        size_t key_len = strlen(p);
+        const char* value = p + key_len + 1;
+        if (key_len == len && strncasecmp(p, name, len) == 0) {
+            while (*value == ' ' || *value == '\t')
+                value++;
+            return value;
+        }
+        p = value + strlen(value);
+    }
+    return NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef __HTTP_HEADERS_H__
+#define __HTTP_HEADERS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// request headers the server acts on, indexes of http_headers_t.known
+enum http_header_id {
+    HTTP_HEADER_CONNECTION = 0,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_REFERER,
+    HTTP_HEADER_USER_AGENT,
+    HTTP_HEADER_COUNT,
+    HTTP_HEADER_UNKNOWN = -1
+};
+
+// value of a header inside the request head, off is 0 when it is absent
+// since the request line always comes first
+typedef struct http_header_view_t {
+    uint32_t off;
+    uint32_t len;
+} http_header_view_t;
+
+struct http_headers_t;
+
+/*
+    function declarations
+ */
+// id of the header called name, in any case, or HTTP_HEADER_UNKNOWN. One
+// hash and at most one comparison
+enum http_header_id http_header_lookup(const char* name, size_t len);
+// value of a known header, "" when absent
+const char* http_header(const struct http_headers_t* hdr,
+                        enum http_header_id id);
+// value of any header, found by scanning the head. NULL when absent
+const char* http_header_find(const struct http_headers_t* hdr,
+                             const char* name);
+
+#endif
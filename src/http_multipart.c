@@ -0,0 +1,288 @@
+#include "http_multipart.h"
+#include "http_cache.h"
+#include "logger.h"
+#include <libgen.h>
+#include <sys/uio.h>
+
+int http_multipart_init(http_multipart_t* mp, const char* boundary,
+                        off_t length, const char* path) {
+    mp->state = MP_PREAMBLE;
+    mp->remaining = length;
+    mp->fd = -1;
+    mp->parts = 0;
+    mp->io_error = 0;
+    mp->filename[0] = '\0';
+    mp->part_path[0] = '\0';
+    // every delimiter but the first one is preceded by "\r\n"
+    mp->delim_len = snprintf(mp->delim, sizeof(mp->delim), "\r\n--%s", boundary);
+    if (mp->delim_len >= sizeof(mp->delim))
+        return -1;
+    snprintf(mp->path, sizeof(mp->path), "%s", path);
+    // looked up by the first part, on the thread writing the files
+    mp->target_is_dir = -1;
+    return 0;
+}
+
+void http_multipart_cleanup(http_multipart_t* mp) {
+    if (mp->fd < 0)
+        return;
+    close(mp->fd);
+    mp->fd = -1;
+    // never leave a truncated file behind
+    unlink(mp->part_path);
+    logger(DEBUG, "removed incomplete upload %s", mp->part_path);
+}
+
+// body bytes that are already buffered
+static size_t body_available(http_multipart_t* mp, struct evbuffer* input) {
+    size_t avail = evbuffer_get_length(input);
+    return (off_t)avail < mp->remaining ? avail : (size_t)mp->remaining;
+}
+
+static void consume(http_multipart_t* mp, struct evbuffer* input, size_t n) {
+    evbuffer_drain(input, n);
+    mp->remaining -= n;
+}
+
+// look for pat in the buffered body. On a hit *offset is where it starts,
+// otherwise *offset counts the leading bytes that cannot be part of a match
+static int search_delimiter(http_multipart_t* mp, struct evbuffer* input,
+                            const char* pat, size_t plen, size_t* offset) {
+    size_t limit = body_available(mp, input);
+    struct evbuffer_iovec vec;
+    *offset = 0;
+    if (limit == 0 || evbuffer_peek(input, limit, NULL, &vec, 1) < 1)
+        return 0;
+    // scan the first chain in place
+    size_t len = vec.iov_len < limit ? vec.iov_len : limit;
+    char* hit = (char*)memmem(vec.iov_base, len, pat, plen);
+    if (hit != NULL) {
+        *offset = hit - (char*)vec.iov_base;
+        return 1;
+    }
+    if (len == limit) {
+        *offset = len >= plen ? len - (plen - 1) : 0;
+        return 0;
+    }
+    // a delimiter may straddle the end of the chain, check a small copy
+    // of its tail joined with the head of the next one
+    char window[2 * MULTIPART_DELIM_LEN];
+    size_t tail = len < plen - 1 ? len : plen - 1;
+    size_t wlen = tail + plen - 1;
+    if (len - tail + wlen > limit)
+        wlen = limit - (len - tail);
+    struct evbuffer_ptr pos;
+    evbuffer_ptr_set(input, &pos, len - tail, EVBUFFER_PTR_SET);
+    evbuffer_copyout_from(input, &pos, window, wlen);
+    hit = (char*)memmem(window, wlen, pat, plen);
+    if (hit != NULL) {
+        *offset = len - tail + (hit - window);
+        return 1;
+    }
+    // a match may still begin in the last plen - 1 bytes of the window
+    *offset = len - tail + (wlen > plen - 1 ? wlen - (plen - 1) : 0);
+    return 0;
+}
+
+// find the end of a line inside the body, returns its length or -1
+static ssize_t search_line(http_multipart_t* mp, struct evbuffer* input,
+                           size_t* eol_len) {
+    struct evbuffer_ptr eol =
+        evbuffer_search_eol(input, NULL, eol_len, EVBUFFER_EOL_CRLF);
+    if (eol.pos < 0 || (size_t)eol.pos + *eol_len > body_available(mp, input))
+        return -1;
+    return eol.pos;
+}
+
+// move n buffered bytes into the current part file without copying them
+static int write_part(http_multipart_t* mp, struct evbuffer* input, size_t n) {
+    struct evbuffer_iovec vecs[UPLOAD_WRITE_IOVECS];
+    while (n > 0) {
+        int nvec = evbuffer_peek(input, n, NULL, vecs, UPLOAD_WRITE_IOVECS);
+        if (nvec > UPLOAD_WRITE_IOVECS)
+            nvec = UPLOAD_WRITE_IOVECS;
+        size_t total = 0;
+        for (int i = 0; i < nvec; i++) {
+            if (total + vecs[i].iov_len > n)
+                vecs[i].iov_len = n - total;
+            total += vecs[i].iov_len;
+        }
+        ssize_t written = writev(mp->fd, (struct iovec*)vecs, nvec);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0) {
+            logger(ERROR, "failed to write %s: %s", mp->part_path,
+                   strerror(errno));
+            mp->io_error = 1;
+            return -1;
+        }
+        consume(mp, input, written);
+        n -= written;
+    }
+    return 0;
+}
+
+// `Content-Disposition: form-data; name="x"; filename="y"`
+static void parse_part_header(http_multipart_t* mp, char* line) {
+    logger(DEBUG, "part header: %s", line);
+    if (strncasecmp(line, "Content-Disposition:", 20))
+        return;
+    char* name = strcasestr(line, "filename=\"");
+    if (name == NULL)
+        return;
+    name += 10;
+    char* end = strchr(name, '"');
+    if (end != NULL)
+        *end = '\0';
+    // browsers may send a client side path, keep the last component only
+    char* base = name;
+    for (char* p = name; *p; p++) {
+        if (*p == '/' || *p == '\\')
+            base = p + 1;
+    }
+    snprintf(mp->filename, sizeof(mp->filename), "%s", base);
+}
+
+static int open_part(http_multipart_t* mp) {
+    if (mp->filename[0] == '\0') {
+        // plain form field, its content is skipped
+        mp->fd = -1;
+        return 0;
+    }
+    if (!strcmp(mp->filename, ".") || !strcmp(mp->filename, "..")) {
+        logger(DEBUG, "invalid upload filename: %s", mp->filename);
+        return -1;
+    }
+    if (mp->target_is_dir < 0) {
+        struct stat st;
+        mp->target_is_dir = (stat(mp->path, &st) == 0 && S_ISDIR(st.st_mode));
+    }
+    if (!mp->target_is_dir && mp->parts == 0) {
+        // the first file goes to the path of the request
+        snprintf(mp->part_path, sizeof(mp->part_path), "%s", mp->path);
+    } else {
+        // further files are stored under their own name beside it
+        char dir[MAX_PATH_LEN];
+        snprintf(dir, sizeof(dir), "%s", mp->path);
+        const char* parent = mp->target_is_dir ? dir : dirname(dir);
+        size_t len = strlen(parent);
+        // the same spelling as a GET of the file, so caches keyed by path
+        // forget the right entry
+        int n = snprintf(mp->part_path, sizeof(mp->part_path), "%s%s%s",
+                         parent, len > 0 && parent[len - 1] == '/' ? "" : "/",
+                         mp->filename);
+        if (n >= (int)sizeof(mp->part_path))
+            return -1;
+    }
+    if ((mp->fd = open(mp->part_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        logger(DEBUG, "Failed to create file %s", mp->part_path);
+        mp->io_error = 1;
+        return -1;
+    }
+    mp->parts++;
+    http_cache_invalidate(mp->part_path);
+    http_open_cache_invalidate(mp->part_path);
+    logger(DEBUG, "receiving part into %s", mp->part_path);
+    return 0;
+}
+
+static void close_part(http_multipart_t* mp) {
+    if (mp->fd >= 0) {
+        close(mp->fd);
+        mp->fd = -1;
+        http_cache_invalidate(mp->part_path);
+        http_open_cache_invalidate(mp->part_path);
+    }
+    mp->filename[0] = '\0';
+}
+
+int http_multipart_feed(http_multipart_t* mp, struct evbuffer* input) {
+    for (;;) {
+        size_t off = 0, eol_len = 0;
+        ssize_t line_len = 0;
+        int hit = 0;
+        switch (mp->state) {
+            case MP_PREAMBLE:
+                // the first delimiter may start the body, without "\r\n"
+                hit = search_delimiter(mp, input, mp->delim + 2,
+                                       mp->delim_len - 2, &off);
+                consume(mp, input, off);
+                if (!hit) {
+                    if (off == 0)
+                        goto need_more;
+                    break;
+                }
+                consume(mp, input, mp->delim_len - 2);
+                mp->state = MP_DELIMITER;
+                break;
+
+            case MP_DELIMITER:
+                if (body_available(mp, input) < 2)
+                    goto need_more;
+                char tail[2];
+                evbuffer_copyout(input, tail, 2);
+                if (tail[0] == '-' && tail[1] == '-') {
+                    logger(DEBUG, "detect end boundary.");
+                    consume(mp, input, 2);
+                    mp->state = MP_EPILOGUE;
+                    break;
+                }
+                // skip the rest of the delimiter line
+                if ((line_len = search_line(mp, input, &eol_len)) < 0)
+                    goto need_line;
+                logger(DEBUG, "detect start boundary.");
+                consume(mp, input, line_len + eol_len);
+                mp->state = MP_HEADERS;
+                break;
+
+            case MP_HEADERS:
+                if ((line_len = search_line(mp, input, &eol_len)) < 0)
+                    goto need_line;
+                if (line_len == 0) {
+                    consume(mp, input, eol_len);
+                    if (open_part(mp) < 0)
+                        return HTTP_PARSE_ERROR;
+                    mp->state = MP_BODY;
+                    break;
+                }
+                char* line = (char*)evbuffer_pullup(input, line_len + eol_len);
+                line[line_len] = '\0';
+                parse_part_header(mp, line);
+                consume(mp, input, line_len + eol_len);
+                break;
+
+            case MP_BODY:
+                hit = search_delimiter(mp, input, mp->delim, mp->delim_len, &off);
+                if (off > 0) {
+                    if (mp->fd < 0)
+                        consume(mp, input, off);
+                    else if (write_part(mp, input, off) < 0)
+                        return HTTP_PARSE_ERROR;
+                }
+                if (!hit) {
+                    if (off == 0)
+                        goto need_more;
+                    break;
+                }
+                consume(mp, input, mp->delim_len);
+                close_part(mp);
+                mp->state = MP_DELIMITER;
+                break;
+
+            case MP_EPILOGUE:
+                consume(mp, input, body_available(mp, input));
+                if (mp->remaining == 0)
+                    return HTTP_PARSE_DONE;
+                goto need_more;
+        }
+    }
+
+need_line:
+    if (body_available(mp, input) > HTTP_HDR_LINE_LEN)
+        return HTTP_PARSE_ERROR;
+need_more:
+    // the body ended before the close delimiter
+    if (mp->remaining == 0)
+        return HTTP_PARSE_ERROR;
+    return HTTP_PARSE_AGAIN;
+}
@@ -0,0 +1,51 @@
+#ifndef __HTTP_MULTIPART_H__
+#define __HTTP_MULTIPART_H__
+
+#include <stdint.h>
+#include "http_functions.h"
+
+// read high watermark while an upload body is streamed to disk
+#define UPLOAD_READ_HIGHWATER (1 << 18)
+// iovecs written to disk per writev(2)
+#define UPLOAD_WRITE_IOVECS 16
+// body length while a chunked body is still being decoded
+#define MULTIPART_LENGTH_UNKNOWN ((off_t)INT64_MAX)
+// "\r\n--" + boundary
+#define MULTIPART_DELIM_LEN (HTTP_HDR_BOUNDARY_LEN + 4)
+
+// states of the multipart/form-data body parser
+enum multipart_state {
+    MP_PREAMBLE = 0,  // before the first delimiter
+    MP_DELIMITER,     // right after a delimiter, "--" or a new part follows
+    MP_HEADERS,       // header lines of a part
+    MP_BODY,          // content of a part
+    MP_EPILOGUE       // after the close delimiter
+};
+
+// multipart body being received, persists across read callbacks
+typedef struct http_multipart_t {
+    enum multipart_state state;
+    char delim[MULTIPART_DELIM_LEN];
+    size_t delim_len;
+    off_t remaining;                 // body bytes not consumed yet
+    int fd;                          // file of the current part, -1 if none
+    int parts;                       // files stored so far
+    int io_error;                    // failed because of the filesystem
+    int target_is_dir;               // path is a directory, -1 if unknown
+    char path[MAX_PATH_LEN];         // request path on server
+    char filename[MAX_PATH_LEN];     // filename of the current part
+    char part_path[MAX_PATH_LEN];    // where the current part is stored
+} http_multipart_t;
+
+/*
+    function declarations
+ */
+// prepare to receive a body of length bytes posted to path
+int http_multipart_init(http_multipart_t* mp, const char* boundary,
+                        off_t length, const char* path);
+// consume buffered body bytes, returns one of HTTP_PARSE_*
+int http_multipart_feed(http_multipart_t* mp, struct evbuffer* input);
+// release an upload, removing the part left incomplete
+void http_multipart_cleanup(http_multipart_t* mp);
+
+#endif
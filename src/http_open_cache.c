@@ -0,0 +1,211 @@
+#include "http_open_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "http_functions.h"
+#include "logger.h"
+
+static struct {
+    pthread_mutex_t lock;
+    // entries allowed in the table, 0 when it is disabled
+    int max;
+    int count;
+    http_open_file_t* buckets[HTTP_OPEN_CACHE_BUCKETS];
+    // most recently used first
+    http_open_file_t* lru_head;
+    http_open_file_t* lru_tail;
+} table = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned hash_path(const char* path) {
+    // FNV-1a
+    unsigned h = 2166136261u;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void http_open_cache_release(http_open_file_t* f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    if (f->fd >= 0)
+        close(f->fd);
+    free(f->path);
+    free(f);
+}
+
+static http_open_file_t* lookup(const char* path, unsigned hash) {
+    http_open_file_t* f = table.buckets[hash & (HTTP_OPEN_CACHE_BUCKETS - 1)];
+    while (f != NULL && (f->hash != hash || strcmp(f->path, path)))
+        f = f->next;
+    return f;
+}
+
+static void lru_unlink(http_open_file_t* f) {
+    if (f->lru_prev)
+        f->lru_prev->lru_next = f->lru_next;
+    else
+        table.lru_head = f->lru_next;
+    if (f->lru_next)
+        f->lru_next->lru_prev = f->lru_prev;
+    else
+        table.lru_tail = f->lru_prev;
+    f->lru_prev = f->lru_next = NULL;
+}
+
+static void lru_push(http_open_file_t* f) {
+    f->lru_prev = NULL;
+    f->lru_next = table.lru_head;
+    if (table.lru_head)
+        table.lru_head->lru_prev = f;
+    table.lru_head = f;
+    if (table.lru_tail == NULL)
+        table.lru_tail = f;
+}
+
+// unlink entry from the table, caller holds the lock. Requests still
+// holding it keep its descriptor open until they are done
+static void table_remove(http_open_file_t* f) {
+    http_open_file_t** p =
+        &table.buckets[f->hash & (HTTP_OPEN_CACHE_BUCKETS - 1)];
+    while (*p != f)
+        p = &(*p)->next;
+    *p = f->next;
+    f->next = NULL;
+    lru_unlink(f);
+    f->in_table = 0;
+    table.count--;
+    http_open_cache_release(f);
+}
+
+// publish a fresh entry, replacing one another thread opened meanwhile
+static void table_insert(http_open_file_t* f) {
+    http_open_file_t* old = lookup(f->path, f->hash);
+    if (old != NULL)
+        table_remove(old);
+    while (table.lru_tail != NULL && table.count >= table.max)
+        table_remove(table.lru_tail);
+    http_open_file_t** bucket =
+        &table.buckets[f->hash & (HTTP_OPEN_CACHE_BUCKETS - 1)];
+    f->next = *bucket;
+    *bucket = f;
+    lru_push(f);
+    f->in_table = 1;
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+    table.count++;
+}
+
+// open and fstat path, outside of the lock
+static http_open_file_t* open_entry(const char* path, unsigned hash) {
+    http_open_file_t* f = (http_open_file_t*)calloc(1, sizeof(*f));
+    if (f == NULL || (f->path = strdup(path)) == NULL) {
+        free(f);
+        return NULL;
+    }
+    f->hash = hash;
+    f->refs = 1;
+    // O_NONBLOCK keeps a fifo from blocking the open, regular files and
+    // directories ignore it
+    f->fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (f->fd < 0 || fstat(f->fd, &f->st) < 0)
+        f->err = errno;
+    // only what can be sent or listed keeps its descriptor
+    if (f->fd >= 0 && (f->err != 0 || (!S_ISREG(f->st.st_mode) &&
+                                       !S_ISDIR(f->st.st_mode)))) {
+        close(f->fd);
+        f->fd = -1;
+    }
+    f->valid_until = time(NULL) + (f->err ? HTTP_OPEN_CACHE_NEGATIVE_SECS
+                                          : HTTP_OPEN_CACHE_VALID_SECS);
+    return f;
+}
+
+// whether the entry still describes what is at its path
+static int entry_current(const http_open_file_t* f) {
+    struct stat st;
+    if (stat(f->path, &st) < 0)
+        return 0;
+    return st.st_ino == f->st.st_ino && st.st_dev == f->st.st_dev &&
+           st.st_size == f->st.st_size &&
+           st.st_mtim.tv_sec == f->st.st_mtim.tv_sec &&
+           st.st_mtim.tv_nsec == f->st.st_mtim.tv_nsec &&
+           st.st_ctim.tv_sec == f->st.st_ctim.tv_sec &&
+           st.st_ctim.tv_nsec == f->st.st_ctim.tv_nsec;
+}
+
+http_open_file_t* http_open_cache_get(const char* path) {
+    unsigned hash = hash_path(path);
+    if (table.max == 0)
+        return open_entry(path, hash);
+
+    pthread_mutex_lock(&table.lock);
+    http_open_file_t* f = lookup(path, hash);
+    if (f != NULL) {
+        __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+        lru_unlink(f);
+        lru_push(f);
+        time_t now = time(NULL);
+        if (now < f->valid_until) {
+            pthread_mutex_unlock(&table.lock);
+            return f;
+        }
+        // one request per interval checks a found path, the others keep
+        // using it meanwhile. Missing paths are simply looked up again
+        int check = (f->err == 0);
+        if (check)
+            f->valid_until = now + HTTP_OPEN_CACHE_VALID_SECS;
+        pthread_mutex_unlock(&table.lock);
+        if (check && entry_current(f))
+            return f;
+        pthread_mutex_lock(&table.lock);
+        if (f->in_table)
+            table_remove(f);
+        pthread_mutex_unlock(&table.lock);
+        http_open_cache_release(f);
+    } else {
+        pthread_mutex_unlock(&table.lock);
+    }
+
+    if ((f = open_entry(path, hash)) == NULL)
+        return NULL;
+    pthread_mutex_lock(&table.lock);
+    table_insert(f);
+    pthread_mutex_unlock(&table.lock);
+    logger(DEBUG, "open cache miss %s: %s", path,
+           f->err ? strerror(f->err) : "found");
+    return f;
+}
+
+static void forget(const char* path) {
+    http_open_file_t* f = lookup(path, hash_path(path));
+    if (f != NULL)
+        table_remove(f);
+}
+
+void http_open_cache_invalidate(const char* path) {
+    if (table.max == 0)
+        return;
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char* slash = strrchr(dir, '/');
+    pthread_mutex_lock(&table.lock);
+    forget(path);
+    // the directory is requested with or without its trailing slash
+    if (slash != NULL) {
+        slash[1] = '\0';
+        forget(dir);
+        slash[0] = '\0';
+        forget(dir);
+    }
+    pthread_mutex_unlock(&table.lock);
+}
+
+void http_open_cache_init(int max_files) {
+    table.max = max_files;
+}
@@ -0,0 +1,49 @@
+#ifndef __HTTP_OPEN_CACHE_H__
+#define __HTTP_OPEN_CACHE_H__
+
+#include <sys/stat.h>
+#include <time.h>
+
+// buckets of the open file table, a power of two
+#define HTTP_OPEN_CACHE_BUCKETS (1 << 12)
+// seconds a found path is trusted before it is checked with stat again
+#define HTTP_OPEN_CACHE_VALID_SECS 5
+// seconds a path that could not be opened is remembered
+#define HTTP_OPEN_CACHE_NEGATIVE_SECS 1
+
+// what opening one path found. Shared by every request for the path and
+// immutable once published, the descriptor is closed with the last
+// reference
+typedef struct http_open_file_t {
+    char* path;
+    unsigned hash;
+    // open for regular files and directories, -1 otherwise
+    int fd;
+    // errno of the failed open, 0 when st is valid
+    int err;
+    struct stat st;
+    // trusted until then, checked or looked up again afterwards
+    time_t valid_until;
+    // references held by the table, requests and pending output
+    int refs;
+    int in_table;
+    struct http_open_file_t* next;
+    struct http_open_file_t* lru_prev;
+    struct http_open_file_t* lru_next;
+} http_open_file_t;
+
+/*
+    function declarations
+ */
+// create the table shared by all workers, holding at most max_files
+// entries and so as many descriptors. 0 disables it
+void http_open_cache_init(int max_files);
+// referenced entry of path, opening it on a miss. May block on the disk,
+// NULL only when out of memory
+http_open_file_t* http_open_cache_get(const char* path);
+// drop a reference returned by http_open_cache_get
+void http_open_cache_release(http_open_file_t* file);
+// forget path and its directory, whose listing changes along with it
+void http_open_cache_invalidate(const char* path);
+
+#endif
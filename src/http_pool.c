@@ -0,0 +1,92 @@
+#include "http_pool.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logger.h"
+
+// a block grown by an arena, used from the start of data
+typedef struct http_arena_block_t {
+    struct http_arena_block_t* next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} http_arena_block_t;
+
+// the free list links objects through their first bytes, keep them aligned
+#define ALIGN_UP(n) \
+    (((n) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+void* http_pool_alloc(http_pool_t* pool) {
+    if (pool->free == NULL) {
+        size_t size = ALIGN_UP(pool->size);
+        char* slab = (char*)malloc(size * HTTP_POOL_SLAB_OBJECTS);
+        if (slab == NULL)
+            return NULL;
+        for (int i = HTTP_POOL_SLAB_OBJECTS - 1; i >= 0; i--)
+            http_pool_free(pool, slab + i * size);
+        pool->total += HTTP_POOL_SLAB_OBJECTS;
+    }
+    void* obj = pool->free;
+    pool->free = *(void**)obj;
+    return obj;
+}
+
+void http_pool_free(http_pool_t* pool, void* obj) {
+    *(void**)obj = pool->free;
+    pool->free = obj;
+}
+
+void http_arena_init(http_arena_t* arena) {
+    arena->used = 0;
+    arena->blocks = NULL;
+}
+
+// n bytes at an offset rounded up to align, a power of two
+static void* arena_take(http_arena_t* arena, size_t n, size_t align) {
+    size_t off = (arena->used + align - 1) & ~(align - 1);
+    if (off + n <= HTTP_ARENA_INLINE) {
+        arena->used = off + n;
+        return arena->buf + off;
+    }
+    http_arena_block_t* block = arena->blocks;
+    if (block != NULL) {
+        off = (block->used + align - 1) & ~(align - 1);
+        if (off + n <= block->size) {
+            block->used = off + n;
+            return (char*)block->data + off;
+        }
+    }
+    size_t size = n > HTTP_ARENA_BLOCK ? n : HTTP_ARENA_BLOCK;
+    block = (http_arena_block_t*)malloc(sizeof(http_arena_block_t) + size);
+    if (block == NULL) {
+        logger(ERROR, "failed to grow request arena");
+        return NULL;
+    }
+    block->size = size;
+    block->used = n;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return block->data;
+}
+
+void* http_arena_alloc(http_arena_t* arena, size_t n) {
+    return arena_take(arena, n, _Alignof(max_align_t));
+}
+
+char* http_arena_strndup(http_arena_t* arena, const char* s, size_t n) {
+    char* p = (char*)arena_take(arena, n + 1, 1);
+    if (p == NULL)
+        return NULL;
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+void http_arena_reset(http_arena_t* arena) {
+    arena->used = 0;
+    while (arena->blocks != NULL) {
+        http_arena_block_t* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef __HTTP_POOL_H__
+#define __HTTP_POOL_H__
+
+#include <stddef.h>
+
+// objects carved from one slab of a pool
+#define HTTP_POOL_SLAB_OBJECTS 32
+// bytes of an arena kept inside its owner, enough for common request heads
+#define HTTP_ARENA_INLINE (1 << 10)
+// smallest block an arena allocates once its inline bytes are used up
+#define HTTP_ARENA_BLOCK (1 << 12)
+
+// fixed size objects recycled through a free list. Slabs are never given
+// back, so a pool holds as many objects as were ever in use at once. A pool
+// belongs to one thread, there is no locking
+typedef struct http_pool_t {
+    size_t size;
+    // objects ready for reuse, linked through their first bytes
+    void* free;
+    // objects carved so far, in use or free
+    size_t total;
+} http_pool_t;
+
+// a pool of objects of size bytes
+#define HTTP_POOL_INIT(size) {(size), NULL, 0}
+
+struct http_arena_block_t;
+
+// bump allocator released all at once. What fits in the inline bytes costs
+// no allocation and resetting it only rewinds an offset
+typedef struct http_arena_t {
+    size_t used;
+    // blocks allocated past the inline bytes, newest first
+    struct http_arena_block_t* blocks;
+    _Alignas(max_align_t) char buf[HTTP_ARENA_INLINE];
+} http_arena_t;
+
+/*
+    function declarations
+ */
+// take an object from the pool, its content is undefined. NULL when out
+// of memory
+void* http_pool_alloc(http_pool_t* pool);
+// give obj back to the pool it came from
+void http_pool_free(http_pool_t* pool, void* obj);
+// get an empty arena ready, once before it is used
+void http_arena_init(http_arena_t* arena);
+// n bytes aligned for any type, NULL when out of memory
+void* http_arena_alloc(http_arena_t* arena, size_t n);
+// copy of the n bytes at s, nul terminated
+char* http_arena_strndup(http_arena_t* arena, const char* s, size_t n);
+// release everything allocated from the arena
+void http_arena_reset(http_arena_t* arena);
+
+#endif
@@ -0,0 +1,237 @@
+#include "http_put.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include "http_cache.h"
+#include "http_config.h"
+#include "logger.h"
+
+static int fsync_policy = DEFAULT_FSYNC;
+
+void http_put_init(int policy) {
+    fsync_policy = policy;
+}
+
+void http_put_prepare(http_put_file_t* f, const char* path) {
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    f->temp[0] = '\0';
+    f->fd = -1;
+    f->offset = 0;
+    f->existed = 0;
+    f->ranged = 0;
+    f->pipe[0] = f->pipe[1] = -1;
+    f->err = 0;
+}
+
+// status answering a failed open or create
+static enum http_status open_status(http_put_file_t* f) {
+    f->err = errno;
+    logger(DEBUG, "failed to create %s: %s", f->temp, strerror(f->err));
+    if (f->err == ENOENT || f->err == ENOTDIR)
+        return HTTP_STATUS_CONFLICT;  // no parent directory
+    if (f->err == EACCES)
+        return HTTP_STATUS_FORBIDDEN;
+    return HTTP_STATUS_INTERNAL_ERR;
+}
+
+enum http_status http_put_open(http_put_file_t* f, off_t first, off_t length,
+                               off_t total) {
+    struct stat st;
+    if (stat(f->path, &st) == 0) {
+        if (S_ISDIR(st.st_mode))
+            return HTTP_STATUS_CONFLICT;
+        f->existed = 1;
+    }
+    // written next to the target so the rename stays on one filesystem
+    const char* slash = strrchr(f->path, '/');
+    int dir_len = slash - f->path + 1;
+    f->ranged = (total >= 0);
+    if (f->ranged) {
+        // pieces are collected in a file of fixed name, so an interrupted
+        // upload resumes where it stopped
+        snprintf(f->temp, sizeof(f->temp), "%.*s.%s" PUT_PART_SUFFIX,
+                 dir_len, f->path, slash + 1);
+        f->fd = open(f->temp, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (f->fd < 0)
+            return open_status(f);
+        // another piece of the same file is being written, the lock goes
+        // with the descriptor
+        if (flock(f->fd, LOCK_EX | LOCK_NB) < 0) {
+            f->err = errno;
+            logger(DEBUG, "%s is being uploaded already", f->path);
+            return f->err == EWOULDBLOCK ? HTTP_STATUS_CONFLICT
+                                         : HTTP_STATUS_INTERNAL_ERR;
+        }
+        if (fstat(f->fd, &st) < 0) {
+            f->err = errno;
+            return HTTP_STATUS_INTERNAL_ERR;
+        }
+        // pieces arrive in order, each may overlap what is there
+        f->offset = st.st_size;
+        if (first > st.st_size)
+            return HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+        // earlier pieces were of another file, the client starts over
+        if (st.st_size > total) {
+            unlink(f->temp);
+            return HTTP_STATUS_CONFLICT;
+        }
+    } else {
+        snprintf(f->temp, sizeof(f->temp), "%.*s.%s.XXXXXX", dir_len,
+                 f->path, slash + 1);
+        f->fd = mkostemp(f->temp, O_CLOEXEC);
+        if (f->fd < 0) {
+            enum http_status status = open_status(f);
+            f->temp[0] = '\0';
+            return status;
+        }
+        // mkostemp creates it readable by the owner only
+        fchmod(f->fd, 0644);
+    }
+    f->offset = first;
+    // blocks are allocated at once rather than as the body trickles in,
+    // and a full disk is found out before the body is read
+    if (length > 0 &&
+        fallocate(f->fd, FALLOC_FL_KEEP_SIZE, first, length) < 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS) {
+        f->err = errno;
+        logger(ERROR, "failed to reserve %lld bytes for %s: %s",
+               (long long)length, f->temp, strerror(f->err));
+        return HTTP_STATUS_INTERNAL_ERR;
+    }
+    return HTTP_STATUS_OK;
+}
+
+int http_put_write(http_put_file_t* f, struct evbuffer* body) {
+    while (evbuffer_get_length(body) > 0) {
+        struct evbuffer_iovec vec[PUT_WRITE_IOVECS];
+        struct iovec iov[PUT_WRITE_IOVECS];
+        int n = evbuffer_peek(body, -1, NULL, vec, PUT_WRITE_IOVECS);
+        if (n > PUT_WRITE_IOVECS)
+            n = PUT_WRITE_IOVECS;
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = vec[i].iov_base;
+            iov[i].iov_len = vec[i].iov_len;
+        }
+        ssize_t written = pwritev(f->fd, iov, n, f->offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            f->err = errno;
+            logger(ERROR, "failed to write %s: %s", f->temp, strerror(f->err));
+            return -1;
+        }
+        f->offset += written;
+        evbuffer_drain(body, written);
+    }
+    return 0;
+}
+
+int http_put_splice(http_put_file_t* f, int sock, off_t* remaining) {
+    if (f->pipe[0] < 0) {
+        if (pipe2(f->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+            f->err = errno;
+            logger(ERROR, "failed to create pipe: %s", strerror(f->err));
+            return -1;
+        }
+        // a larger pipe moves more per pair of calls, the default 64k is
+        // kept when pipe-max-size is lower
+        fcntl(f->pipe[1], F_SETPIPE_SZ, PUT_PIPE_SIZE);
+    }
+    while (*remaining > 0) {
+        size_t want = *remaining < PUT_PIPE_SIZE ? (size_t)*remaining
+                                                 : PUT_PIPE_SIZE;
+        // the pipe is empty here, so EAGAIN is about the socket
+        ssize_t n = splice(sock, NULL, f->pipe[1], NULL, want,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return 0;
+        if (n <= 0)
+            return 1;
+        *remaining -= n;
+        // empty the pipe into the file before reading more
+        while (n > 0) {
+            ssize_t moved = splice(f->pipe[0], NULL, f->fd, &f->offset, n,
+                                   SPLICE_F_MOVE);
+            if (moved < 0 && errno == EINTR)
+                continue;
+            if (moved <= 0) {
+                f->err = moved < 0 ? errno : EIO;
+                logger(ERROR, "failed to write %s: %s", f->temp,
+                       strerror(f->err));
+                return -1;
+            }
+            n -= moved;
+        }
+    }
+    return 0;
+}
+
+// flush the directory entry of a rename
+static void sync_dir(const char* path) {
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%.*s", (int)(strrchr(path, '/') - path),
+             path);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (fsync(fd) < 0)
+        logger(WARNING, "failed to sync %s: %s", dir, strerror(errno));
+    close(fd);
+}
+
+enum http_status http_put_commit(http_put_file_t* f, off_t total) {
+    int ret = 0;
+    if (fsync_policy == FSYNC_FULL)
+        ret = fsync(f->fd);
+    else if (fsync_policy == FSYNC_DATA)
+        ret = fdatasync(f->fd);
+    if (ret < 0) {
+        f->err = errno;
+        logger(ERROR, "failed to sync %s: %s", f->temp, strerror(f->err));
+        return HTTP_STATUS_INTERNAL_ERR;
+    }
+    if (f->ranged) {
+        // pieces may be sent again, what counts is what the file holds
+        struct stat st;
+        if (fstat(f->fd, &st) < 0) {
+            f->err = errno;
+            return HTTP_STATUS_INTERNAL_ERR;
+        }
+        f->offset = st.st_size;
+        if (st.st_size < total)
+            return HTTP_STATUS_ACCEPTED;
+    }
+    // readers see the old file or the new one, never a part of it
+    if (rename(f->temp, f->path) < 0) {
+        f->err = errno;
+        logger(ERROR, "failed to rename %s: %s", f->temp, strerror(f->err));
+        return HTTP_STATUS_INTERNAL_ERR;
+    }
+    f->temp[0] = '\0';
+    if (fsync_policy == FSYNC_FULL)
+        sync_dir(f->path);
+    http_cache_invalidate(f->path);
+    http_open_cache_invalidate(f->path);
+    logger(DEBUG, "stored %s", f->path);
+    return f->existed ? HTTP_STATUS_NO_CONTENT : HTTP_STATUS_CREATED;
+}
+
+void http_put_cleanup(http_put_file_t* f) {
+    if (f->pipe[0] >= 0) {
+        close(f->pipe[0]);
+        close(f->pipe[1]);
+        f->pipe[0] = f->pipe[1] = -1;
+    }
+    if (f->fd < 0)
+        return;
+    close(f->fd);
+    f->fd = -1;
+    // a part file stays for the upload to be resumed
+    if (!f->ranged && f->temp[0] != '\0') {
+        unlink(f->temp);
+        logger(DEBUG, "removed incomplete upload %s", f->temp);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef __HTTP_PUT_H__
+#define __HTTP_PUT_H__
+
+#include <sys/types.h>
+#include "http_functions.h"
+
+// capacity asked for the pipe splice(2) moves a PUT body through
+#define PUT_PIPE_SIZE (1 << 20)
+// iovecs written to disk per pwritev(2)
+#define PUT_WRITE_IOVECS 16
+// suffix of the hidden file the pieces of a ranged PUT are collected in
+#define PUT_PART_SUFFIX ".part"
+
+// file a PUT body is written to, renamed over its target once complete.
+// Used by one pool thread at a time
+typedef struct http_put_file_t {
+    char path[MAX_PATH_LEN];  // target
+    char temp[MAX_PATH_LEN];  // where the body goes meanwhile, "" if none
+    int fd;
+    // where the next body byte goes, the bytes collected after a commit
+    // answered with 202 or an open answered with 416
+    off_t offset;
+    // the target was there before
+    int existed;
+    // the body is one piece of the file, collected across requests
+    int ranged;
+    // pipe between socket and file, -1 until splice(2) is first used
+    int pipe[2];
+    // errno of the failed operation, 0 while fine
+    int err;
+} http_put_file_t;
+
+/*
+    function declarations
+ */
+// how uploads are flushed before they replace their target, an enum
+// http_fsync
+void http_put_init(int fsync_policy);
+// set up a PUT to path, nothing is opened yet
+void http_put_prepare(http_put_file_t* f, const char* path);
+// open the file for length body bytes starting at first, total is the
+// length of the whole file for a Content-Range piece and -1 otherwise.
+// Space is reserved up front. Returns HTTP_STATUS_OK or the status the PUT
+// is answered with
+enum http_status http_put_open(http_put_file_t* f, off_t first, off_t length,
+                               off_t total);
+// write and drain the queued body, -1 on failure
+int http_put_write(http_put_file_t* f, struct evbuffer* body);
+// move up to *remaining body bytes from sock to the file without copying
+// them through user space. 0 once sock has nothing more for now or the
+// body is complete, 1 when the client went away first, -1 on failure
+int http_put_splice(http_put_file_t* f, int sock, off_t* remaining);
+// flush the file and rename it over the target once all of its total bytes
+// are there. Returns the status the PUT is answered with
+enum http_status http_put_commit(http_put_file_t* f, off_t total);
+// close the file, removing a temporary one that wasn't committed
+void http_put_cleanup(http_put_file_t* f);
+
+#endif
@@ -0,0 +1,163 @@
+#include "http_range.h"
+#include "http_conditional.h"
+#include "logger.h"
+
+// parse decimal digits at *p, -1 if there are none or too many
+static off_t parse_offset(const char** p) {
+    off_t v = 0;
+    int digits = 0;
+    while (isdigit((unsigned char)**p)) {
+        if (++digits > 18)
+            return -1;
+        v = v * 10 + (**p - '0');
+        (*p)++;
+    }
+    return digits ? v : -1;
+}
+
+static int range_cmp(const void* a, const void* b) {
+    off_t x = ((const http_range_t*)a)->first;
+    off_t y = ((const http_range_t*)b)->first;
+    return x < y ? -1 : x > y;
+}
+
+int http_range_parse(const char* value, off_t size, http_range_t* ranges) {
+    if (strncasecmp(value, "bytes=", 6))
+        return 0;
+    const char* p = value + 6;
+    int n = 0, specs = 0;
+    for (;;) {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        off_t first = -1, last = -1;
+        if (*p == '-') {
+            // suffix: the last n bytes
+            p++;
+            off_t suffix = parse_offset(&p);
+            if (suffix < 0)
+                return 0;
+            first = suffix < size ? size - suffix : 0;
+            last = suffix > 0 ? size - 1 : -1;
+        } else {
+            if ((first = parse_offset(&p)) < 0 || *p++ != '-')
+                return 0;
+            if (isdigit((unsigned char)*p)) {
+                if ((last = parse_offset(&p)) < first)
+                    return 0;
+            } else {
+                last = size - 1;
+            }
+            if (last >= size)
+                last = size - 1;
+        }
+        // too many ranges are more likely an attack than a download
+        if (++specs > HTTP_RANGE_MAX)
+            return 0;
+        if (first < size && first <= last) {
+            ranges[n].first = first;
+            ranges[n].last = last;
+            n++;
+        }
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0')
+            break;
+        if (*p++ != ',')
+            return 0;
+    }
+    if (n == 0)
+        return -1;
+    // overlapping and adjacent ranges are sent as one
+    qsort(ranges, n, sizeof(http_range_t), range_cmp);
+    int merged = 0;
+    for (int i = 1; i < n; i++) {
+        if (ranges[i].first <= ranges[merged].last + 1) {
+            if (ranges[i].last > ranges[merged].last)
+                ranges[merged].last = ranges[i].last;
+        } else {
+            ranges[++merged] = ranges[i];
+        }
+    }
+    return merged + 1;
+}
+
+int http_range_if_range(const char* value, const http_validators_t* v) {
+    // an entity tag must match strongly, a date exactly
+    if (value[0] == '"' || !strncmp(value, "W/", 2))
+        return http_etag_match(value, v->etag, 0);
+    return !strcmp(value, v->last_modified);
+}
+
+static size_t part_header(char* buf, const char* boundary, const char* type,
+                          const http_range_t* r, off_t size) {
+    return snprintf(buf, HTTP_RANGE_PART_HDR_LEN,
+                    "\r\n--%s\r\nContent-Type: %s\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    boundary, type, (long long)r->first, (long long)r->last,
+                    (long long)size);
+}
+
+int http_range_send(http_conn_t* conn, http_open_file_t* file,
+                    const char* type, http_range_t* ranges, int n) {
+    bfevent_t* client = conn->bev;
+    const struct stat* st = &file->st;
+    char buf[HTTP_RANGE_PART_HDR_LEN];
+    http_response_t resp;
+    http_response_begin(&resp, HTTP_STATUS_PARTIAL_CONTENT);
+    http_response_append(&resp, "Accept-Ranges: bytes\r\n", 22);
+
+    if (n > 1 && !http_conn_can_sendfile(conn)) {
+        // the file stream carries one range, send the span covering all
+        ranges[0].last = ranges[n - 1].last;
+        n = 1;
+    }
+    if (n == 1) {
+        logger(DEBUG, "sending range %lld-%lld", (long long)ranges[0].first,
+               (long long)ranges[0].last);
+        http_response_header(&resp, "Content-Type", type);
+        snprintf(buf, sizeof(buf), "bytes %lld-%lld/%lld",
+                 (long long)ranges[0].first, (long long)ranges[0].last,
+                 (long long)st->st_size);
+        http_response_header(&resp, "Content-Range", buf);
+        http_response_length(&resp, ranges[0].last - ranges[0].first + 1);
+        http_response_end(&resp, conn->hdr.alive);
+        http_response_send(&resp, client);
+        return send_file(conn, file, ranges[0].first,
+                         ranges[0].last - ranges[0].first + 1);
+    }
+
+    // multipart/byteranges, its length is known up front
+    char boundary[40];
+    snprintf(boundary, sizeof(boundary), "wuw%08lx%08lx",
+             (unsigned long)st->st_ino & 0xffffffffUL,
+             (unsigned long)random());
+    off_t length = 0;
+    for (int i = 0; i < n; i++)
+        length += part_header(buf, boundary, type, &ranges[i], st->st_size) +
+                  ranges[i].last - ranges[i].first + 1;
+    length += strlen(boundary) + 8;
+    snprintf(buf, sizeof(buf), "multipart/byteranges; boundary=%s", boundary);
+    http_response_header(&resp, "Content-Type", buf);
+    http_response_length(&resp, length);
+    http_response_end(&resp, conn->hdr.alive);
+    http_response_send(&resp, client);
+
+    // every part is sent from the same file segment
+    struct evbuffer* output = bufferevent_get_output(client);
+    struct evbuffer_file_segment* seg = http_file_segment(file);
+    if (seg == NULL) {
+        conn->failed = 1;
+        return -1;
+    }
+    logger(DEBUG, "sending %d ranges", n);
+    for (int i = 0; i < n; i++) {
+        size_t len = part_header(buf, boundary, type, &ranges[i], st->st_size);
+        evbuffer_add(output, buf, len);
+        evbuffer_add_file_segment(output, seg, ranges[i].first,
+                                  ranges[i].last - ranges[i].first + 1);
+    }
+    evbuffer_add_printf(output, "\r\n--%s--\r\n", boundary);
+    // the output buffer holds its own references
+    evbuffer_file_segment_free(seg);
+    return 0;
+}
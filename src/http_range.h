@@ -0,0 +1,30 @@
+#ifndef __HTTP_RANGE_H__
+#define __HTTP_RANGE_H__
+
+#include "http_functions.h"
+
+// ranges honoured per request, more make the header ignored
+#define HTTP_RANGE_MAX 16
+// longest part header of a multipart/byteranges response
+#define HTTP_RANGE_PART_HDR_LEN 256
+
+// byte range [first, last] of a representation
+typedef struct http_range_t {
+    off_t first;
+    off_t last;
+} http_range_t;
+
+/*
+    function declarations
+ */
+// parse a Range value against a representation of size bytes. Returns the
+// number of satisfiable ranges stored in ranges, sorted and merged, 0 when
+// the header is to be ignored, -1 when no range can be satisfied
+int http_range_parse(const char* value, off_t size, http_range_t* ranges);
+// whether an If-Range validator still matches the file
+int http_range_if_range(const char* value, const http_validators_t* v);
+// send the ranges of file as a 206 response, takes over the reference
+int http_range_send(http_conn_t* conn, http_open_file_t* file,
+                    const char* type, http_range_t* ranges, int n);
+
+#endif
@@ -0,0 +1,217 @@
+#include "http_ratelimit.h"
+#include <pthread.h>
+#include <event2/bufferevent.h>
+#include "logger.h"
+
+struct http_rate_client_t {
+    struct in_addr addr;
+    struct bufferevent_rate_limit_group* group;
+    // connections in the group, under the table lock
+    int conns;
+    struct http_rate_client_t* next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    // bytes per tick by enum http_rate_scope, HTTP_RATE_UNLIMITED for none.
+    // Downloads are written to the client, uploads read from it
+    size_t down[RATE_SCOPES];
+    size_t up[RATE_SCOPES];
+    // bucket of every connection, NULL when they aren't limited one by one
+    struct ev_token_bucket_cfg* conn_cfg;
+    // group of all connections, used when client addresses aren't limited
+    struct bufferevent_rate_limit_group* global;
+    // connections are grouped by client address
+    int per_client;
+    struct http_rate_client_t* buckets[1 << HTTP_RATE_BUCKET_BITS];
+    int clients;
+    // clients the global rate was last split among
+    int split;
+    struct event* rescale;
+    int options;
+} limits = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const struct timeval tick = {0, HTTP_RATE_TICK_MS * 1000};
+
+static size_t per_tick(int kib) {
+    if (kib <= 0)
+        return HTTP_RATE_UNLIMITED;
+    size_t n = (size_t)kib * 1024 * HTTP_RATE_TICK_MS / 1000;
+    return n > 0 ? n : 1;
+}
+
+// bucket of down and up bytes per tick. The burst is one tick, so an idle
+// connection doesn't save up for a later flood
+static struct ev_token_bucket_cfg* bucket_cfg(size_t down, size_t up) {
+    return ev_token_bucket_cfg_new(up, up, down, down, &tick);
+}
+
+// rate of one client group, its own limit or its share of the global one
+static size_t client_rate(size_t client, size_t global, int clients) {
+    if (global == HTTP_RATE_UNLIMITED)
+        return client;
+    size_t share = global / (clients > 0 ? clients : 1);
+    if (share == 0)
+        share = 1;
+    return share < client ? share : client;
+}
+
+static struct ev_token_bucket_cfg* client_cfg(int clients) {
+    return bucket_cfg(
+        client_rate(limits.down[RATE_CLIENT], limits.down[RATE_GLOBAL], clients),
+        client_rate(limits.up[RATE_CLIENT], limits.up[RATE_GLOBAL], clients));
+}
+
+// a bufferevent joins one group at most, so with client groups the global
+// rate is split among them, as the number of clients changes
+static void rescale_cb(evutil_socket_t fd, short what, void* arg) {
+    (void)fd;
+    (void)what;
+    (void)arg;
+    pthread_mutex_lock(&limits.lock);
+    struct ev_token_bucket_cfg* cfg;
+    if (limits.clients != limits.split &&
+        (cfg = client_cfg(limits.clients)) != NULL) {
+        for (int i = 0; i < (1 << HTTP_RATE_BUCKET_BITS); i++) {
+            for (struct http_rate_client_t* c = limits.buckets[i]; c != NULL;
+                 c = c->next)
+                bufferevent_rate_limit_group_set_cfg(c->group, cfg);
+        }
+        ev_token_bucket_cfg_free(cfg);
+        limits.split = limits.clients;
+    }
+    pthread_mutex_unlock(&limits.lock);
+}
+
+int http_ratelimit_init(struct event_base* base, int workers,
+                        const int download[RATE_SCOPES],
+                        const int upload[RATE_SCOPES]) {
+    for (int i = 0; i < RATE_SCOPES; i++) {
+        limits.down[i] = per_tick(download[i]);
+        limits.up[i] = per_tick(upload[i]);
+    }
+    if ((download[RATE_CONN] > 0 || upload[RATE_CONN] > 0) &&
+        (limits.conn_cfg = bucket_cfg(limits.down[RATE_CONN],
+                                      limits.up[RATE_CONN])) == NULL)
+        return -1;
+    int global = (download[RATE_GLOBAL] > 0 || upload[RATE_GLOBAL] > 0);
+    limits.per_client = (download[RATE_CLIENT] > 0 || upload[RATE_CLIENT] > 0);
+    if (global && !limits.per_client) {
+        struct ev_token_bucket_cfg* cfg =
+            bucket_cfg(limits.down[RATE_GLOBAL], limits.up[RATE_GLOBAL]);
+        if (cfg == NULL)
+            return -1;
+        limits.global = bufferevent_rate_limit_group_new(base, cfg);
+        ev_token_bucket_cfg_free(cfg);
+        if (limits.global == NULL)
+            return -1;
+    } else if (global) {
+        struct timeval secs = {HTTP_RATE_RESCALE_SECS, 0};
+        if ((limits.rescale = event_new(base, -1, EV_PERSIST, rescale_cb,
+                                        NULL)) == NULL ||
+            event_add(limits.rescale, &secs) < 0)
+            return -1;
+    }
+    // the timer of a group refills it on one worker and wakes members
+    // belonging to the others
+    if ((global || limits.per_client) && workers > 1)
+        limits.options = BEV_OPT_THREADSAFE;
+    if (limits.conn_cfg != NULL || global || limits.per_client)
+        logger(INFO,
+               "rate limits in KiB/s, download %d,%d,%d upload %d,%d,%d "
+               "(connection, client, global)",
+               download[RATE_CONN], download[RATE_CLIENT],
+               download[RATE_GLOBAL], upload[RATE_CONN], upload[RATE_CLIENT],
+               upload[RATE_GLOBAL]);
+    return 0;
+}
+
+int http_ratelimit_options(void) {
+    return limits.options;
+}
+
+int http_ratelimit_downloads(void) {
+    return limits.down[RATE_CONN] != HTTP_RATE_UNLIMITED ||
+           limits.down[RATE_CLIENT] != HTTP_RATE_UNLIMITED ||
+           limits.down[RATE_GLOBAL] != HTTP_RATE_UNLIMITED;
+}
+
+int http_ratelimit_uploads(void) {
+    return limits.up[RATE_CONN] != HTTP_RATE_UNLIMITED ||
+           limits.up[RATE_CLIENT] != HTTP_RATE_UNLIMITED ||
+           limits.up[RATE_GLOBAL] != HTTP_RATE_UNLIMITED;
+}
+
+// addresses of one network differ in their low bits, which a
+// multiplicative hash spreads over the whole table
+static unsigned client_slot(struct in_addr addr) {
+    return (ntohl(addr.s_addr) * 2654435761u) >> (32 - HTTP_RATE_BUCKET_BITS);
+}
+
+// group of the client address of conn, created by its first connection
+static struct http_rate_client_t* client_get(http_conn_t* conn) {
+    struct in_addr addr = conn->peer.sin_addr;
+    unsigned slot = client_slot(addr);
+    pthread_mutex_lock(&limits.lock);
+    struct http_rate_client_t* c = limits.buckets[slot];
+    while (c != NULL && c->addr.s_addr != addr.s_addr)
+        c = c->next;
+    if (c == NULL && (c = calloc(1, sizeof(*c))) != NULL) {
+        struct ev_token_bucket_cfg* cfg = client_cfg(limits.clients + 1);
+        if (cfg != NULL)
+            c->group = bufferevent_rate_limit_group_new(conn->base, cfg);
+        ev_token_bucket_cfg_free(cfg);
+        if (c->group == NULL) {
+            logger(ERROR, "failed to create rate limit group");
+            free(c);
+            c = NULL;
+        } else {
+            c->addr = addr;
+            c->next = limits.buckets[slot];
+            limits.buckets[slot] = c;
+            limits.clients++;
+        }
+    }
+    if (c != NULL)
+        c->conns++;
+    pthread_mutex_unlock(&limits.lock);
+    return c;
+}
+
+void http_ratelimit_join(http_conn_t* conn) {
+    if (limits.per_client)
+        conn->rate_client = client_get(conn);
+    http_ratelimit_apply(conn);
+}
+
+void http_ratelimit_apply(http_conn_t* conn) {
+    if (limits.conn_cfg != NULL)
+        bufferevent_set_rate_limit(conn->bev, limits.conn_cfg);
+    if (conn->rate_client != NULL)
+        bufferevent_add_to_rate_limit_group(conn->bev, conn->rate_client->group);
+    else if (limits.global != NULL)
+        bufferevent_add_to_rate_limit_group(conn->bev, limits.global);
+}
+
+void http_ratelimit_leave(http_conn_t* conn) {
+    struct http_rate_client_t* c = conn->rate_client;
+    if (c == NULL)
+        return;
+    // a freed bufferevent may only leave its group later, while the group
+    // has to be empty when it goes
+    bufferevent_remove_from_rate_limit_group(conn->bev);
+    conn->rate_client = NULL;
+    pthread_mutex_lock(&limits.lock);
+    if (--c->conns == 0) {
+        struct http_rate_client_t** p = &limits.buckets[client_slot(c->addr)];
+        while (*p != c)
+            p = &(*p)->next;
+        *p = c->next;
+        limits.clients--;
+        bufferevent_rate_limit_group_free(c->group);
+        free(c);
+    }
+    pthread_mutex_unlock(&limits.lock);
+}
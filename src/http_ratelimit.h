@@ -0,0 +1,43 @@
+#ifndef __HTTP_RATELIMIT_H__
+#define __HTTP_RATELIMIT_H__
+
+#include <event2/event.h>
+#include "http_config.h"
+#include "http_functions.h"
+
+// buckets are refilled every tick, in milliseconds. Short ticks spread a
+// second's worth of bytes evenly instead of sending it in one burst
+#define HTTP_RATE_TICK_MS 100
+// bytes per tick of a direction without limit. Openssl bufferevents spin
+// on a bucket of EV_RATE_LIMIT_MAX
+#define HTTP_RATE_UNLIMITED ((size_t)1 << 30)
+// buckets of the per-address group table, as a power of two
+#define HTTP_RATE_BUCKET_BITS 10
+// seconds between two splits of the global rate among client addresses
+#define HTTP_RATE_RESCALE_SECS 1
+
+// connections of one client address, sharing a rate-limit group
+struct http_rate_client_t;
+
+/*
+    function declarations
+ */
+// set up the limits of downloads and uploads in KiB/s by enum
+// http_rate_scope. Groups spanning workers run their timers on base
+int http_ratelimit_init(struct event_base* base, int workers,
+                        const int download[RATE_SCOPES],
+                        const int upload[RATE_SCOPES]);
+// options new bufferevents need, groups touch them from other workers
+int http_ratelimit_options(void);
+// whether downloads are limited, so files must not go out with sendfile(2)
+int http_ratelimit_downloads(void);
+// whether uploads are limited, so bodies must come through a bufferevent
+int http_ratelimit_uploads(void);
+// put a new connection under the limits of its client address
+void http_ratelimit_join(http_conn_t* conn);
+// limit the bufferevent of the connection, again after it is replaced
+void http_ratelimit_apply(http_conn_t* conn);
+// take the connection out of its groups, before its bufferevent is freed
+void http_ratelimit_leave(http_conn_t* conn);
+
+#endif
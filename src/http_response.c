@@ -1,114 +1,352 @@
 #include "http_response.h"
+#include "http_encoding.h"
+#include "http_stats.h"
 #include "logger.h"
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 
-#define MAX_BUFF_SIZE (1 << 10)
+const char* get_content_type(const char* extension) {
+    for (int i = 0; content_type_table[i].extension != NULL; i++) {
+        if (!strcasecmp(extension, content_type_table[i].extension))
+            return content_type_table[i].content_type;
+    }
+    return "application/octet-stream";
+}
+
+// status lines, indexed by enum http_status
+static const char* status_lines[HTTP_STATUS_COUNT] = {
+    [HTTP_STATUS_OK] = "HTTP/1.1 200 OK",
+    [HTTP_STATUS_CREATED] = "HTTP/1.1 201 Created",
+    [HTTP_STATUS_ACCEPTED] = "HTTP/1.1 202 Accepted",
+    [HTTP_STATUS_NO_CONTENT] = "HTTP/1.1 204 No Content",
+    [HTTP_STATUS_PARTIAL_CONTENT] = "HTTP/1.1 206 Partial Content",
+    [HTTP_STATUS_NOT_MODIFIED] = "HTTP/1.1 304 Not Modified",
+    [HTTP_STATUS_BAD_REQUEST] = "HTTP/1.1 400 Bad Request",
+    [HTTP_STATUS_FORBIDDEN] = "HTTP/1.1 403 Forbidden",
+    [HTTP_STATUS_NOT_FOUND] = "HTTP/1.1 404 Not Found",
+    [HTTP_STATUS_REQUEST_TIMEOUT] = "HTTP/1.1 408 Request Timeout",
+    [HTTP_STATUS_CONFLICT] = "HTTP/1.1 409 Conflict",
+    [HTTP_STATUS_LENGTH_REQUIRED] = "HTTP/1.1 411 Length Required",
+    [HTTP_STATUS_RANGE_NOT_SATISFIABLE] = "HTTP/1.1 416 Range Not Satisfiable",
+    [HTTP_STATUS_INTERNAL_ERR] = "HTTP/1.1 500 Internal Server Error",
+    [HTTP_STATUS_NOT_IMPLEMENT] = "HTTP/1.1 501 Method Not Implemented",
+};
+
+// prebuilt blob, never freed
+typedef struct {
+    char* data;
+    size_t len;
+} blob_t;
+
+// status line followed by the server header
+static blob_t status_heads[HTTP_STATUS_COUNT];
+// error responses up to the Date header, and their pages
+static blob_t error_heads[HTTP_STATUS_COUNT];
+static blob_t error_pages[HTTP_STATUS_COUNT];
+
+// Date header of the current second, one copy per worker thread
+static __thread time_t date_second = -1;
+static __thread char date_line[64];
+static __thread size_t date_len;
+
+static blob_t blob_printf(const char* fmt, ...) {
+    blob_t b = {NULL, 0};
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vasprintf(&b.data, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        logger(ERROR, "failed to build response blob");
+        exit(1);
+    }
+    b.len = n;
+    return b;
+}
+
+static void build_error(enum http_status status, const char* title,
+                        const char* body) {
+    error_pages[status] = blob_printf(HTML_RESPONSE_FMT, title, body);
+    error_heads[status] = blob_printf(
+        "%sContent-Type: text/html\r\nContent-Length: %zu\r\n",
+        status_heads[status].data, error_pages[status].len);
+}
+
+void http_response_init(void) {
+    for (int i = 0; i < HTTP_STATUS_COUNT; i++)
+        status_heads[i] =
+            blob_printf("%s\r\n" SERVER_BASE_STR "\r\n", status_lines[i]);
+    build_error(HTTP_STATUS_BAD_REQUEST, HTML_TITLE_BAD_REQUEST,
+                HTML_BODY_BAD_REQUEST);
+    build_error(HTTP_STATUS_FORBIDDEN, HTML_TITLE_FORBIDDEN,
+                HTML_BODY_FORBIDDEN);
+    build_error(HTTP_STATUS_NOT_FOUND, HTML_TITLE_NOT_FOUND,
+                HTML_BODY_NOT_FOUND);
+    build_error(HTTP_STATUS_REQUEST_TIMEOUT, HTML_TITLE_REQUEST_TIMEOUT,
+                HTML_BODY_REQUEST_TIMEOUT);
+    build_error(HTTP_STATUS_CONFLICT, HTML_TITLE_CONFLICT, HTML_BODY_CONFLICT);
+    build_error(HTTP_STATUS_LENGTH_REQUIRED, HTML_TITLE_LENGTH_REQUIRED,
+                HTML_BODY_LENGTH_REQUIRED);
+    build_error(HTTP_STATUS_RANGE_NOT_SATISFIABLE,
+                HTML_TITLE_RANGE_NOT_SATISFIABLE,
+                HTML_BODY_RANGE_NOT_SATISFIABLE);
+    build_error(HTTP_STATUS_INTERNAL_ERR, HTML_TITLE_INTERNAL_ERR,
+                HTML_BODY_INTERNAL_ERR);
+    build_error(HTTP_STATUS_NOT_IMPLEMENT, HTML_TITLE_NOT_IMPLEMENT,
+                HTML_BODY_NOT_IMPLEMENT);
+}
+
+void http_response_append(http_response_t* resp, const char* data,
+                          size_t len) {
+    if (resp->len + len > sizeof(resp->buf)) {
+        resp->overflow = 1;
+        return;
+    }
+    memcpy(resp->buf + resp->len, data, len);
+    resp->len += len;
+}
+
+int http_status_code(enum http_status status) {
+    // "HTTP/1.1 " is followed by the code
+    return atoi(status_lines[status] + 9);
+}
+
+void http_response_begin(http_response_t* resp, enum http_status status) {
+    http_stats_status(status);
+    resp->len = 0;
+    resp->overflow = 0;
+    http_response_append(resp, status_heads[status].data,
+                         status_heads[status].len);
+}
+
+void http_response_header(http_response_t* resp, const char* name,
+                          const char* value) {
+    size_t nlen = strlen(name), vlen = strlen(value);
+    if (resp->len + nlen + vlen + 4 > sizeof(resp->buf)) {
+        resp->overflow = 1;
+        return;
+    }
+    char* p = resp->buf + resp->len;
+    memcpy(p, name, nlen);
+    p += nlen;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, value, vlen);
+    p += vlen;
+    *p++ = '\r';
+    *p++ = '\n';
+    resp->len = p - resp->buf;
+}
+
+void http_response_length(http_response_t* resp, off_t len) {
+    // digits are produced backwards at the end of a small buffer
+    char buf[48];
+    char* p = buf + sizeof(buf);
+    *--p = '\n';
+    *--p = '\r';
+    unsigned long long v = len > 0 ? (unsigned long long)len : 0;
+    http_stats_body(v);
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    p -= 16;
+    memcpy(p, "Content-Length: ", 16);
+    http_response_append(resp, p, buf + sizeof(buf) - p);
+}
+
+size_t http_date_format(time_t t, char* buf, size_t size) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+void http_validators_init(http_validators_t* v, const struct stat* st) {
+    // modification time in nanoseconds and size, as nginx does in seconds
+    unsigned long long ns =
+        (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+        st->st_mtim.tv_nsec;
+    snprintf(v->etag, sizeof(v->etag), "\"%llx-%llx\"", ns,
+             (unsigned long long)st->st_size);
+    http_date_format(st->st_mtime, v->last_modified, sizeof(v->last_modified));
+    v->mtime = st->st_mtime;
+}
 
-const char* get_content_type(char* extension) {
-    if (!strcmp(extension, "html") || !strcmp(extension, "htm") ||
-        !strcmp(extension, "htx"))
-        return "text/html";
+void http_response_validators(http_response_t* resp,
+                              const http_validators_t* v) {
+    http_response_header(resp, "ETag", v->etag);
+    http_response_header(resp, "Last-Modified", v->last_modified);
+}
+
+void http_response_end(http_response_t* resp, int alive) {
+    time_t now = time(NULL);
+    if (now != date_second) {
+        memcpy(date_line, "Date: ", 6);
+        date_len = 6 + http_date_format(now, date_line + 6,
+                                        sizeof(date_line) - 8);
+        memcpy(date_line + date_len, "\r\n", 2);
+        date_len += 2;
+        date_second = now;
+    }
+    http_response_append(resp, date_line, date_len);
+    if (alive)
+        http_response_append(resp, "Connection: keep-alive\r\n\r\n", 26);
     else
-        return "application/octet-stream";
+        http_response_append(resp, "Connection: close\r\n\r\n", 21);
 }
 
-void format_and_send_response(bfevent_t* client, const char* msg) {
-    char buf[MAX_BUFF_SIZE];
-    strcpy(buf, msg);
-    logger(DEBUG, "%s\\r\\n", msg);
-    strcat(buf, "\r\n");
-    bufferevent_write(client, buf, strlen(buf));
+int http_response_send(http_response_t* resp, bfevent_t* bev) {
+    if (resp->overflow) {
+        logger(ERROR, "response head exceeds %d bytes", HTTP_RESPONSE_HEAD_MAX);
+        return -1;
+    }
+    return bufferevent_write(bev, resp->buf, resp->len);
 }
 
-void http_ok(bfevent_t* client) {
+void http_ok(bfevent_t* client, size_t len, int alive) {
+    http_ok_content(client, len, "text/html", alive);
+}
+
+void http_ok_content(bfevent_t* client, size_t len, const char* type,
+                     int alive) {
+    http_response_t resp;
     logger(DEBUG, "sending `ok` response headers");
-    // send response back to client
-    format_and_send_response(client, "HTTP/1.1 200 OK");
-    format_and_send_response(client, SERVER_BASE_STR);
-    format_and_send_response(client, "Content-Type: text/html");
-    format_and_send_response(client, "");
+    http_response_begin(&resp, HTTP_STATUS_OK);
+    http_response_header(&resp, "Content-Type", type);
+    http_response_length(&resp, len);
+    http_response_end(&resp, alive);
+    http_response_send(&resp, client);
 }
 
-void http_ok_send_file(bfevent_t* client, int len, char* file_extension) {
-    // TODO: could use filename to determine file type
-    char buf[MAX_BUFF_SIZE];
+void http_ok_send_file(bfevent_t* client, off_t len, char* file_extension,
+                       const http_validators_t* v, int alive) {
+    http_response_t resp;
     logger(DEBUG, "sending response headers of sending file");
-    // send response back to client
-    format_and_send_response(client, "HTTP/1.1 200 OK");
-    format_and_send_response(client, SERVER_BASE_STR);
-    const char *type = get_content_type(file_extension);
-    sprintf(buf, "Content-Type: %s", type);
-    format_and_send_response(client, buf);
-    if (strcmp(type, "text/html")){
-        sprintf(buf, "Content-Length: %d", len);
-        format_and_send_response(client, buf);
+    http_response_begin(&resp, HTTP_STATUS_OK);
+    const char* type = get_content_type(file_extension);
+    http_response_header(&resp, "Content-Type", type);
+    if (http_encoding_compressible(type))
+        http_response_append(&resp, "Vary: Accept-Encoding\r\n", 23);
+    http_response_append(&resp, "Accept-Ranges: bytes\r\n", 22);
+    http_response_validators(&resp, v);
+    http_response_length(&resp, len);
+    http_response_end(&resp, alive);
+    http_response_send(&resp, client);
+}
+
+void http_stored(bfevent_t* client, enum http_status status, int alive) {
+    http_response_t resp;
+    logger(DEBUG, "sending `stored` response headers");
+    http_response_begin(&resp, status);
+    // 204 never has a body, so no length either
+    if (status != HTTP_STATUS_NO_CONTENT)
+        http_response_length(&resp, 0);
+    http_response_end(&resp, alive);
+    http_response_send(&resp, client);
+}
+
+void http_accepted_range(bfevent_t* client, off_t received, int alive) {
+    http_response_t resp;
+    char range[64];
+    logger(DEBUG, "sending `accepted` response headers");
+    http_response_begin(&resp, HTTP_STATUS_ACCEPTED);
+    if (received > 0) {
+        snprintf(range, sizeof(range), "bytes=0-%lld",
+                 (long long)received - 1);
+        http_response_header(&resp, "Range", range);
     }
-    format_and_send_response(client, "");
+    http_response_length(&resp, 0);
+    http_response_end(&resp, alive);
+    http_response_send(&resp, client);
+}
+
+void http_not_modified(bfevent_t* client, const http_validators_t* v,
+                       int alive) {
+    http_response_t resp;
+    logger(DEBUG, "sending `not modified` response headers");
+    http_response_begin(&resp, HTTP_STATUS_NOT_MODIFIED);
+    http_response_validators(&resp, v);
+    http_response_end(&resp, alive);
+    http_response_send(&resp, client);
+}
+
+// send a canned error page, its length frames the response on kept-alive
+// connections. extra holds more header lines, or is NULL
+static void send_error(bfevent_t* client, enum http_status status,
+                       const char* extra, int alive, int head_only) {
+    http_response_t resp;
+    http_stats_status(status);
+    resp.len = 0;
+    resp.overflow = 0;
+    http_response_append(&resp, error_heads[status].data,
+                         error_heads[status].len);
+    if (extra != NULL)
+        http_response_append(&resp, extra, strlen(extra));
+    http_response_end(&resp, alive);
+    http_stats_body(error_pages[status].len);
+    if (!head_only)
+        http_response_append(&resp, error_pages[status].data,
+                             error_pages[status].len);
+    http_response_send(&resp, client);
 }
 
-void http_not_implemented(bfevent_t* client) {
+void http_error(bfevent_t* client, enum http_status status, int alive,
+                int head_only) {
+    logger(DEBUG, "sending `%d` response headers", http_status_code(status));
+    send_error(client, status, NULL, alive, head_only);
+}
+
+void http_not_implemented(bfevent_t* client, int alive) {
     logger(DEBUG, "sending `not implement` response");
-    // send response back to client
-    format_and_send_response(client, "HTTP/1.1 501 Method Not Implemented");
-    format_and_send_response(client, SERVER_BASE_STR);
-    format_and_send_response(client, "Content-Type: text/html");
-    format_and_send_response(client, "");
-    char buf[MAX_BUFF_SIZE];
-    sprintf(buf, HTML_RESPONSE_FMT, HTML_TITLE_NOT_IMPLEMENT,
-            HTML_BODY_NOT_IMPLEMENT);
-    format_and_send_response(client, buf);
-}
-
-void http_internal_server_error(bfevent_t* client) {
+    send_error(client, HTTP_STATUS_NOT_IMPLEMENT, NULL, alive, 0);
+}
+
+void http_internal_server_error(bfevent_t* client, int alive) {
     logger(DEBUG, "sending `internal server error` response headers");
-    // send response back to client
-    format_and_send_response(client, "HTTP/1.1 500 Internal Server Error");
-    format_and_send_response(client, SERVER_BASE_STR);
-    format_and_send_response(client, "Content-Type: text/html");
-    format_and_send_response(client, "");
-    char buf[MAX_BUFF_SIZE];
-    sprintf(buf, HTML_RESPONSE_FMT, HTML_TITLE_INTERNAL_ERR,
-            HTML_BODY_INTERNAL_ERR);
-    format_and_send_response(client, buf);
-}
-
-void http_not_found(bfevent_t* client) {
+    send_error(client, HTTP_STATUS_INTERNAL_ERR, NULL, alive, 0);
+}
+
+void http_not_found(bfevent_t* client, int alive) {
     logger(DEBUG, "sending `404 not found` response headers");
-    // send response back to client
-    format_and_send_response(client, "HTTP/1.1 404 NOT FOUND");
-    format_and_send_response(client, SERVER_BASE_STR);
-    format_and_send_response(client, "Content-Type: text/html");
-    format_and_send_response(client, "");
-    char buf[MAX_BUFF_SIZE];
-    sprintf(buf, HTML_RESPONSE_FMT, HTML_TITLE_NOT_FOUND, HTML_BODY_NOT_FOUND);
-    format_and_send_response(client, buf);
+    send_error(client, HTTP_STATUS_NOT_FOUND, NULL, alive, 0);
 }
 
-void http_forbidden(bfevent_t* client) {
+void http_forbidden(bfevent_t* client, int alive) {
     logger(DEBUG, "sending `forbidden` response headers");
-    // send response back to client
-    format_and_send_response(client, "HTTP/1.1 403 Forbidden");
-    format_and_send_response(client, SERVER_BASE_STR);
-    format_and_send_response(client, "Content-Type: text/html");
-    format_and_send_response(client, "");
-    char buf[MAX_BUFF_SIZE];
-    sprintf(buf, HTML_RESPONSE_FMT, HTML_TITLE_FORBIDDEN, HTML_BODY_FORBIDDEN);
-    format_and_send_response(client, buf);
+    send_error(client, HTTP_STATUS_FORBIDDEN, NULL, alive, 0);
 }
 
-void http_bad_request(bfevent_t* client) {
+void http_bad_request(bfevent_t* client, int alive) {
     logger(DEBUG, "sending `bad request` response headers");
-    // send response back to client
-    format_and_send_response(client, "HTTP/1.1 400 Bad Request");
-    format_and_send_response(client, SERVER_BASE_STR);
-    format_and_send_response(client, "Content-Type: text/html");
-    format_and_send_response(client, "");
-    char buf[MAX_BUFF_SIZE];
-    sprintf(buf, HTML_RESPONSE_FMT, HTML_TITLE_BAD_REQUEST,
-            HTML_BODY_BAD_REQUEST);
-    format_and_send_response(client, buf);
+    send_error(client, HTTP_STATUS_BAD_REQUEST, NULL, alive, 0);
+}
+
+void http_conflict(bfevent_t* client, int alive) {
+    logger(DEBUG, "sending `conflict` response headers");
+    send_error(client, HTTP_STATUS_CONFLICT, NULL, alive, 0);
+}
+
+void http_length_required(bfevent_t* client, int alive) {
+    logger(DEBUG, "sending `length required` response headers");
+    send_error(client, HTTP_STATUS_LENGTH_REQUIRED, NULL, alive, 0);
+}
+
+void http_request_timeout(bfevent_t* client) {
+    logger(DEBUG, "sending `request timeout` response headers");
+    send_error(client, HTTP_STATUS_REQUEST_TIMEOUT, NULL, 0, 0);
+}
+
+void http_range_not_satisfiable(bfevent_t* client, off_t size, int alive) {
+    char content_range[64];
+    logger(DEBUG, "sending `range not satisfiable` response headers");
+    snprintf(content_range, sizeof(content_range),
+             "Content-Range: bytes */%lld\r\n", (long long)size);
+    send_error(client, HTTP_STATUS_RANGE_NOT_SATISFIABLE, content_range, alive,
+               0);
 }
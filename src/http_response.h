@@ -1,6 +1,9 @@
 #ifndef __HTTP_RESPONSE_H__
 #define __HTTP_RESPONSE_H__
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
 // libevent
 #include <event.h>
 #include <event2/bufferevent.h>
@@ -23,6 +26,18 @@
 // 404 not found
 #define HTML_TITLE_NOT_FOUND "404 Not Found"
 #define HTML_BODY_NOT_FOUND "The file you specified is unavailable"
+// 408 request timeout
+#define HTML_TITLE_REQUEST_TIMEOUT "408 Request Timeout"
+#define HTML_BODY_REQUEST_TIMEOUT "The request took too long to arrive"
+// 409 conflict
+#define HTML_TITLE_CONFLICT "409 Conflict"
+#define HTML_BODY_CONFLICT "The target can't be written as a file"
+// 411 length required
+#define HTML_TITLE_LENGTH_REQUIRED "411 Length Required"
+#define HTML_BODY_LENGTH_REQUIRED "The request body needs a Content-Length"
+// 416 range not satisfiable
+#define HTML_TITLE_RANGE_NOT_SATISFIABLE "416 Range Not Satisfiable"
+#define HTML_BODY_RANGE_NOT_SATISFIABLE "The requested range is not available"
 // 500 internal server error
 #define HTML_TITLE_INTERNAL_ERR "500 Internal Server Error"
 #define HTML_BODY_INTERNAL_ERR "Internal Server Error"
@@ -30,9 +45,50 @@
 #define HTML_TITLE_NOT_IMPLEMENT "501 Method Not Implemented"
 #define HTML_BODY_NOT_IMPLEMENT "HTTP request method not supported"
 
+// room for an entity tag and an HTTP-date
+#define HTTP_ETAG_LEN 48
+#define HTTP_DATE_LEN 32
+// largest response head assembled by http_response_t
+#define HTTP_RESPONSE_HEAD_MAX (1 << 11)
+
 // typedef struct bufferevent as bfevent_t;
 typedef struct bufferevent bfevent_t;
 
+// statuses whose status line is prebuilt at startup
+enum http_status {
+    HTTP_STATUS_OK = 0,
+    HTTP_STATUS_CREATED,
+    HTTP_STATUS_ACCEPTED,
+    HTTP_STATUS_NO_CONTENT,
+    HTTP_STATUS_PARTIAL_CONTENT,
+    HTTP_STATUS_NOT_MODIFIED,
+    HTTP_STATUS_BAD_REQUEST,
+    HTTP_STATUS_FORBIDDEN,
+    HTTP_STATUS_NOT_FOUND,
+    HTTP_STATUS_REQUEST_TIMEOUT,
+    HTTP_STATUS_CONFLICT,
+    HTTP_STATUS_LENGTH_REQUIRED,
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE,
+    HTTP_STATUS_INTERNAL_ERR,
+    HTTP_STATUS_NOT_IMPLEMENT,
+    HTTP_STATUS_COUNT
+};
+
+// response head built in one buffer and queued with a single write
+typedef struct http_response_t {
+    char buf[HTTP_RESPONSE_HEAD_MAX];
+    size_t len;
+    // set when a header did not fit, the response is not sent
+    int overflow;
+} http_response_t;
+
+// validators of a file, derived from its stat data
+typedef struct http_validators_t {
+    char etag[HTTP_ETAG_LEN];
+    char last_modified[HTTP_DATE_LEN];
+    time_t mtime;
+} http_validators_t;
+
 static const struct table_entry {
 	const char *extension;
 	const char *content_type;
@@ -41,8 +97,13 @@ static const struct table_entry {
 	{ "c", "text/plain" },
 	{ "h", "text/plain" },
 	{ "html", "text/html" },
-	{ "htm", "text/htm" },
+	{ "htm", "text/html" },
+	{ "htx", "text/html" },
 	{ "css", "text/css" },
+	{ "js", "application/javascript" },
+	{ "json", "application/json" },
+	{ "xml", "application/xml" },
+	{ "svg", "image/svg+xml" },
 	{ "gif", "image/gif" },
 	{ "jpg", "image/jpeg" },
 	{ "jpeg", "image/jpeg" },
@@ -55,16 +116,61 @@ static const struct table_entry {
 /* 
     declarations of functions
  */
-void http_ok(bfevent_t* bev);
-void http_ok_send_file(bfevent_t* bev, int len, char *extension);
-void http_not_found(bfevent_t* bev);
+// build status lines and canned error responses, called once at startup
+void http_response_init(void);
+// start a response head with status line and server header
+void http_response_begin(http_response_t* resp, enum http_status status);
+// append raw header lines, each terminated by "\r\n"
+void http_response_append(http_response_t* resp, const char* data, size_t len);
+// append "name: value\r\n"
+void http_response_header(http_response_t* resp, const char* name,
+                          const char* value);
+// append Content-Length
+void http_response_length(http_response_t* resp, off_t len);
+// append Date, Connection and the blank line ending the head
+void http_response_end(http_response_t* resp, int alive);
+// queue the finished head on bev, -1 if it overflowed
+int http_response_send(http_response_t* resp, bfevent_t* bev);
+// numeric code of status, 200 for HTTP_STATUS_OK
+int http_status_code(enum http_status status);
+// format t as an HTTP-date, returns its length
+size_t http_date_format(time_t t, char* buf, size_t size);
+// derive ETag and Last-Modified of a file
+void http_validators_init(http_validators_t* v, const struct stat* st);
+// append ETag and Last-Modified
+void http_response_validators(http_response_t* resp,
+                              const http_validators_t* v);
+
+void http_ok(bfevent_t* bev, size_t len, int alive);
+void http_ok_content(bfevent_t* bev, size_t len, const char* type, int alive);
+void http_ok_send_file(bfevent_t* bev, off_t len, char *extension,
+                       const http_validators_t* v, int alive);
+// 304 carrying the validators of the unchanged file
+void http_not_modified(bfevent_t* bev, const http_validators_t* v, int alive);
+void http_not_found(bfevent_t* bev, int alive);
+// 416 for a representation of size bytes
+void http_range_not_satisfiable(bfevent_t* bev, off_t size, int alive);
 
-void http_not_implemented(bfevent_t* bev);
-void http_bad_request(bfevent_t* bev);
+void http_not_implemented(bfevent_t* bev, int alive);
+// 408, the request head didn't arrive in time
+void http_request_timeout(bfevent_t* bev);
+void http_bad_request(bfevent_t* bev, int alive);
+// 201 or 204, what status says, once a PUT has replaced its target
+void http_stored(bfevent_t* bev, enum http_status status, int alive);
+// 202, the first received bytes of a file PUT in pieces are stored
+void http_accepted_range(bfevent_t* bev, off_t received, int alive);
+// 409, a PUT target that is a directory or has no parent
+void http_conflict(bfevent_t* bev, int alive);
+// 411, a PUT without Content-Length
+void http_length_required(bfevent_t* bev, int alive);
 
-void http_forbidden(bfevent_t* bev);
-void http_internal_server_error(bfevent_t* bev);
+void http_forbidden(bfevent_t* bev, int alive);
+void http_internal_server_error(bfevent_t* bev, int alive);
+// canned error page of status, only its head when head_only is set, as
+// the answer of a HEAD request
+void http_error(bfevent_t* bev, enum http_status status, int alive,
+                int head_only);
 
-const char* get_content_type(char *extension);
+const char* get_content_type(const char *extension);
 
 #endif
\ No newline at end of file
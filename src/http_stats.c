@@ -0,0 +1,298 @@
+#include "http_stats.h"
+#include <inttypes.h>
+#include "logger.h"
+
+// counters of the calling thread, NULL on threads that don't serve clients
+static __thread http_stats_t* local;
+// a response is answered in one go, so this is the one of the request
+// that is ending
+static __thread enum http_status last_status;
+static __thread off_t last_body;
+
+static http_stats_t* threads[HTTP_STATS_MAX_THREADS];
+static int nthreads;
+
+// quantiles reported for the latency
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define QUANTILES ((int)(sizeof(quantiles) / sizeof(quantiles[0])))
+
+// only the owning thread writes, the atomic store keeps readers untorn
+#define STATS_ADD(field, n)                                      \
+    __atomic_store_n(&local->field, local->field + (n),          \
+                     __ATOMIC_RELAXED)
+#define STATS_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+int http_stats_thread_init(void) {
+    int id = __atomic_fetch_add(&nthreads, 1, __ATOMIC_RELAXED);
+    if (id >= HTTP_STATS_MAX_THREADS) {
+        logger(WARNING, "no room for the metrics of thread %d", id);
+        return -1;
+    }
+    http_stats_t* s = NULL;
+    if (posix_memalign((void**)&s, 64, sizeof(http_stats_t)) != 0)
+        return -1;
+    memset(s, 0, sizeof(http_stats_t));
+    __atomic_store_n(&threads[id], s, __ATOMIC_RELEASE);
+    local = s;
+    return 0;
+}
+
+uint64_t http_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void http_stats_accepted(void) {
+    if (local != NULL)
+        STATS_ADD(accepted, 1);
+}
+
+void http_stats_closed(void) {
+    if (local != NULL)
+        STATS_ADD(closed, 1);
+}
+
+void http_stats_contexts(uint64_t total) {
+    if (local != NULL)
+        __atomic_store_n(&local->contexts, total, __ATOMIC_RELAXED);
+}
+
+void http_stats_request(void) {
+    if (local != NULL)
+        STATS_ADD(requests, 1);
+}
+
+void http_stats_status(enum http_status status) {
+    last_status = status;
+    last_body = 0;
+    if (local != NULL)
+        STATS_ADD(responses[status], 1);
+}
+
+enum http_status http_stats_last_status(void) {
+    return last_status;
+}
+
+void http_stats_body(off_t len) {
+    last_body += len;
+}
+
+off_t http_stats_last_body(void) {
+    return last_body;
+}
+
+void http_stats_restore(enum http_status status, off_t body) {
+    last_status = status;
+    last_body = body;
+}
+
+// log-linear bucket of a latency: exact below 2 << HTTP_STATS_SUB_BITS,
+// then 1 << HTTP_STATS_SUB_BITS buckets per power of two
+static int bucket_of(uint64_t us) {
+    if (us >> HTTP_STATS_MAX_BITS)
+        us = (1ULL << HTTP_STATS_MAX_BITS) - 1;
+    if (us < (2U << HTTP_STATS_SUB_BITS))
+        return (int)us;
+    int shift = 63 - __builtin_clzll(us) - HTTP_STATS_SUB_BITS;
+    return (shift << HTTP_STATS_SUB_BITS) + (int)(us >> shift);
+}
+
+// largest latency counted in bucket i
+static uint64_t bucket_upper(int i) {
+    int shift = (i >> HTTP_STATS_SUB_BITS) - 1;
+    if (shift <= 0)
+        return i;
+    uint64_t m = (i & ((1 << HTTP_STATS_SUB_BITS) - 1)) |
+                 (1 << HTTP_STATS_SUB_BITS);
+    return ((m + 1) << shift) - 1;
+}
+
+void http_stats_latency(uint64_t us) {
+    if (local == NULL)
+        return;
+    STATS_ADD(latency[bucket_of(us)], 1);
+    STATS_ADD(latency_sum, us);
+    if (us > local->latency_max)
+        __atomic_store_n(&local->latency_max, us, __ATOMIC_RELAXED);
+}
+
+// the input gains what is read
+static void count_in_cb(struct evbuffer* buf,
+                        const struct evbuffer_cb_info* info, void* arg) {
+    (void)buf;
+    (void)arg;
+    if (local != NULL && info->n_added > 0)
+        STATS_ADD(bytes_in, info->n_added);
+}
+
+// the output loses what is written
+static void count_out_cb(struct evbuffer* buf,
+                         const struct evbuffer_cb_info* info, void* arg) {
+    (void)buf;
+    (void)arg;
+    if (local != NULL && info->n_deleted > 0)
+        STATS_ADD(bytes_out, info->n_deleted);
+}
+
+void http_stats_watch(http_conn_t* conn) {
+    evbuffer_add_cb(bufferevent_get_input(conn->bev), count_in_cb, conn);
+    evbuffer_add_cb(bufferevent_get_output(conn->bev), count_out_cb, conn);
+}
+
+// totals over every registered thread
+static void stats_sum(http_stats_t* sum) {
+    memset(sum, 0, sizeof(http_stats_t));
+    int n = __atomic_load_n(&nthreads, __ATOMIC_RELAXED);
+    for (int t = 0; t < n && t < HTTP_STATS_MAX_THREADS; t++) {
+        http_stats_t* s = __atomic_load_n(&threads[t], __ATOMIC_ACQUIRE);
+        if (s == NULL)
+            continue;
+        sum->accepted += STATS_LOAD(s->accepted);
+        sum->closed += STATS_LOAD(s->closed);
+        sum->contexts += STATS_LOAD(s->contexts);
+        sum->requests += STATS_LOAD(s->requests);
+        for (int i = 0; i < HTTP_STATUS_COUNT; i++)
+            sum->responses[i] += STATS_LOAD(s->responses[i]);
+        sum->bytes_in += STATS_LOAD(s->bytes_in);
+        sum->bytes_out += STATS_LOAD(s->bytes_out);
+        for (int i = 0; i < HTTP_STATS_BUCKETS; i++)
+            sum->latency[i] += STATS_LOAD(s->latency[i]);
+        sum->latency_sum += STATS_LOAD(s->latency_sum);
+        uint64_t max = STATS_LOAD(s->latency_max);
+        if (max > sum->latency_max)
+            sum->latency_max = max;
+    }
+}
+
+static uint64_t latency_count(const http_stats_t* sum) {
+    uint64_t count = 0;
+    for (int i = 0; i < HTTP_STATS_BUCKETS; i++)
+        count += sum->latency[i];
+    return count;
+}
+
+// upper bound of the bucket holding quantile q, in microseconds
+static uint64_t latency_quantile(const http_stats_t* sum, uint64_t count,
+                                 double q) {
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * count);
+    if (rank >= count)
+        rank = count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HTTP_STATS_BUCKETS; i++) {
+        seen += sum->latency[i];
+        if (seen > rank)
+            return bucket_upper(i) < sum->latency_max ? bucket_upper(i)
+                                                      : sum->latency_max;
+    }
+    return sum->latency_max;
+}
+
+static void render_prometheus(struct evbuffer* out, const http_stats_t* sum) {
+    uint64_t count = latency_count(sum);
+    evbuffer_add_printf(out,
+                        "# TYPE wuw_connections_accepted_total counter\n"
+                        "wuw_connections_accepted_total %" PRIu64 "\n"
+                        "# TYPE wuw_connections_open gauge\n"
+                        "wuw_connections_open %" PRIu64 "\n"
+                        "# TYPE wuw_connection_contexts gauge\n"
+                        "wuw_connection_contexts %" PRIu64 "\n"
+                        "# TYPE wuw_connection_context_bytes gauge\n"
+                        "wuw_connection_context_bytes %zu\n"
+                        "# TYPE wuw_requests_total counter\n"
+                        "wuw_requests_total %" PRIu64 "\n"
+                        "# TYPE wuw_received_bytes_total counter\n"
+                        "wuw_received_bytes_total %" PRIu64 "\n"
+                        "# TYPE wuw_sent_bytes_total counter\n"
+                        "wuw_sent_bytes_total %" PRIu64 "\n"
+                        "# TYPE wuw_responses_total counter\n",
+                        sum->accepted, sum->accepted - sum->closed,
+                        sum->contexts, sizeof(http_conn_t), sum->requests,
+                        sum->bytes_in, sum->bytes_out);
+    for (int i = 0; i < HTTP_STATUS_COUNT; i++)
+        evbuffer_add_printf(out, "wuw_responses_total{code=\"%d\"} %" PRIu64
+                                 "\n",
+                            http_status_code(i), sum->responses[i]);
+
+    // the fine buckets are summed into one per power of two
+    evbuffer_add_printf(out,
+                        "# TYPE wuw_request_duration_seconds histogram\n");
+    uint64_t cumulative = 0;
+    int i = 0;
+    for (int bits = HTTP_STATS_SUB_BITS + 1; bits <= HTTP_STATS_MAX_BITS;
+         bits++) {
+        while (i < HTTP_STATS_BUCKETS && bucket_upper(i) < (1ULL << bits))
+            cumulative += sum->latency[i++];
+        evbuffer_add_printf(out,
+                            "wuw_request_duration_seconds_bucket{le=\"%g\"} "
+                            "%" PRIu64 "\n",
+                            (double)(1ULL << bits) / 1e6, cumulative);
+    }
+    evbuffer_add_printf(out,
+                        "wuw_request_duration_seconds_bucket{le=\"+Inf\"} "
+                        "%" PRIu64 "\n"
+                        "wuw_request_duration_seconds_sum %.6f\n"
+                        "wuw_request_duration_seconds_count %" PRIu64 "\n"
+                        "# TYPE wuw_request_duration_quantile_seconds gauge\n",
+                        count, (double)sum->latency_sum / 1e6, count);
+    for (int q = 0; q < QUANTILES; q++)
+        evbuffer_add_printf(out,
+                            "wuw_request_duration_quantile_seconds"
+                            "{quantile=\"%g\"} %.6f\n",
+                            quantiles[q],
+                            latency_quantile(sum, count, quantiles[q]) / 1e6);
+}
+
+static void render_json(struct evbuffer* out, const http_stats_t* sum) {
+    uint64_t count = latency_count(sum);
+    evbuffer_add_printf(out,
+                        "{\"connections\":{\"accepted\":%" PRIu64
+                        ",\"open\":%" PRIu64 ",\"contexts\":%" PRIu64
+                        ",\"context_bytes\":%zu},\"requests\":%" PRIu64
+                        ",\"bytes\":{\"received\":%" PRIu64 ",\"sent\":%" PRIu64
+                        "},\"responses\":{",
+                        sum->accepted, sum->accepted - sum->closed,
+                        sum->contexts, sizeof(http_conn_t), sum->requests,
+                        sum->bytes_in, sum->bytes_out);
+    for (int i = 0; i < HTTP_STATUS_COUNT; i++)
+        evbuffer_add_printf(out, "%s\"%d\":%" PRIu64, i ? "," : "",
+                            http_status_code(i), sum->responses[i]);
+    evbuffer_add_printf(out,
+                        "},\"latency_us\":{\"count\":%" PRIu64
+                        ",\"mean\":%" PRIu64 ",\"max\":%" PRIu64,
+                        count, count ? sum->latency_sum / count : 0,
+                        sum->latency_max);
+    for (int q = 0; q < QUANTILES; q++)
+        evbuffer_add_printf(out, ",\"p%g\":%" PRIu64, quantiles[q] * 100,
+                            latency_quantile(sum, count, quantiles[q]));
+    evbuffer_add(out, "}}\n", 3);
+}
+
+void http_stats_send(http_conn_t* conn) {
+    http_stats_t* sum = (http_stats_t*)malloc(sizeof(http_stats_t));
+    struct evbuffer* body = evbuffer_new();
+    if (sum == NULL || body == NULL) {
+        free(sum);
+        if (body != NULL)
+            evbuffer_free(body);
+        http_conn_error(conn, HTTP_STATUS_INTERNAL_ERR);
+        return;
+    }
+    stats_sum(sum);
+    int json = (strstr(conn->hdr.query, "format=json") != NULL);
+    if (json)
+        render_json(body, sum);
+    else
+        render_prometheus(body, sum);
+    free(sum);
+    http_ok_content(conn->bev, evbuffer_get_length(body),
+                    json ? "application/json"
+                         : "text/plain; version=0.0.4",
+                    conn->hdr.alive);
+    // the body is rendered for its length only
+    if (conn->hdr.mode != HEAD)
+        bufferevent_write_buffer(conn->bev, body);
+    evbuffer_free(body);
+}
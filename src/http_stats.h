@@ -0,0 +1,70 @@
+#ifndef __HTTP_STATS_H__
+#define __HTTP_STATS_H__
+
+#include <stdint.h>
+#include "http_functions.h"
+
+// path answered with the server metrics
+#define HTTP_STATS_PATH "/__stats"
+// threads that can record metrics, workers register at startup
+#define HTTP_STATS_MAX_THREADS 256
+// latency buckets per power of two, as 1 << HTTP_STATS_SUB_BITS
+#define HTTP_STATS_SUB_BITS 3
+// latencies are recorded in microseconds, up to 2^31 of them
+#define HTTP_STATS_MAX_BITS 31
+#define HTTP_STATS_BUCKETS \
+    ((HTTP_STATS_MAX_BITS - HTTP_STATS_SUB_BITS + 1) << HTTP_STATS_SUB_BITS)
+
+// counters of one worker thread. Only their thread writes them, others
+// read them with relaxed loads to build the totals
+typedef struct http_stats_t {
+    uint64_t accepted;
+    uint64_t closed;
+    // connection contexts pooled by the thread, in use or free
+    uint64_t contexts;
+    uint64_t requests;
+    uint64_t responses[HTTP_STATUS_COUNT];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    // request latency, from the parsed head to the queued response
+    uint64_t latency[HTTP_STATS_BUCKETS];
+    uint64_t latency_sum;
+    uint64_t latency_max;
+} __attribute__((aligned(64))) http_stats_t;
+
+/*
+    function declarations
+ */
+// give the calling thread counters of its own, before it serves anything
+int http_stats_thread_init(void);
+// microseconds of a monotonic clock
+uint64_t http_stats_now(void);
+// count an accepted and a closed connection
+void http_stats_accepted(void);
+void http_stats_closed(void);
+// the pool of connection contexts of this thread grew to total
+void http_stats_contexts(uint64_t total);
+// count the start of a request
+void http_stats_request(void);
+// record the latency of a request in microseconds
+void http_stats_latency(uint64_t us);
+// count a response by status
+void http_stats_status(enum http_status status);
+// status of the last response built on this thread
+enum http_status http_stats_last_status(void);
+// add len to the body size of the response being built, each response
+// starts at 0 with http_stats_status
+void http_stats_body(off_t len);
+// body size of the last response built on this thread, the length of what a
+// GET would get for the answer of a HEAD
+off_t http_stats_last_body(void);
+// make status and body size those of the last response again, without
+// counting it, for a response that ended after others were built
+void http_stats_restore(enum http_status status, off_t body);
+// count bytes read from and written to the client of conn
+void http_stats_watch(http_conn_t* conn);
+// answer a request of HTTP_STATS_PATH, `?format=json` selects json over
+// the prometheus text format
+void http_stats_send(http_conn_t* conn);
+
+#endif
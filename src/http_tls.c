@@ -0,0 +1,117 @@
+#include "http_tls.h"
+#include "http_ratelimit.h"
+#include "http_stats.h"
+#include "logger.h"
+
+static SSL_CTX* tls_ctx;
+// move kTLS connections off openssl, see http_tls_established
+static int tls_handoff;
+
+void http_tls_log_errors(void) {
+    unsigned long err;
+    char buf[256];
+    while ((err = ERR_get_error()) != 0) {
+        ERR_error_string_n(err, buf, sizeof(buf));
+        logger(INFO, "tls: %s", buf);
+    }
+}
+
+int http_tls_init(int handoff) {
+    tls_handoff = handoff;
+    if ((tls_ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+        http_tls_log_errors();
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    // kernel TLS encrypts what openssl writes once the handshake is done,
+    // and with the handoff lets files go out with sendfile(2). The rest are
+    // the usual hardening options
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS |
+                                     SSL_OP_CIPHER_SERVER_PREFERENCE |
+                                     SSL_OP_NO_RENEGOTIATION);
+    // idle connections give their read and write buffers back
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, SERVER_CRT) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, SERVER_KEY, SSL_FILETYPE_PEM) <= 0 ||
+        !SSL_CTX_check_private_key(tls_ctx)) {
+        logger(ERROR, "failed to load %s and %s", SERVER_CRT, SERVER_KEY);
+        http_tls_log_errors();
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return -1;
+    }
+    // reconnects resume from the shared session cache (TLS 1.2 session ids)
+    // or from a ticket, and skip the full handshake
+    static const unsigned char sid_ctx[] = "wuw";
+    SSL_CTX_set_session_id_context(tls_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(tls_ctx, HTTP_TLS_SESSION_CACHE);
+    SSL_CTX_set_timeout(tls_ctx, HTTP_TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_num_tickets(tls_ctx, HTTP_TLS_TICKETS);
+    return 0;
+}
+
+bfevent_t* http_tls_bufferevent(struct event_base* base, evutil_socket_t fd) {
+    SSL* ssl = SSL_new(tls_ctx);
+    if (ssl == NULL) {
+        http_tls_log_errors();
+        return NULL;
+    }
+    bfevent_t* bev = bufferevent_openssl_socket_new(
+        base, fd, ssl, BUFFEREVENT_SSL_ACCEPTING,
+        BEV_OPT_CLOSE_ON_FREE | http_ratelimit_options());
+    if (bev == NULL) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    // clients often close without close_notify, treat it as a plain EOF
+    bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+    return bev;
+}
+
+void http_tls_established(http_conn_t* conn) {
+    SSL* ssl = bufferevent_openssl_get_ssl(conn->bev);
+    logger(DEBUG, "tls %s %s%s", SSL_get_version(ssl),
+           SSL_get_cipher_name(ssl), SSL_session_reused(ssl) ? " resumed" : "");
+    // records openssl has already read would be lost with it
+    if (!tls_handoff || !BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+        !BIO_get_ktls_recv(SSL_get_rbio(ssl)) || SSL_has_pending(ssl) ||
+        evbuffer_get_length(bufferevent_get_output(conn->bev)) > 0)
+        return;
+
+    // the socket now carries plaintext for us, drive it directly so files
+    // are sent with sendfile(2). The duplicate keeps the socket open when
+    // the openssl bufferevent closes its descriptor
+    evutil_socket_t fd = dup(bufferevent_getfd(conn->bev));
+    if (fd < 0)
+        return;
+    bfevent_t* bev = bufferevent_socket_new(
+        conn->base, fd, BEV_OPT_CLOSE_ON_FREE | http_ratelimit_options());
+    if (bev == NULL) {
+        close(fd);
+        return;
+    }
+    bufferevent_data_cb readcb, writecb;
+    bufferevent_event_cb eventcb;
+    void* arg;
+    bufferevent_getcb(conn->bev, &readcb, &writecb, &eventcb, &arg);
+    // decrypted input that is already buffered moves along, only the
+    // bufferevent may append to its input so it is unfrozen meanwhile
+    struct evbuffer* input = bufferevent_get_input(bev);
+    evbuffer_unfreeze(input, 0);
+    evbuffer_add_buffer(input, bufferevent_get_input(conn->bev));
+    evbuffer_freeze(input, 0);
+    // the old one would leave its rate limit group only once finalized
+    bufferevent_remove_from_rate_limit_group(conn->bev);
+    bufferevent_free(conn->bev);
+    conn->bev = bev;
+    conn->tls = 0;
+    bufferevent_setcb(bev, readcb, writecb, eventcb, arg);
+    http_stats_watch(conn);
+    http_conn_timeouts(conn);
+    http_ratelimit_apply(conn);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    logger(DEBUG, "tls record layer offloaded to the kernel");
+    if (evbuffer_get_length(bufferevent_get_input(bev)) > 0)
+        readcb(bev, arg);
+}
@@ -0,0 +1,31 @@
+#ifndef __HTTP_TLS_H__
+#define __HTTP_TLS_H__
+
+#include <event2/bufferevent_ssl.h>
+#include "http_functions.h"
+
+// sessions kept in the server side session cache
+#define HTTP_TLS_SESSION_CACHE (1 << 14)
+// seconds a session can be resumed, from the cache or from a ticket
+#define HTTP_TLS_SESSION_TIMEOUT 3600
+// TLS 1.3 tickets issued per full handshake
+#define HTTP_TLS_TICKETS 2
+
+/*
+    function declarations
+ */
+// create the context shared by all workers from SERVER_CRT and SERVER_KEY.
+// handoff enables what http_tls_established does with kTLS connections
+int http_tls_init(int handoff);
+// bufferevent running the server side handshake on an accepted socket
+bfevent_t* http_tls_bufferevent(struct event_base* base, evutil_socket_t fd);
+// after the handshake, move the connection to a plain socket bufferevent
+// when the kernel took over both directions of the record layer and the
+// handoff is enabled. A plain read(2) fails with EIO on a control record
+// (alert, key update, ticket), so this is off unless asked for; otherwise
+// openssl keeps driving the socket, still with kernel TLS when it has it
+void http_tls_established(http_conn_t* conn);
+// log and clear the errors queued by openssl
+void http_tls_log_errors(void);
+
+#endif
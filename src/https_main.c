@@ -1,55 +1,296 @@
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include "http_aio.h"
+#include "http_bundle.h"
+#include "http_cache.h"
+#include "http_config.h"
 #include "http_functions.h"
+#include "http_put.h"
+#include "http_ratelimit.h"
+#include "http_stats.h"
+#include "http_tls.h"
 #include "logger.h"
+#include <netinet/tcp.h>
+
+// connections taken per wakeup of a listener, so a burst can't starve the
+// clients already connected
+#define ACCEPT_BATCH 64
+// pause of the listeners of a worker at the connection limit or out of
+// descriptors, the backlog holds new clients meanwhile
+#define ACCEPT_PAUSE_MSEC 100
+
+// one event loop with its own listening sockets
+typedef struct http_worker_t {
+    int id;
+    pthread_t thread;
+    evutil_socket_t fd;
+    struct event_base* base;
+    struct event* listener;
+    // HTTPS listener, -1 and NULL when disabled
+    evutil_socket_t tls_fd;
+    struct event* tls_listener;
+    // adds the listeners back after a pause
+    struct event* resume;
+    int accept_paused;
+    // the connection limit was hit and reported, until a client is accepted
+    int limited;
+} http_worker_t;
 
 void event_cb(struct bufferevent* bev, short event, void* arg);
 void accept_cb(int fd, short events, void* arg);
+void accept_tls_cb(int fd, short events, void* arg);
+
+// create socket, with SO_REUSEPORT the kernel spreads connections over the
+// listeners of all workers
+static struct event* worker_listen(http_worker_t* worker, int port,
+                                   int reuse_port, evutil_socket_t* fd,
+                                   event_callback_fn cb) {
+    if ((*fd = http_init(port, reuse_port, server_config.backlog)) < 0)
+        return NULL;
+    // create an event for accepting connections and add it to the base
+    struct event* listener =
+        event_new(worker->base, *fd, EV_READ | EV_PERSIST, cb, worker);
+    if (listener == NULL || event_add(listener, NULL) < 0) {
+        logger(ERROR, "failed to add listener of worker %d", worker->id);
+        return NULL;
+    }
+    return listener;
+}
 
-int main() {
-    // create socket
-    evutil_socket_t httpd = http_init();
-    logger(INFO, "HTTP server is running on localhost:%d", SERVER_PORT);
+static void resume_cb(evutil_socket_t fd, short events, void* arg) {
+    (void)fd;
+    (void)events;
+    http_worker_t* worker = (http_worker_t*)arg;
+    worker->accept_paused = 0;
+    event_add(worker->listener, NULL);
+    if (worker->tls_listener != NULL)
+        event_add(worker->tls_listener, NULL);
+}
+
+// stop accepting for ACCEPT_PAUSE_MSEC
+static void worker_pause(http_worker_t* worker) {
+    if (worker->accept_paused)
+        return;
+    struct timeval delay = {0, ACCEPT_PAUSE_MSEC * 1000};
+    worker->accept_paused = 1;
+    event_del(worker->listener);
+    if (worker->tls_listener != NULL)
+        event_del(worker->tls_listener);
+    evtimer_add(worker->resume, &delay);
+}
 
+static int worker_init(http_worker_t* worker, int id, int reuse_port) {
+    worker->id = id;
+    worker->tls_fd = -1;
     // create a base event
-    struct event_base* base = event_base_new();
+    if ((worker->base = event_base_new()) == NULL ||
+        (worker->resume = evtimer_new(worker->base, resume_cb, worker)) ==
+            NULL) {
+        logger(ERROR, "failed to create event base");
+        return -1;
+    }
+    if ((worker->listener = worker_listen(worker, SERVER_PORT, reuse_port,
+                                          &worker->fd, accept_cb)) == NULL)
+        return -1;
+    if (server_config.tls_port > 0 &&
+        (worker->tls_listener =
+             worker_listen(worker, server_config.tls_port, reuse_port,
+                           &worker->tls_fd, accept_tls_cb)) == NULL)
+        return -1;
+    return 0;
+}
 
-    // create an event for accepting connections
-    struct event* listener =
-        event_new(base, httpd, EV_READ | EV_PERSIST, accept_cb, base);
-    // add listener to the base
-    event_add(listener, NULL);
+static void worker_pin(http_worker_t* worker) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker->id % cpus, &set);
+    if (pthread_setaffinity_np(worker->thread, sizeof(set), &set) != 0)
+        logger(WARNING, "failed to pin worker %d", worker->id);
+}
+
+static void* worker_run(void* arg) {
+    http_worker_t* worker = (http_worker_t*)arg;
+    logger(DEBUG, "worker %d started", worker->id);
+    http_stats_thread_init();
+    event_base_dispatch(worker->base);
+    return NULL;
+}
 
-    event_base_dispatch(base);
+int main(int argc, char** argv) {
+    // records are written by a thread of their own from here on
+    log_init();
+    if (http_config_parse(argc, argv) < 0)
+        return 1;
+    // a client that resets its connection fails the write, not the server
+    signal(SIGPIPE, SIG_IGN);
+    if (server_config.access_log != NULL &&
+        log_open_access(server_config.access_log) < 0) {
+        logger(ERROR, "failed to open access log %s: %s",
+               server_config.access_log, strerror(errno));
+        return 1;
+    }
+
+    // canned responses, the content cache and the threads doing disk i/o
+    // are shared by all workers
+    http_response_init();
+    http_cache_init(server_config.cache_size);
+    http_open_cache_init(server_config.open_files);
+    if (server_config.bundle != NULL &&
+        http_bundle_open(server_config.bundle) < 0)
+        return 1;
+    http_put_init(server_config.fsync);
+    http_conn_init(server_config.idle_timeout, server_config.header_timeout,
+                   server_config.body_timeout);
+    if (http_aio_init(server_config.io_threads) < 0)
+        return 1;
+    if (server_config.tls_port > 0 && http_tls_init(server_config.ktls_handoff) < 0)
+        return 1;
+
+    int n = server_config.workers;
+    http_worker_t* workers = (http_worker_t*)calloc(n, sizeof(http_worker_t));
+    if (workers == NULL) {
+        logger(ERROR, "failed to allocate workers");
+        return 1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (worker_init(&workers[i], i, n > 1) < 0)
+            return 1;
+    }
+    // groups spanning all workers keep their timers on the first one
+    if (http_ratelimit_init(workers[0].base, n, server_config.download_limit,
+                            server_config.upload_limit) < 0) {
+        logger(ERROR, "failed to set up rate limits");
+        return 1;
+    }
+    logger(INFO, "HTTP server is running on localhost:%d with %d worker(s)",
+           SERVER_PORT, n);
+    if (server_config.tls_port > 0)
+        logger(INFO, "HTTPS server is running on localhost:%d",
+               server_config.tls_port);
+
+    // worker 0 runs on the main thread
+    workers[0].thread = pthread_self();
+    for (int i = 1; i < n; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run,
+                           &workers[i]) != 0) {
+            logger(ERROR, "failed to start worker %d", i);
+            return 1;
+        }
+    }
+    if (server_config.pin_cpus) {
+        for (int i = 0; i < n; i++)
+            worker_pin(&workers[i]);
+    }
+    worker_run(&workers[0]);
+    for (int i = 1; i < n; i++)
+        pthread_join(workers[i].thread, NULL);
     // event_base_free(base);
     return 0;
 }
 
 void event_cb(struct bufferevent* bev, short event, void* arg) {
-    if (event & BEV_EVENT_EOF) {
+    (void)bev;
+    http_conn_t* conn = (http_conn_t*)arg;
+    if (event & BEV_EVENT_CONNECTED) {
+        // tls handshake completed
+        http_tls_established(conn);
+        return;
+    }
+    if (event & BEV_EVENT_TIMEOUT) {
+        http_conn_timeout(conn, event);
+        return;
+    }
+    if ((event & BEV_EVENT_EOF) && !(event & BEV_EVENT_ERROR)) {
         logger(INFO, "connection closed");
+        // still answer requests that arrived before the client shut down
+        http_conn_eof(conn);
+        return;
     } else if (event & BEV_EVENT_ERROR) {
         logger(INFO, "some other error");
+        if (conn->tls)
+            http_tls_log_errors();
     }
-    bufferevent_free(bev);
+    http_conn_free(conn);
 }
 
-void accept_cb(int fd, short events, void* arg) {
-    struct sockaddr_in client;
-    socklen_t len = sizeof(client);
+// serve an accepted client, over tls when tls is set
+static void accept_client(struct event_base* base, evutil_socket_t sockfd,
+                          const struct sockaddr_in* client, int tls) {
+    logger(INFO, "Accept a client: %d%s", sockfd, tls ? " (tls)" : "");
+    // responses are written whole, nagle would only hold back their tails
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-    evutil_socket_t sockfd;
-    if ((sockfd = accept(fd, (struct sockaddr*)&client, &len)) < 0) {
-        logger(ERROR, "accept() failed");
+    struct bufferevent* bev =
+        tls ? http_tls_bufferevent(base, sockfd)
+            : bufferevent_socket_new(base, sockfd, BEV_OPT_CLOSE_ON_FREE |
+                                                       http_ratelimit_options());
+    if (bev == NULL) {
+        logger(ERROR, "failed to create bufferevent");
+        close(sockfd);
         return;
     }
-    evutil_make_socket_nonblocking(sockfd);
+    http_conn_t* conn = http_conn_new(base, bev);
+    if (conn == NULL) {
+        logger(ERROR, "failed to allocate connection context");
+        bufferevent_free(bev);
+        return;
+    }
+    conn->tls = tls;
+    conn->peer = *client;
+    http_ratelimit_join(conn);
+    http_stats_accepted();
+    http_stats_watch(conn);
+    bufferevent_setcb(bev, do_accept_cb, do_write_cb, event_cb, conn);
 
-    logger(INFO, "Accept a client: %d", sockfd);
+    bufferevent_enable(bev, EV_READ | EV_PERSIST | EV_WRITE);
+}
 
-    struct event_base* base = (struct event_base*)arg;
+// drain the accept queue of listener fd, up to ACCEPT_BATCH clients
+static void accept_clients(http_worker_t* worker, evutil_socket_t fd,
+                           int tls) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        if (server_config.max_conns > 0 &&
+            http_conn_count() >= server_config.max_conns) {
+            if (!worker->limited)
+                logger(WARNING, "%d connections open, accepting paused",
+                       server_config.max_conns);
+            worker->limited = 1;
+            worker_pause(worker);
+            return;
+        }
+        struct sockaddr_in client;
+        socklen_t len = sizeof(client);
+        evutil_socket_t sockfd = accept4(fd, (struct sockaddr*)&client, &len,
+                                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sockfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            // the client went away while queued
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            logger(ERROR, "accept() failed: %s", strerror(errno));
+            // out of descriptors or memory, retrying at once would spin
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+                errno == ENOMEM)
+                worker_pause(worker);
+            return;
+        }
+        worker->limited = 0;
+        accept_client(worker->base, sockfd, &client, tls);
+    }
+}
 
-    struct bufferevent* bev =
-        bufferevent_socket_new(base, sockfd, BEV_OPT_CLOSE_ON_FREE);
-    bufferevent_setcb(bev, do_accept_cb, NULL, event_cb, arg);
+void accept_cb(int fd, short events, void* arg) {
+    (void)events;
+    accept_clients((http_worker_t*)arg, fd, 0);
+}
 
-    bufferevent_enable(bev, EV_READ | EV_PERSIST | EV_WRITE);
-}
\ No newline at end of file
+void accept_tls_cb(int fd, short events, void* arg) {
+    (void)events;
+    accept_clients((http_worker_t*)arg, fd, 1);
+}
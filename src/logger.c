@@ -0,0 +1,236 @@
+#include "logger.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char* log_level_str[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+
+// one queued record. seq tells producers and the consumer whose turn it is,
+// as in Vyukov's bounded queue
+typedef struct log_cell_t {
+    size_t seq;
+    unsigned short len;
+    unsigned char sink;
+    char data[LOG_RECORD_LEN];
+} log_cell_t;
+
+static log_cell_t ring[LOG_RING_SLOTS];
+// next cell to fill, shared by the producers
+static size_t ring_head __attribute__((aligned(64)));
+// next cell to write out, owned by whoever holds drain_lock
+static size_t ring_tail __attribute__((aligned(64)));
+static int ring_ready;
+static uint64_t ring_dropped;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+// set while the log thread sleeps on an empty ring, the futex it waits on
+static int drain_idle __attribute__((aligned(64)));
+
+static int sink_fds[LOG_SINK_COUNT] = {STDOUT_FILENO, STDERR_FILENO, -1};
+// records gathered per sink before they are written
+static char batch[LOG_SINK_COUNT][LOG_BATCH_LEN];
+static size_t batch_len[LOG_SINK_COUNT];
+
+static void write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        data += n;
+        len -= n;
+    }
+}
+
+static void batch_flush(void) {
+    for (int i = 0; i < LOG_SINK_COUNT; i++) {
+        if (batch_len[i] > 0 && sink_fds[i] >= 0)
+            write_all(sink_fds[i], batch[i], batch_len[i]);
+        batch_len[i] = 0;
+    }
+}
+
+static void batch_add(int sink, const char* data, size_t len) {
+    if (batch_len[sink] + len > LOG_BATCH_LEN)
+        batch_flush();
+    memcpy(batch[sink] + batch_len[sink], data, len);
+    batch_len[sink] += len;
+}
+
+// write out every published record, returns how many there were
+static size_t ring_drain(void) {
+    size_t n = 0;
+    pthread_mutex_lock(&drain_lock);
+    for (;;) {
+        log_cell_t* cell = &ring[ring_tail & (LOG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+            break;
+        batch_add(cell->sink, cell->data, cell->len);
+        // hand the cell back to the producers of the next lap
+        __atomic_store_n(&cell->seq, ring_tail + LOG_RING_SLOTS,
+                         __ATOMIC_RELEASE);
+        ring_tail++;
+        n++;
+    }
+    uint64_t dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        char line[64];
+        int len = snprintf(line, sizeof(line),
+                           "WARNING: %llu log records dropped\n",
+                           (unsigned long long)dropped);
+        batch_add(LOG_SINK_STDERR, line, len);
+    }
+    batch_flush();
+    pthread_mutex_unlock(&drain_lock);
+    return n;
+}
+
+// whether the next record to write out is published
+static int ring_pending(void) {
+    pthread_mutex_lock(&drain_lock);
+    log_cell_t* cell = &ring[ring_tail & (LOG_RING_SLOTS - 1)];
+    int pending = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == ring_tail + 1;
+    pthread_mutex_unlock(&drain_lock);
+    return pending;
+}
+
+static void* log_run(void* arg) {
+    (void)arg;
+    for (;;) {
+        if (ring_drain() > 0)
+            continue;
+        // announce the sleep before looking at the ring again, a record
+        // published in between either is seen here or wakes the futex
+        __atomic_store_n(&drain_idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!ring_pending())
+            syscall(SYS_futex, &drain_idle, FUTEX_WAIT_PRIVATE, 1, NULL, NULL,
+                    0);
+        __atomic_store_n(&drain_idle, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void log_exit(void) {
+    ring_drain();
+}
+
+int log_init(void) {
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++)
+        ring[i].seq = i;
+    __atomic_store_n(&ring_ready, 1, __ATOMIC_RELEASE);
+    // what is still queued when the process exits is written out then
+    atexit(log_exit);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_run, NULL) != 0) {
+        fprintf(stderr, "failed to start the log thread\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int log_open_access(const char* path) {
+    int fd = strcmp(path, "-")
+                 ? open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)
+                 : STDOUT_FILENO;
+    if (fd < 0)
+        return -1;
+    sink_fds[LOG_SINK_ACCESS] = fd;
+    return 0;
+}
+
+int log_access_enabled(void) {
+    return sink_fds[LOG_SINK_ACCESS] >= 0;
+}
+
+// claim a free cell, NULL when the ring is full. *pos is its position
+static log_cell_t* ring_claim(size_t* pos) {
+    size_t p = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    for (;;) {
+        log_cell_t* cell = &ring[p & (LOG_RING_SLOTS - 1)];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)p;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring_head, &p, p + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                *pos = p;
+                return cell;
+            }
+        } else if (dif < 0) {
+            // the log thread is a whole lap behind, never wait for it
+            __atomic_add_fetch(&ring_dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            p = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void ring_publish(log_cell_t* cell, size_t pos) {
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    // only the first record after the ring ran empty pays for the wakeup,
+    // the rest are batched with it
+    if (__atomic_load_n(&drain_idle, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&drain_idle, 0, __ATOMIC_RELAXED))
+        syscall(SYS_futex, &drain_idle, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void log_write(enum log_level level, const char* file, int line,
+               const char* fmt, ...) {
+    int sink = level == ERROR ? LOG_SINK_STDERR : LOG_SINK_STDOUT;
+    char local[LOG_RECORD_LEN];
+    log_cell_t* cell = NULL;
+    size_t pos = 0;
+    if (__atomic_load_n(&ring_ready, __ATOMIC_ACQUIRE) &&
+        (cell = ring_claim(&pos)) == NULL)
+        return;
+    // the record is formatted straight into its cell
+    char* buf = cell != NULL ? cell->data : local;
+    int n = snprintf(buf, LOG_RECORD_LEN, "[%s:%d] %s: ", file, line,
+                     log_level_str[level]);
+    if (n < 0)
+        n = 0;
+    if (n < LOG_RECORD_LEN) {
+        va_list ap;
+        va_start(ap, fmt);
+        int m = vsnprintf(buf + n, LOG_RECORD_LEN - n, fmt, ap);
+        va_end(ap);
+        if (m > 0)
+            n += m;
+    }
+    if (n > LOG_RECORD_LEN - 1)
+        n = LOG_RECORD_LEN - 1;
+    buf[n++] = '\n';
+    if (cell == NULL) {
+        // before log_init there is no thread to hand records to
+        write_all(sink_fds[sink], buf, n);
+        return;
+    }
+    cell->len = n;
+    cell->sink = sink;
+    ring_publish(cell, pos);
+}
+
+void log_access(const char* line, size_t len) {
+    size_t pos = 0;
+    log_cell_t* cell = NULL;
+    if (!__atomic_load_n(&ring_ready, __ATOMIC_ACQUIRE) ||
+        (cell = ring_claim(&pos)) == NULL)
+        return;
+    if (len > LOG_RECORD_LEN)
+        len = LOG_RECORD_LEN;
+    memcpy(cell->data, line, len);
+    // a truncated line still ends the record
+    cell->data[len - 1] = '\n';
+    cell->len = len;
+    cell->sink = LOG_SINK_ACCESS;
+    ring_publish(cell, pos);
+}
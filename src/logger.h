@@ -5,31 +5,71 @@
 #include <errno.h>
 #include <string.h>
 
-#define LOG_DEBUG
-
 enum log_level { DEBUG = 0, INFO, WARNING, ERROR };
 
-static enum log_level this_log_level = DEBUG;
+// lowest level compiled in, set with `make LOG_LEVEL=DEBUG`
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// records queued for the log thread, a power of two
+#define LOG_RING_SLOTS (1 << 12)
+// longest record, longer ones are truncated
+#define LOG_RECORD_LEN 512
+// bytes gathered per write(2)
+#define LOG_BATCH_LEN (1 << 16)
 
-static const char* log_level_str[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+// where a record is written
+enum log_sink { LOG_SINK_STDOUT = 0, LOG_SINK_STDERR, LOG_SINK_ACCESS,
+                LOG_SINK_COUNT };
 
-#ifdef LOG_DEBUG
-#define log_it(output, fmt, level_str, ...)                                 \
-    fprintf(output, "[%s:%u] %s: " fmt "\n", __FILE__, __LINE__, level_str, \
-            ##__VA_ARGS__);
+// disabled levels keep their arguments type checked, but no code is left
+#define LOG_DISCARD(fmt, ...)                              \
+    do {                                                   \
+        if (0)                                             \
+            log_write(DEBUG, NULL, 0, fmt, ##__VA_ARGS__); \
+    } while (0)
+#define LOG_RECORD(level, fmt, ...) \
+    log_write(level, __FILE__, __LINE__, fmt, ##__VA_ARGS__)
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOGGER_DEBUG(fmt, ...) LOG_RECORD(DEBUG, fmt, ##__VA_ARGS__)
 #else
-#define log_it(output, fmt, level_str, ...)                         \
-    if (strcmp(level_str, "DEBUG")) {                               \
-        fprintf(output, "%s: " fmt "\n", level_str, ##__VA_ARGS__); \
-    }
+#define LOGGER_DEBUG(fmt, ...) LOG_DISCARD(fmt, ##__VA_ARGS__)
 #endif
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOGGER_INFO(fmt, ...) LOG_RECORD(INFO, fmt, ##__VA_ARGS__)
+#else
+#define LOGGER_INFO(fmt, ...) LOG_DISCARD(fmt, ##__VA_ARGS__)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_WARNING
+#define LOGGER_WARNING(fmt, ...) LOG_RECORD(WARNING, fmt, ##__VA_ARGS__)
+#else
+#define LOGGER_WARNING(fmt, ...) LOG_DISCARD(fmt, ##__VA_ARGS__)
+#endif
+#define LOGGER_ERROR(fmt, ...) LOG_RECORD(ERROR, fmt, ##__VA_ARGS__)
+
+// level is one of the enum log_level names, resolved by the preprocessor
+#define logger(level, fmt, ...) LOGGER_##level(fmt, ##__VA_ARGS__)
 
-#define logger(level, fmt, ...)                                       \
-    do {                                                              \
-        if (level == ERROR)                                           \
-            log_it(stderr, fmt, log_level_str[level], ##__VA_ARGS__); \
-        if (level < ERROR && level >= this_log_level)                 \
-            log_it(stdout, fmt, log_level_str[level], ##__VA_ARGS__); \
-    } while (0);
+/*
+    function declarations
+ */
+// start the thread writing queued records, earlier records are written
+// synchronously
+int log_init(void);
+// send access records to path, "-" for stdout
+int log_open_access(const char* path);
+// whether access records are written
+int log_access_enabled(void);
+// queue a record, errors go to stderr and the rest to stdout
+void log_write(enum log_level level, const char* file, int line,
+               const char* fmt, ...) __attribute__((format(printf, 4, 5)));
+// queue a line of the access log, newline included
+void log_access(const char* line, size_t len);
 
 #endif
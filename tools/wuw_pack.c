@@ -0,0 +1,397 @@
+// site packer for wuw_server: compiles a directory tree into one bundle the
+// server maps with -p, with the path index, response heads, validators and
+// compressed variants worked out ahead of time
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "http_bundle.h"
+#include "http_encoding.h"
+
+// zlib level of the gzip variants made here, time is no concern offline
+#define PACK_GZIP_LEVEL 9
+// descriptors nftw(3) may hold while walking the tree
+#define PACK_WALK_FDS 32
+
+// a file of the tree and the entry built for it
+typedef struct pack_file_t {
+    char* url;  // path under the root, starting with '/'
+    char* fs;   // path on disk
+    struct stat st;
+    http_bundle_entry_t entry;
+} pack_file_t;
+
+static struct {
+    const char* root;
+    size_t root_len;
+    int level;
+    pack_file_t* files;
+    int count;
+    int cap;
+    FILE* out;
+    // where the next byte goes
+    uint64_t offset;
+    // paths and heads, written after the entries. Entries point into it
+    // relative to its start until then
+    char* strings;
+    size_t strings_len;
+    size_t strings_cap;
+    int variants[BUNDLE_REPS];
+} pack = {
+    .level = PACK_GZIP_LEVEL,
+};
+
+// media type of a url path, as get_content_type of its extension
+static const char* content_type(const char* url) {
+    const char* dot = strrchr(url, '.');
+    if (dot == NULL)
+        return "application/octet-stream";
+    for (int i = 0; content_type_table[i].extension != NULL; i++) {
+        if (!strcasecmp(dot + 1, content_type_table[i].extension))
+            return content_type_table[i].content_type;
+    }
+    return "application/octet-stream";
+}
+
+// same types as http_encoding_compressible
+static int compressible(const char* type) {
+    return !strncmp(type, "text/", 5) ||
+           !strcmp(type, "application/javascript") ||
+           !strcmp(type, "application/json") ||
+           !strcmp(type, "application/xml") || !strcmp(type, "image/svg+xml");
+}
+
+// the tags http_validators_init gives the file, so clients keep their
+// cached copies when a site moves between the tree and a bundle
+static void validators_init(http_validators_t* v, const struct stat* st) {
+    unsigned long long ns =
+        (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+        st->st_mtim.tv_nsec;
+    snprintf(v->etag, sizeof(v->etag), "\"%llx-%llx\"", ns,
+             (unsigned long long)st->st_size);
+    struct tm tm;
+    gmtime_r(&st->st_mtime, &tm);
+    strftime(v->last_modified, sizeof(v->last_modified),
+             "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    v->mtime = st->st_mtime;
+}
+
+// keep len bytes among the strings, returns where they start
+static uint64_t add_string(const char* data, size_t len) {
+    if (pack.strings_len + len > pack.strings_cap) {
+        size_t cap = pack.strings_cap ? pack.strings_cap : (1 << 16);
+        while (cap < pack.strings_len + len)
+            cap *= 2;
+        if ((pack.strings = (char*)realloc(pack.strings, cap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        pack.strings_cap = cap;
+    }
+    memcpy(pack.strings + pack.strings_len, data, len);
+    pack.strings_len += len;
+    return pack.strings_len - len;
+}
+
+static int write_out(const void* data, size_t len) {
+    if (len > 0 && fwrite(data, 1, len, pack.out) != len) {
+        perror("write");
+        return -1;
+    }
+    pack.offset += len;
+    return 0;
+}
+
+// pad the bundle up to the next HTTP_BUNDLE_ALIGN boundary
+static int align_out(void) {
+    static const char zeros[HTTP_BUNDLE_ALIGN];
+    size_t pad = -pack.offset & (HTTP_BUNDLE_ALIGN - 1);
+    return write_out(zeros, pad);
+}
+
+static char* read_file(const char* path, off_t size) {
+    FILE* f = fopen(path, "rb");
+    char* data = (char*)malloc(size > 0 ? size : 1);
+    if (f == NULL || data == NULL || fread(data, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "failed to read %s: %s\n", path, strerror(errno));
+        if (f != NULL)
+            fclose(f);
+        free(data);
+        return NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+// write the content of a representation and record its head
+static int add_rep(http_bundle_rep_t* rep, const char* type,
+                   const char* coding, const char* data, size_t size) {
+    char head[HTTP_RESPONSE_HEAD_MAX];
+    int n;
+    if (coding == NULL)
+        n = snprintf(head, sizeof(head),
+                     "Content-Type: %s\r\n%sAccept-Ranges: bytes\r\n"
+                     "ETag: %s\r\nLast-Modified: %s\r\n"
+                     "Content-Length: %zu\r\n",
+                     type, compressible(type) ? "Vary: Accept-Encoding\r\n" : "",
+                     rep->validators.etag, rep->validators.last_modified, size);
+    else
+        n = snprintf(head, sizeof(head),
+                     "Content-Type: %s\r\nContent-Encoding: %s\r\n"
+                     "Vary: Accept-Encoding\r\nETag: %s\r\n"
+                     "Last-Modified: %s\r\nContent-Length: %zu\r\n",
+                     type, coding, rep->validators.etag,
+                     rep->validators.last_modified, size);
+    rep->head = add_string(head, n);
+    rep->head_len = n;
+    rep->data = pack.offset;
+    rep->size = size;
+    return write_out(data, size);
+}
+
+// add path + suffix as a representation when it is not older than the file
+static int add_sidecar(pack_file_t* f, enum http_bundle_rep which,
+                       const char* type, const char* coding,
+                       const char* suffix) {
+    char sidecar[MAX_PATH_LEN + 8];
+    struct stat st;
+    snprintf(sidecar, sizeof(sidecar), "%s%s", f->fs, suffix);
+    if (stat(sidecar, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_mtime < f->st.st_mtime)
+        return 1;
+    char* data = read_file(sidecar, st.st_size);
+    if (data == NULL)
+        return -1;
+    http_bundle_rep_t* rep = &f->entry.reps[which];
+    validators_init(&rep->validators, &st);
+    int ret = add_rep(rep, type, coding, data, st.st_size);
+    free(data);
+    pack.variants[which]++;
+    return ret;
+}
+
+// gzip the file as the server would, with a tag derived from the file's.
+// Nothing is added when it doesn't shrink
+static int add_gzip(pack_file_t* f, const char* type, const char* data) {
+    if (f->st.st_size < HTTP_GZIP_MIN_SIZE)
+        return 0;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 added to the window bits selects the gzip wrapper
+    if (deflateInit2(&zs, pack.level, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    uLong bound = deflateBound(&zs, f->st.st_size);
+    char* gz = (char*)malloc(bound);
+    int ret = Z_STREAM_ERROR;
+    if (gz != NULL) {
+        zs.next_in = (Bytef*)data;
+        zs.avail_in = f->st.st_size;
+        zs.next_out = (Bytef*)gz;
+        zs.avail_out = bound;
+        ret = deflate(&zs, Z_FINISH);
+    }
+    size_t len = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        free(gz);
+        fprintf(stderr, "failed to compress %s\n", f->fs);
+        return -1;
+    }
+    if (len < (size_t)f->st.st_size) {
+        http_bundle_rep_t* rep = &f->entry.reps[BUNDLE_GZIP];
+        rep->validators = f->entry.reps[BUNDLE_IDENTITY].validators;
+        size_t n = strlen(rep->validators.etag);
+        snprintf(rep->validators.etag + n - 1,
+                 sizeof(rep->validators.etag) - n + 1, "-gz\"");
+        ret = add_rep(rep, type, "gzip", gz, len);
+        pack.variants[BUNDLE_GZIP]++;
+    } else {
+        ret = 0;
+    }
+    free(gz);
+    return ret;
+}
+
+static int add_file(pack_file_t* f) {
+    http_bundle_entry_t* e = &f->entry;
+    size_t len = strlen(f->url);
+    e->hash = http_bundle_hash(f->url, len);
+    e->path_len = len;
+    e->path = add_string(f->url, len + 1);
+    char* data = read_file(f->fs, f->st.st_size);
+    if (data == NULL)
+        return -1;
+    const char* type = content_type(f->url);
+    validators_init(&e->reps[BUNDLE_IDENTITY].validators, &f->st);
+    int ret = add_rep(&e->reps[BUNDLE_IDENTITY], type, NULL, data,
+                      f->st.st_size);
+    // variants as the server picks them for the tree: sidecars first, then
+    // gzip made from the file
+    if (ret == 0 && compressible(type)) {
+        if ((ret = add_sidecar(f, BUNDLE_BR, type, "br", ".br")) > 0)
+            ret = 0;
+        if (ret == 0 &&
+            (ret = add_sidecar(f, BUNDLE_GZIP, type, "gzip", ".gz")) > 0)
+            ret = add_gzip(f, type, data);
+    }
+    free(data);
+    return ret;
+}
+
+static int collect(const char* fpath, const struct stat* st, int type,
+                   struct FTW* ftw) {
+    (void)ftw;
+    const char* url = fpath + pack.root_len;
+    // hidden files are upload leftovers and the like, never served
+    if (type != FTW_F || !S_ISREG(st->st_mode) || strstr(url, "/.") != NULL)
+        return 0;
+    if (strlen(fpath) >= MAX_PATH_LEN) {
+        fprintf(stderr, "skipping %s: path too long\n", fpath);
+        return 0;
+    }
+    if (pack.count == pack.cap) {
+        pack.cap = pack.cap ? pack.cap * 2 : 256;
+        pack.files = (pack_file_t*)realloc(pack.files,
+                                           pack.cap * sizeof(pack_file_t));
+        if (pack.files == NULL) {
+            perror("realloc");
+            return -1;
+        }
+    }
+    pack_file_t* f = &pack.files[pack.count++];
+    memset(f, 0, sizeof(*f));
+    f->url = strdup(url);
+    f->fs = strdup(fpath);
+    f->st = *st;
+    return (f->url == NULL || f->fs == NULL) ? -1 : 0;
+}
+
+static int file_cmp(const void* a, const void* b) {
+    return strcmp(((const pack_file_t*)a)->url, ((const pack_file_t*)b)->url);
+}
+
+// write the index after the content and the header in front of it
+static int write_index(http_bundle_header_t* h) {
+    if (align_out() < 0)
+        return -1;
+    uint32_t buckets = 1;
+    while (buckets <= (uint32_t)pack.count * 2)
+        buckets <<= 1;
+    uint32_t* slots = (uint32_t*)calloc(buckets, sizeof(uint32_t));
+    if (slots == NULL)
+        return -1;
+    for (int i = 0; i < pack.count; i++) {
+        uint32_t s = pack.files[i].entry.hash & (buckets - 1);
+        while (slots[s] != 0)
+            s = (s + 1) & (buckets - 1);
+        slots[s] = i + 1;
+    }
+    h->count = pack.count;
+    h->buckets = buckets;
+    h->slots = pack.offset;
+    int ret = write_out(slots, buckets * sizeof(uint32_t));
+    free(slots);
+    if (ret < 0)
+        return -1;
+    h->entries = pack.offset;
+    uint64_t strings = h->entries + pack.count * sizeof(http_bundle_entry_t);
+    for (int i = 0; i < pack.count; i++) {
+        http_bundle_entry_t* e = &pack.files[i].entry;
+        e->path += strings;
+        for (int r = 0; r < BUNDLE_REPS; r++) {
+            if (e->reps[r].head_len > 0)
+                e->reps[r].head += strings;
+        }
+        if (write_out(e, sizeof(*e)) < 0)
+            return -1;
+    }
+    if (write_out(pack.strings, pack.strings_len) < 0)
+        return -1;
+    h->size = pack.offset;
+    if (fseek(pack.out, 0, SEEK_SET) < 0 ||
+        fwrite(h, sizeof(*h), 1, pack.out) != 1) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-z level] root bundle\n"
+            "  -z level   zlib level of generated gzip variants (default %d)\n"
+            "  root       directory served, e.g. htdocs\n"
+            "  bundle     file to write, replaced atomically\n",
+            prog, PACK_GZIP_LEVEL);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "z:h")) != -1) {
+        switch (opt) {
+            case 'z': pack.level = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind != 2 || pack.level < 1 || pack.level > 9) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* bundle = argv[optind + 1];
+    // urls are what follows the root in the walked paths
+    char* root = argv[optind];
+    pack.root_len = strlen(root);
+    while (pack.root_len > 1 && root[pack.root_len - 1] == '/')
+        root[--pack.root_len] = '\0';
+    pack.root = root;
+    if (nftw(pack.root, collect, PACK_WALK_FDS, FTW_PHYS) < 0) {
+        fprintf(stderr, "failed to walk %s: %s\n", pack.root, strerror(errno));
+        return 1;
+    }
+    // sorted so the same tree always packs the same way
+    qsort(pack.files, pack.count, sizeof(pack_file_t), file_cmp);
+
+    // written next to the bundle and renamed over it once complete
+    char temp[MAX_PATH_LEN];
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", bundle);
+    int fd = mkstemp(temp);
+    if (fd < 0 || (pack.out = fdopen(fd, "wb")) == NULL) {
+        fprintf(stderr, "failed to create %s: %s\n", temp, strerror(errno));
+        return 1;
+    }
+    http_bundle_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, HTTP_BUNDLE_MAGIC, sizeof(HTTP_BUNDLE_MAGIC));
+    h.version = HTTP_BUNDLE_VERSION;
+    h.entry_size = sizeof(http_bundle_entry_t);
+    int ret = write_out(&h, sizeof(h));
+    if (ret == 0 && (ret = align_out()) == 0)
+        h.content = pack.offset;
+    for (int i = 0; ret == 0 && i < pack.count; i++)
+        ret = add_file(&pack.files[i]);
+    if (ret == 0)
+        ret = write_index(&h);
+    if (ret == 0 && (fflush(pack.out) != 0 || fsync(fd) < 0 ||
+                     fchmod(fd, 0644) < 0)) {
+        perror(temp);
+        ret = -1;
+    }
+    fclose(pack.out);
+    if (ret == 0 && rename(temp, bundle) < 0) {
+        fprintf(stderr, "failed to rename %s: %s\n", temp, strerror(errno));
+        ret = -1;
+    }
+    if (ret < 0) {
+        unlink(temp);
+        return 1;
+    }
+    printf("%s: %d files, %d gzip and %d br variants, %llu bytes\n", bundle,
+           pack.count, pack.variants[BUNDLE_GZIP], pack.variants[BUNDLE_BR],
+           (unsigned long long)h.size);
+    return 0;
+}